@@ -88,6 +88,11 @@ void update_shape_bvh(shape_bvh& bvh, const shape_data& shape);
 void update_scene_bvh(scene_bvh& bvh, const scene_data& scene,
     const vector<int>& updated_instances, const vector<int>& updated_shapes);
 
+// Rebuild the instances bvh only, reusing the shapes bvh already present in
+// `bvh.shapes` (one per scene shape).
+void rebuild_scene_bvh(
+    scene_bvh& bvh, const scene_data& scene, bool highquality = false);
+
 // Results of intersect_xxx and overlap_xxx functions that include hit flag,
 // instance id, shape element id, shape element uv and intersection distance.
 // The values are all set for scene intersection. Shape intersection does not
@@ -99,6 +104,12 @@ struct scene_intersection {
   vec2f uv       = {0, 0};
   float distance = 0;
   bool  hit      = false;
+  // Set by custom intersection functions (see trace_bvh), for geometry that
+  // is not stored as shapes: the hit point is then given directly.
+  bool  custom   = false;
+  vec3f position = {0, 0, 0};
+  vec3f normal   = {0, 0, 1};
+  vec4f color    = {1, 1, 1, 1};
 };
 
 // Intersect ray with a bvh returning either the first or any intersection
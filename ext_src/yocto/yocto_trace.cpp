@@ -97,12 +97,18 @@ trace_bvh make_trace_bvh(const scene_data& scene, const trace_params& params) {
 
 // Ray-intersection shortcuts
 static scene_intersection intersect_scene(const trace_bvh& bvh,
-    const scene_data& scene, const ray3f& ray, bool find_any = false) {
-  if (bvh.ebvh.ebvh) {
-    return intersect_scene_ebvh(bvh.ebvh, scene, ray, find_any);
-  } else {
-    return intersect_scene_bvh(bvh.bvh, scene, ray, find_any);
+    const scene_data& scene, const ray3f& ray_, bool find_any = false) {
+  auto ray          = ray_;
+  auto intersection = scene_intersection{};
+  if (bvh.custom) {
+    intersection = bvh.custom(ray, find_any);
+    if (intersection.hit && find_any) return intersection;
+    if (intersection.hit) ray.tmax = intersection.distance;
   }
+  auto shapes_intersection = bvh.ebvh.ebvh
+      ? intersect_scene_ebvh(bvh.ebvh, scene, ray, find_any)
+      : intersect_scene_bvh(bvh.bvh, scene, ray, find_any);
+  return shapes_intersection.hit ? shapes_intersection : intersection;
 }
 static scene_intersection intersect_instance(const trace_bvh& bvh,
     const scene_data& scene, int instance, const ray3f& ray,
@@ -124,36 +130,50 @@ namespace yocto {
 // Convenience functions
 [[maybe_unused]] static vec3f eval_position(
     const scene_data& scene, const scene_intersection& intersection) {
+  if (intersection.custom) return intersection.position;
   return eval_position(scene, scene.instances[intersection.instance],
       intersection.element, intersection.uv);
 }
 [[maybe_unused]] static vec3f eval_normal(
     const scene_data& scene, const scene_intersection& intersection) {
+  if (intersection.custom) return intersection.normal;
   return eval_normal(scene, scene.instances[intersection.instance],
       intersection.element, intersection.uv);
 }
 [[maybe_unused]] static vec3f eval_element_normal(
     const scene_data& scene, const scene_intersection& intersection) {
+  if (intersection.custom) return intersection.normal;
   return eval_element_normal(
       scene, scene.instances[intersection.instance], intersection.element);
 }
 [[maybe_unused]] static vec3f eval_shading_position(const scene_data& scene,
     const scene_intersection& intersection, const vec3f& outgoing) {
+  if (intersection.custom) return intersection.position;
   return eval_shading_position(scene, scene.instances[intersection.instance],
       intersection.element, intersection.uv, outgoing);
 }
 [[maybe_unused]] static vec3f eval_shading_normal(const scene_data& scene,
     const scene_intersection& intersection, const vec3f& outgoing) {
+  if (intersection.custom) {
+    auto& normal = intersection.normal;
+    return dot(normal, outgoing) >= 0 ? normal : -normal;
+  }
   return eval_shading_normal(scene, scene.instances[intersection.instance],
       intersection.element, intersection.uv, outgoing);
 }
 [[maybe_unused]] static vec2f eval_texcoord(
     const scene_data& scene, const scene_intersection& intersection) {
+  if (intersection.custom) return {0, 0};
   return eval_texcoord(scene, scene.instances[intersection.instance],
       intersection.element, intersection.uv);
 }
 [[maybe_unused]] static material_point eval_material(
     const scene_data& scene, const scene_intersection& intersection) {
+  if (intersection.custom) {
+    auto& instance = scene.instances[intersection.instance];
+    return eval_material(scene, scene.materials[instance.material], {0, 0},
+        intersection.color);
+  }
   return eval_material(scene, scene.instances[intersection.instance],
       intersection.element, intersection.uv);
 }
@@ -678,12 +698,8 @@ static trace_result trace_pathdirect(const scene_data& scene,
           auto emission =
               !intersection.hit
                   ? eval_environment(scene, incoming)
-                  : eval_emission(eval_material(scene,
-                                      scene.instances[intersection.instance],
-                                      intersection.element, intersection.uv),
-                        eval_shading_normal(scene,
-                            scene.instances[intersection.instance],
-                            intersection.element, intersection.uv, -incoming),
+                  : eval_emission(eval_material(scene, intersection),
+                        eval_shading_normal(scene, intersection, -incoming),
                         -incoming);
           radiance += weight * bsdfcos * emission / pdf;
         }
@@ -873,13 +889,9 @@ static trace_result trace_pathmis(const scene_data& scene, const trace_bvh& bvh,
             if (!intersection.hit) {
               emission = eval_environment(scene, incoming);
             } else {
-              auto material = eval_material(scene,
-                  scene.instances[intersection.instance], intersection.element,
-                  intersection.uv);
+              auto material = eval_material(scene, intersection);
               emission      = eval_emission(material,
-                       eval_shading_normal(scene,
-                           scene.instances[intersection.instance],
-                           intersection.element, intersection.uv, -incoming),
+                       eval_shading_normal(scene, intersection, -incoming),
                        -incoming);
             }
             radiance += weight * bsdfcos * emission * mis_weight;
@@ -1274,13 +1286,10 @@ static trace_result trace_furnace(const scene_data& scene, const trace_bvh& bvh,
     }
 
     // prepare shading point
-    auto  outgoing = -ray.d;
-    auto& instance = scene.instances[intersection.instance];
-    auto  element  = intersection.element;
-    auto  uv       = intersection.uv;
-    auto  position = eval_position(scene, instance, element, uv);
-    auto  normal = eval_shading_normal(scene, instance, element, uv, outgoing);
-    auto  material = eval_material(scene, instance, element, uv);
+    auto outgoing = -ray.d;
+    auto position = eval_position(scene, intersection);
+    auto normal   = eval_shading_normal(scene, intersection, outgoing);
+    auto material = eval_material(scene, intersection);
 
     // handle opacity
     if (material.opacity < 1 && rand1f(rng) >= material.opacity) {
@@ -38,6 +38,7 @@
 // -----------------------------------------------------------------------------
 
 #include <atomic>
+#include <functional>
 #include <future>
 #include <memory>
 #include <string>
@@ -135,9 +136,14 @@ struct trace_lights {
 };
 
 // Trace Bvh, a wrapper of a Yocto/Bvh and an Embree one
+// An optional custom intersection function can be added for geometry that
+// is not stored in the scene shapes.  Its hits must set `custom` and
+// reference an instance for the material.
 struct trace_bvh {
   scene_bvh  bvh  = {};
   scene_ebvh ebvh = {};
+  std::function<scene_intersection(const ray3f& ray, bool find_any)> custom =
+      {};
 };
 
 // Check is a sampler requires lights
@@ -18,7 +18,7 @@
 
 /* This file is autogenerated by tools/create_assets.py */
 
-{.path = "data/scripts/test.js", .size = 1608, .data =
+{.path = "data/scripts/test.js", .size = 2822, .data =
     "\n"
     "import * as std from 'std'\n"
     "\n"
@@ -67,8 +67,10 @@
     "  onExecute: function() {\n"
     "    let box = goxel.image.selectionBox\n"
     "    let volume = goxel.image.activeLayer.volume\n"
-    "    box.iterVoxels(function(pos) {\n"
-    "      volume.setAt(pos, getRandomColor())\n"
+    "    volume.fill(box, function(pos, data) {\n"
+    "      for (let i = 0; i < data.length; i += 4) {\n"
+    "        data.set(getRandomColor(), i)\n"
+    "      }\n"
     "    })\n"
     "  }\n"
     "})\n"
@@ -77,15 +79,7 @@
     "  name: 'Dilate',\n"
     "  onExecute: function() {\n"
     "    let volume = goxel.image.activeLayer.volume\n"
-    "    volume.copy().iter(function(pos, color) {\n"
-    "      for (let z = -1; z < 2; z++) {\n"
-    "        for (let y = -1; y < 2; y++) {\n"
-    "          for (let x = -1; x < 2; x++) {\n"
-    "            volume.setAt([pos.x + x, pos.y + y, pos.z + z], color)\n"
-    "          }\n"
-    "        }\n"
-    "      }\n"
-    "    })\n"
+    "    volume.dilate(1, 'cube')\n"
     "  }\n"
     "})\n"
     "\n"
@@ -0,0 +1,68 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024-present Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+/*
+ * Filter to apply morphology operations (dilate, erode...) to the current
+ * layer.
+ */
+
+typedef struct {
+    filter_t filter;
+    int op;
+    int shape;
+    int radius;
+} filter_morphology_t;
+
+static void on_open(filter_t *filter_)
+{
+    filter_morphology_t *filter = (void*)filter_;
+    if (!filter->radius) filter->radius = 1;
+}
+
+static int gui(filter_t *filter_)
+{
+    filter_morphology_t *filter = (void*)filter_;
+    const char *ops[] = {_("Dilate"), _("Erode"), _("Open"), _("Close"),
+                         _("Hollow")};
+    const char *shapes[] = {_("Sphere"), _("Cube"), _("Cylinder")};
+    const shape_t *shapes_ptr[] = {&shape_sphere, &shape_cube,
+                                   &shape_cylinder};
+    layer_t *layer = goxel.image->active_layer;
+
+    gui_group_begin(NULL);
+    gui_combo(_("Operation"), &filter->op, ops, ARRAY_SIZE(ops));
+    gui_combo(_("Shape"), &filter->shape, shapes, ARRAY_SIZE(shapes));
+    if (gui_input_int(_("Radius"), &filter->radius, 1, TILE_SIZE))
+        filter->radius = clamp(filter->radius, 1, TILE_SIZE);
+    gui_group_end();
+
+    if (gui_button(_("Apply"), -1, 0)) {
+        volume_morphology(layer->volume, filter->op,
+                          shapes_ptr[filter->shape], filter->radius);
+        image_history_push(goxel.image);
+    }
+    return 0;
+}
+
+FILTER_REGISTER(morphology, filter_morphology_t,
+    .name = "Morphology",
+    .on_open = on_open,
+    .gui_fn = gui,
+)
@@ -20,6 +20,9 @@
 
 #include "file_format.h"
 #include "utils/vec.h"
+#include "../ext_src/stb/stb_ds.h"
+
+#include <errno.h>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-truncation"
@@ -28,12 +31,6 @@
 #include "../ext_src/cgltf/cgltf_write.h"
 #pragma GCC diagnostic pop
 
-typedef struct {
-    cgltf_data *data;
-    palette_t palette;
-    cgltf_material *default_mat;
-} gltf_t;
-
 typedef struct {
     float   pos[3];
     float   normal[3];
@@ -45,12 +42,80 @@ typedef struct {
     };
 } gltf_vertex_t;
 
+// Vertex used with the quantize option (KHR_mesh_quantization).
+typedef struct {
+    int16_t pos[4];
+    int8_t  normal[4];
+    union {
+        uint16_t color[4];
+        uint16_t texcoord[2];
+    };
+} gltf_qvertex_t;
+
+#define MAX_LODS 3
+
+// A mesh placed in a layer.
+typedef struct {
+    cgltf_mesh *mesh;
+    int pos_scale;  // Scale of the quantized positions, or zero.
+    int pos[3];     // Translation, in voxels.
+    int lod;        // Level of detail: the mesh voxels are 2^lod large.
+} gltf_instance_t;
+
+// A level of detail mesh of a layer, computed in parallel.
+typedef struct {
+    const layer_t *layer;
+    int level;
+    volume_t *volume;           // Downsampled volume.
+    const palette_t *palette;
+    float simplify;
+    volume_mesh_t *mesh;
+    gltf_instance_t instance;   // Set once the mesh has been saved.
+} lod_job_t;
+
+// The MSFT_lod extension of a node, added to the json after cgltf_write.
+typedef struct {
+    int node;
+    int nb;
+    int ids[MAX_LODS];
+} node_lods_t;
+
+// Use as stb_ds hash key, so we store the material index and not its
+// pointer, whose high bytes overflow the stb_ds hash function.
+typedef struct {
+    uint64_t ids[27];
+    uint64_t material;  // Material index + 1, or 0 for the default one.
+} tile_key_t;
+
+typedef struct {
+    cgltf_data *data;
+    palette_t palette;
+    cgltf_material *default_mat;
+    // Content of the unique binary buffer.
+    uint8_t *bin;
+    size_t bin_size;
+    size_t bin_capacity;
+    bool quantized; // Set if any mesh uses KHR_mesh_quantization.
+    // Shared meshes of the repeated tiles.
+    struct { tile_key_t key; gltf_instance_t value; } *tiles_meshes;
+    // Instances of the saved layers, indexed by layer id.
+    struct { int key; gltf_instance_t *value; } *layers_instances;
+    lod_job_t *lod_jobs;
+    node_lods_t *nodes_lods; // Nodes using MSFT_lod, in nodes order.
+} gltf_t;
+
 typedef struct {
     bool vertex_color;
     float simplify;
+    bool quantize;
+    bool instancing;
+    int lods; // Number of extra levels of detail, up to MAX_LODS.
+    bool binary; // Save as glb.
 } export_options_t;
 
-static export_options_t g_export_options = {};
+static export_options_t g_export_options = {
+    .instancing = true,
+};
 
 
 // Return the next power of 2 larger or equal to x.
@@ -124,41 +189,95 @@ static char *data_new(const void *data, uint32_t len, const char *mime)
         }                                                                     \
     })
 
+// Return the base layer of a clone layer, or NULL.
+static const layer_t *get_base_layer(const image_t *img,
+                                     const layer_t *layer)
+{
+    const layer_t *base;
+    if (!layer->base_id) return NULL;
+    DL_FOREACH(img->layers, base) {
+        if (base->id == layer->base_id) return base;
+    }
+    return NULL;
+}
+
+static int count_tiles(const volume_t *volume)
+{
+    volume_iterator_t iter;
+    int bpos[3], ret = 0;
+
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+    while (volume_iter(&iter, bpos)) ret++;
+    return ret;
+}
+
 static void gltf_init(gltf_t *g, const export_options_t *options,
                       const image_t *img)
 {
-    const layer_t *layer;
-    volume_iterator_t iter;
-    int bpos[3], nb_blocks = 0;
+    const layer_t *layer, *base;
+    int n, nb_blocks = 0, nb_nodes = 1, nb_meshes;
 
     g->data = calloc(1, sizeof(*g->data));
     g->data->memory.free_func = &cgltf_default_free;
     g->data->asset.version = strdup("2.0");
     g->data->asset.generator = strdup("goxel");
 
-    // Count the total number of blocks.
+    // Count the total number of blocks.  Each layer can use one mesh per
+    // block plus one merged mesh, and clone layers can have a node for
+    // each of their base layer meshes.  Each level of detail adds one
+    // mesh and up to two nodes per layer.
     DL_FOREACH(img->layers, layer) {
-        iter = volume_get_iterator(layer->volume,
-                VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
-        while (volume_iter(&iter, bpos)) {
-            nb_blocks++;
-        }
+        n = count_tiles(layer->volume);
+        nb_blocks += n;
+        base = get_base_layer(img, layer);
+        if (base) n = max(n, count_tiles(base->volume));
+        nb_nodes += n + 2 + options->lods * 2;
     }
+    nb_meshes = nb_blocks + DL_SIZE(img->layers) * (1 + options->lods);
 
     // Initialize all the gltf base object arrays.
     ALLOC(g->data->materials, DL_SIZE(img->materials) + 1);
     ALLOC(g->data->scenes, 1);
-    ALLOC(g->data->nodes, 1 + nb_blocks + DL_SIZE(img->layers));
-    ALLOC(g->data->meshes, nb_blocks);
-    ALLOC(g->data->accessors, nb_blocks * 4);
-    ALLOC(g->data->buffers, nb_blocks * 2 + 1);
-    ALLOC(g->data->buffer_views, nb_blocks * 2 + 1);
+    ALLOC(g->data->nodes, nb_nodes);
+    ALLOC(g->data->meshes, nb_meshes);
+    ALLOC(g->data->accessors, nb_meshes * 4);
+    ALLOC(g->data->buffers, 1);
+    ALLOC(g->data->buffer_views, nb_meshes * 2 + 1);
     ALLOC(g->data->images, 1);
     ALLOC(g->data->textures, 1);
 }
 
 #define add_item(data, list) ({ &(data)->list[(data)->list##_count++]; })
 
+/*
+ * Reserve size bytes at the end of the binary buffer and create a buffer
+ * view for them.  Return a pointer to the reserved data, that stays valid
+ * until the next call.
+ */
+static void *add_buffer_view(gltf_t *g, size_t size, int stride,
+                             cgltf_buffer_view_type type,
+                             cgltf_buffer_view **view)
+{
+    size_t ofs;
+    // Keep all the views 4 bytes aligned, as required for vertex data.
+    ofs = (g->bin_size + 3) & ~(size_t)3;
+    if (ofs + size > g->bin_capacity) {
+        g->bin_capacity = max(ofs + size, g->bin_capacity * 2);
+        g->bin = realloc(g->bin, g->bin_capacity);
+    }
+    memset(g->bin + g->bin_size, 0, ofs - g->bin_size);
+    g->bin_size = ofs + size;
+
+    *view = add_item(g->data, buffer_views);
+    (*view)->buffer = &g->data->buffers[0];
+    (*view)->offset = ofs;
+    (*view)->size = size;
+    (*view)->stride = stride;
+    (*view)->type = type;
+    return g->bin + ofs;
+}
+
 // Create a buffer view and attribute.
 static void make_attribute(gltf_t *g, cgltf_buffer_view *buffer_view,
                            cgltf_primitive *primitive,
@@ -240,100 +359,471 @@ static cgltf_material *get_default_mat(
     return g->default_mat;
 }
 
-static void save_layer(gltf_t *g, cgltf_node *root_node,
-                       const image_t *img, const layer_t *layer,
-                       const palette_t *palette,
-                       int palette_pix_size,
-                       const export_options_t *options)
+/*
+ * Return the smallest scale factor k such that all the vertices positions
+ * multiplied by k are integers that fit in an int16, or zero if there is
+ * none.  Since the voxel meshes vertices are on a regular grid, this
+ * usually succeeds with k = 1 or 2.
+ */
+static int get_pos_scale(const volume_mesh_t *mesh)
 {
-    volume_mesh_t *mesh;
+    int i, j, k;
+    float v, r;
+
+    r = 0;
+    for (i = 0; i < 3; i++) {
+        r = max(r, fabsf(mesh->pos_min[i]));
+        r = max(r, fabsf(mesh->pos_max[i]));
+    }
+    for (k = 1; k <= 16 && r * k <= INT16_MAX; k *= 2) {
+        for (i = 0; i < mesh->vertices_count; i++) {
+            for (j = 0; j < 3; j++) {
+                v = mesh->vertices[i].pos[j] * k;
+                if (v != roundf(v)) break;
+            }
+            if (j < 3) break;
+        }
+        if (i == mesh->vertices_count) return k;
+    }
+    return 0;
+}
+
+// Save the vertices using the types allowed by KHR_mesh_quantization:
+// int16 positions (scaled by pos_scale), normalized int8 normals, and
+// normalized uint16 colors or texture coordinates.
+static void save_quantized_vertices(
+        gltf_t *g, const volume_mesh_t *mesh, cgltf_primitive *primitive,
+        int pos_scale, const export_options_t *options)
+{
+    int i, j;
+    gltf_qvertex_t *vertices;
+    cgltf_buffer_view *buffer_view;
+    float pos_min[3], pos_max[3];
+
+    vertices = add_buffer_view(
+            g, mesh->vertices_count * sizeof(*vertices), sizeof(*vertices),
+            cgltf_buffer_view_type_vertices, &buffer_view);
+    memset(vertices, 0, mesh->vertices_count * sizeof(*vertices));
+    for (i = 0; i < mesh->vertices_count; i++) {
+        for (j = 0; j < 3; j++) {
+            vertices[i].pos[j] = roundf(mesh->vertices[i].pos[j] * pos_scale);
+            vertices[i].normal[j] =
+                roundf(clamp(mesh->vertices[i].normal[j], -1, 1) * 127);
+        }
+        if (options->vertex_color) {
+            for (j = 0; j < 4; j++) {
+                vertices[i].color[j] = roundf(
+                        clamp(mesh->vertices[i].color[j], 0, 1) * 65535);
+            }
+        } else {
+            for (j = 0; j < 2; j++) {
+                vertices[i].texcoord[j] = roundf(
+                        clamp(mesh->vertices[i].texcoord[j], 0, 1) * 65535);
+            }
+        }
+    }
+    vec3_mul(mesh->pos_min, pos_scale, pos_min);
+    vec3_mul(mesh->pos_max, pos_scale, pos_max);
+
+    make_attribute(g, buffer_view, primitive,
+                   "POSITION", cgltf_component_type_r_16, cgltf_type_vec3,
+                   false, mesh->vertices_count,
+                   offsetof(gltf_qvertex_t, pos), pos_min, pos_max);
+    make_attribute(g, buffer_view, primitive,
+                   "NORMAL", cgltf_component_type_r_8, cgltf_type_vec3,
+                   true, mesh->vertices_count,
+                   offsetof(gltf_qvertex_t, normal), NULL, NULL);
+    if (options->vertex_color) {
+        make_attribute(g, buffer_view, primitive,
+                       "COLOR_0", cgltf_component_type_r_16u,
+                       cgltf_type_vec4, true, mesh->vertices_count,
+                       offsetof(gltf_qvertex_t, color), NULL, NULL);
+    } else {
+        make_attribute(g, buffer_view, primitive,
+                       "TEXCOORD_0", cgltf_component_type_r_16u,
+                       cgltf_type_vec2, true, mesh->vertices_count,
+                       offsetof(gltf_qvertex_t, texcoord), NULL, NULL);
+    }
+    g->quantized = true;
+}
+
+// Save a mesh and return it as an instance at the origin.
+static gltf_instance_t save_mesh(gltf_t *g, const image_t *img,
+                                 const volume_mesh_t *mesh,
+                                 const material_t *material,
+                                 const export_options_t *options)
+{
+    gltf_instance_t ret = {};
     cgltf_mesh *gmesh;
-    cgltf_node *node;
     cgltf_primitive *primitive;
-    cgltf_buffer *buffer;
     cgltf_buffer_view *buffer_view;
     cgltf_accessor *accessor;
-
-    mesh = volume_generate_mesh(
-            layer->volume, goxel.rend.settings.effects, palette,
-            g_export_options.simplify);
-
-    if (mesh->vertices_count == 0) return;
+    void *vertices;
+    uint16_t *indices16;
+    int i;
 
     gmesh = add_item(g->data, meshes);
     ALLOC(gmesh->primitives, 1);
     primitive = add_item(gmesh, primitives);
     primitive->type = cgltf_primitive_type_triangles;
     ALLOC(primitive->attributes, 3);
-    if (layer->material) {
+    if (material) {
         primitive->material = g->data->materials +
-                              get_material_idx(img, layer->material);
+                              get_material_idx(img, material);
     } else {
         primitive->material = get_default_mat(g, options);
     }
 
 
-    buffer = add_item(g->data, buffers);
-    buffer->size = mesh->vertices_count * sizeof(*mesh->vertices);
-    buffer->uri = data_new(mesh->vertices, buffer->size, NULL);
-    buffer_view = add_item(g->data, buffer_views);
-    buffer_view->buffer = buffer;
-    buffer_view->size = buffer->size;
-    buffer_view->stride = sizeof(*mesh->vertices);
-    buffer_view->type = cgltf_buffer_view_type_vertices;
-
-    make_attribute(
-            g, buffer_view, primitive,
-            "POSITION",
-            cgltf_component_type_r_32f,
-            cgltf_type_vec3, false,
-            mesh->vertices_count, offsetof(typeof(*mesh->vertices), pos),
-            mesh->pos_min, mesh->pos_max);
-    make_attribute(
-            g, buffer_view, primitive,
-            "NORMAL",
-            cgltf_component_type_r_32f,
-            cgltf_type_vec3, false,
-            mesh->vertices_count, offsetof(typeof(*mesh->vertices), normal),
-            NULL, NULL);
-    if (options->vertex_color) {
-        make_attribute(g, buffer_view, primitive,
-                       "COLOR_0",
-                       cgltf_component_type_r_32f,
-                       cgltf_type_vec4, false,
-                       mesh->vertices_count,
-                       offsetof(typeof(*mesh->vertices), color),
-                       NULL, NULL);
+    if (options->quantize) ret.pos_scale = get_pos_scale(mesh);
+    if (ret.pos_scale) {
+        save_quantized_vertices(g, mesh, primitive, ret.pos_scale, options);
     } else {
-        make_attribute(g, buffer_view, primitive,
-                       "TEXCOORD_0",
-                       cgltf_component_type_r_32f, cgltf_type_vec2, false,
-                       mesh->vertices_count,
-                       offsetof(typeof(*mesh->vertices), texcoord),
-                       NULL, NULL);
+        vertices = add_buffer_view(
+                g, mesh->vertices_count * sizeof(*mesh->vertices),
+                sizeof(*mesh->vertices), cgltf_buffer_view_type_vertices,
+                &buffer_view);
+        memcpy(vertices, mesh->vertices,
+               mesh->vertices_count * sizeof(*mesh->vertices));
+        make_attribute(
+                g, buffer_view, primitive,
+                "POSITION",
+                cgltf_component_type_r_32f,
+                cgltf_type_vec3, false,
+                mesh->vertices_count, offsetof(typeof(*mesh->vertices), pos),
+                mesh->pos_min, mesh->pos_max);
+        make_attribute(
+                g, buffer_view, primitive,
+                "NORMAL",
+                cgltf_component_type_r_32f,
+                cgltf_type_vec3, false,
+                mesh->vertices_count,
+                offsetof(typeof(*mesh->vertices), normal),
+                NULL, NULL);
+        if (options->vertex_color) {
+            make_attribute(g, buffer_view, primitive,
+                           "COLOR_0",
+                           cgltf_component_type_r_32f,
+                           cgltf_type_vec4, false,
+                           mesh->vertices_count,
+                           offsetof(typeof(*mesh->vertices), color),
+                           NULL, NULL);
+        } else {
+            make_attribute(g, buffer_view, primitive,
+                           "TEXCOORD_0",
+                           cgltf_component_type_r_32f, cgltf_type_vec2, false,
+                           mesh->vertices_count,
+                           offsetof(typeof(*mesh->vertices), texcoord),
+                           NULL, NULL);
+        }
     }
 
-    buffer = add_item(g->data, buffers);
-    buffer->size = mesh->indices_count * sizeof(*mesh->indices);
-    buffer->uri = data_new(mesh->indices, buffer->size, NULL);
-    buffer_view = add_item(g->data, buffer_views);
-    buffer_view->buffer = buffer;
-    buffer_view->size = buffer->size;
-    buffer_view->type = cgltf_buffer_view_type_indices;
-
+    // Use 16 bits indices when possible.  Note: the max value of a type
+    // is reserved for primitive restart, so we cannot use it.
     accessor = add_item(g->data, accessors);
+    if (mesh->vertices_count < 0xffff) {
+        indices16 = add_buffer_view(
+                g, mesh->indices_count * sizeof(*indices16), 0,
+                cgltf_buffer_view_type_indices, &buffer_view);
+        for (i = 0; i < mesh->indices_count; i++)
+            indices16[i] = mesh->indices[i];
+        accessor->component_type = cgltf_component_type_r_16u;
+    } else {
+        memcpy(add_buffer_view(
+                g, mesh->indices_count * sizeof(*mesh->indices), 0,
+                cgltf_buffer_view_type_indices, &buffer_view),
+               mesh->indices, mesh->indices_count * sizeof(*mesh->indices));
+        accessor->component_type = cgltf_component_type_r_32u;
+    }
     accessor->buffer_view = buffer_view;
-    accessor->component_type = cgltf_component_type_r_32u;
     accessor->count = mesh->indices_count;
     accessor->type = cgltf_type_scalar;
     primitive->indices = accessor;
 
+    ret.mesh = gmesh;
+    return ret;
+}
+
+// Get the key used to share the mesh of a tile.  Since the tile mesh
+// depends on the adjacent tiles, the key uses all of them.
+static void get_tile_key(const image_t *img, const volume_t *volume,
+                         const int pos[3], const material_t *material,
+                         tile_key_t *key)
+{
+    int i = 0, x, y, z;
+
+    memset(key, 0, sizeof(*key));
+    key->material = material ? get_material_idx(img, material) + 1 : 0;
+    for (z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++) {
+        volume_get_tile_data(volume, NULL, (int[]){pos[0] + x * TILE_SIZE,
+                             pos[1] + y * TILE_SIZE, pos[2] + z * TILE_SIZE},
+                             &key->ids[i++]);
+    }
+}
+
+// Save a single tile mesh, with the positions relative to the tile.
+static gltf_instance_t save_tile_mesh(gltf_t *g, const image_t *img,
+                                      const layer_t *layer, const int pos[3],
+                                      const palette_t *palette,
+                                      const export_options_t *options)
+{
+    volume_mesh_t *mesh;
+    gltf_instance_t ret = {};
+    int i, j;
+
+    mesh = volume_generate_tiles_mesh(
+            layer->volume, goxel.rend.settings.effects, palette,
+            options->simplify, (const int (*)[3])pos, 1);
+    if (mesh->vertices_count) {
+        for (i = 0; i < mesh->vertices_count; i++) {
+            for (j = 0; j < 3; j++) mesh->vertices[i].pos[j] -= pos[j];
+        }
+        for (j = 0; j < 3; j++) {
+            mesh->pos_min[j] -= pos[j];
+            mesh->pos_max[j] -= pos[j];
+        }
+        ret = save_mesh(g, img, mesh, layer->material, options);
+    }
+    volume_mesh_free(mesh);
+    return ret;
+}
+
+/*
+ * Save the meshes of a layer and return the list of instances that make
+ * it.  Tiles that appear several times (with the same neighbors) in the
+ * layers get their own shared mesh, all the others are merged into a
+ * single mesh.  The result is kept so that clone layers can reuse it.
+ */
+static gltf_instance_t *get_layer_instances(
+        gltf_t *g, const image_t *img, const layer_t *layer,
+        const palette_t *palette, const export_options_t *options)
+{
+    volume_iterator_t iter;
+    volume_mesh_t *mesh;
+    gltf_instance_t *instances = NULL, inst;
+    tile_key_t key, *keys = NULL;
+    struct { tile_key_t key; int value; } *counts = NULL;
+    int i, pos[3], (*tiles)[3] = NULL, (*merged)[3] = NULL;
+
+    i = hmgeti(g->layers_instances, layer->id);
+    if (i >= 0) return g->layers_instances[i].value;
+
+    if (options->instancing) {
+        iter = volume_get_iterator(layer->volume,
+                VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+        while (volume_iter(&iter, pos)) {
+            get_tile_key(img, layer->volume, pos, layer->material, &key);
+            memcpy(arraddnptr(tiles, 1), pos, sizeof(pos));
+            arrput(keys, key);
+            i = hmget(counts, key);
+            hmput(counts, key, i + 1);
+        }
+        for (i = 0; i < arrlen(tiles); i++) {
+            if (hmget(counts, keys[i]) < 2 &&
+                    hmgeti(g->tiles_meshes, keys[i]) < 0) {
+                memcpy(arraddnptr(merged, 1), tiles[i], sizeof(*tiles));
+                continue;
+            }
+            if (hmgeti(g->tiles_meshes, keys[i]) < 0) {
+                hmput(g->tiles_meshes, keys[i], save_tile_mesh(
+                            g, img, layer, tiles[i], palette, options));
+            }
+            inst = hmget(g->tiles_meshes, keys[i]);
+            if (!inst.mesh) continue;
+            memcpy(inst.pos, tiles[i], sizeof(inst.pos));
+            arrput(instances, inst);
+        }
+        mesh = volume_generate_tiles_mesh(
+                layer->volume, goxel.rend.settings.effects, palette,
+                options->simplify, merged, arrlen(merged));
+    } else {
+        mesh = volume_generate_mesh(
+                layer->volume, goxel.rend.settings.effects, palette,
+                options->simplify);
+    }
+
+    if (mesh->vertices_count) {
+        arrins(instances, 0, save_mesh(g, img, mesh, layer->material,
+                                       options));
+    }
+    volume_mesh_free(mesh);
+    arrfree(tiles);
+    arrfree(merged);
+    arrfree(keys);
+    hmfree(counts);
+    hmput(g->layers_instances, layer->id, instances);
+    return instances;
+}
+
+// Setup a node to render an instance.
+static void set_instance_node(cgltf_node *node, const gltf_instance_t *inst)
+{
+    float k;
+    node->mesh = inst->mesh;
+    if (inst->pos[0] || inst->pos[1] || inst->pos[2]) {
+        vec3_set(node->translation, inst->pos[0], inst->pos[1], inst->pos[2]);
+        node->has_translation = true;
+    }
+    k = (float)(1 << inst->lod) / max(inst->pos_scale, 1);
+    if (k != 1) {
+        vec3_set(node->scale, k, k, k);
+        node->has_scale = true;
+    }
+}
+
+/*
+ * Return the base layer of a clone layer if it can reuse its meshes, that
+ * is when the clone is an exact copy of it, and set the transformation
+ * from the base meshes.  Return NULL otherwise.
+ */
+static const layer_t *get_instanced_base(const image_t *img,
+                                         const layer_t *layer,
+                                         const export_options_t *options,
+                                         float mat[4][4])
+{
+    const layer_t *base;
+    if (!options->instancing) return NULL;
+    base = get_base_layer(img, layer);
+    if (base && (base->material != layer->material ||
+                 !volume_move_is_rigid(layer->mat, mat)))
+        base = NULL;
+    return base;
+}
+
+static void lod_job_func(void *user, int i, int thread)
+{
+    lod_job_t *job = &((lod_job_t*)user)[i];
+    job->mesh = volume_generate_mesh(
+            job->volume, goxel.rend.settings.effects, job->palette,
+            job->simplify);
+}
+
+// Compute the levels of detail meshes of all the layers in parallel.
+static void prepare_lods(gltf_t *g, const image_t *img,
+                         const palette_t *palette,
+                         const export_options_t *options)
+{
+    const layer_t *layer;
+    const volume_t *volume;
+    float mat[4][4];
+    int i, level;
+
+    DL_FOREACH(img->layers, layer) {
+        if (get_instanced_base(img, layer, options, mat)) continue;
+        volume = layer->volume;
+        for (level = 1; level <= options->lods; level++) {
+            volume = volume_downsample(volume);
+            arrput(g->lod_jobs, ((lod_job_t) {
+                .layer = layer,
+                .level = level,
+                .volume = (volume_t*)volume,
+                .palette = palette,
+                .simplify = options->simplify,
+            }));
+        }
+    }
+    parallel_for(arrlen(g->lod_jobs), lod_job_func, g->lod_jobs);
+    for (i = 0; i < arrlen(g->lod_jobs); i++) {
+        volume_delete(g->lod_jobs[i].volume);
+        g->lod_jobs[i].volume = NULL;
+    }
+}
+
+/*
+ * Add the levels of detail of a layer node with the MSFT_lod extension.
+ * The lod nodes are not part of the scene: they replace the layer node,
+ * so they get the same transformation.
+ */
+static void save_lods(gltf_t *g, const image_t *img, cgltf_node *node,
+                      const layer_t *layer, const float (*mat)[4],
+                      const export_options_t *options)
+{
+    lod_job_t *job;
+    cgltf_node *lod, *child;
+    node_lods_t lods = {.node = node - g->data->nodes};
+    int i;
+    char name[300], extras[256];
+    size_t n;
+
+    for (i = 0; i < arrlen(g->lod_jobs); i++) {
+        job = &g->lod_jobs[i];
+        if (job->layer != layer || !job->mesh->vertices_count) continue;
+        if (!job->instance.mesh) {
+            job->instance = save_mesh(g, img, job->mesh, layer->material,
+                                      options);
+            job->instance.lod = job->level;
+        }
+        lod = add_item(g->data, nodes);
+        snprintf(name, sizeof(name), "%s_LOD%d", node->name, job->level);
+        lod->name = strdup(name);
+        if (mat) {
+            memcpy(lod->matrix, mat, sizeof(lod->matrix));
+            lod->has_matrix = true;
+            ALLOC(lod->children, 1);
+            child = add_item(g->data, nodes);
+            set_instance_node(child, &job->instance);
+            *add_item(lod, children) = child;
+        } else {
+            set_instance_node(lod, &job->instance);
+        }
+        lods.ids[lods.nb++] = lod - g->data->nodes;
+    }
+    if (!lods.nb) return;
+
+    // The screen coverage halves at each level, and the last level is never
+    // culled.  cgltf cannot write custom node extensions, so the MSFT_lod
+    // object itself is added by get_json.
+    n = snprintf(extras, sizeof(extras), "{\"MSFT_screencoverage\":[");
+    for (i = 0; i < lods.nb; i++)
+        n += snprintf(extras + n, sizeof(extras) - n, "%g,", 0.5 / (1 << i));
+    snprintf(extras + n, sizeof(extras) - n, "0]}");
+    node->extras.data = strdup(extras);
+    arrput(g->nodes_lods, lods);
+}
+
+static void save_layer(gltf_t *g, cgltf_node *root_node,
+                       const image_t *img, const layer_t *layer,
+                       const palette_t *palette,
+                       int palette_pix_size,
+                       const export_options_t *options)
+{
+    const layer_t *base;
+    gltf_instance_t *instances;
+    cgltf_node *node, *child;
+    float mat[4][4];
+    int i, nb;
+
+    // Clones that are exact copies of their base layer reuse its meshes.
+    base = get_instanced_base(img, layer, options, mat);
+    instances = get_layer_instances(g, img, base ?: layer, palette, options);
+    nb = arrlen(instances);
+    if (nb == 0) return;
+
     node = add_item(g->data, nodes);
-    node->mesh = gmesh;
     node->name = strdup(layer->name);
     *add_item(root_node, children) = node;
 
-    volume_mesh_free(mesh);
+    if (!base && nb == 1 && !instances[0].pos[0] && !instances[0].pos[1] &&
+            !instances[0].pos[2]) {
+        set_instance_node(node, &instances[0]);
+    } else {
+        if (base) {
+            memcpy(node->matrix, mat, sizeof(mat));
+            node->has_matrix = true;
+        }
+        ALLOC(node->children, nb);
+        for (i = 0; i < nb; i++) {
+            child = add_item(g->data, nodes);
+            set_instance_node(child, &instances[i]);
+            *add_item(node, children) = child;
+        }
+    }
+
+    if (options->lods) {
+        save_lods(g, img, node, base ?: layer, base ? mat : NULL, options);
+    }
 }
 
 static void create_palette_texture(
@@ -346,7 +836,6 @@ static void create_palette_texture(
     uint8_t c[4];
     uint8_t (*data)[3];
     uint8_t *png;
-    cgltf_buffer *buffer;
     cgltf_buffer_view *buffer_view;
     cgltf_image *image;
     cgltf_texture *texture;
@@ -376,12 +865,8 @@ static void create_palette_texture(
     }
     png = img_write_to_mem((void*)data, s, s, 3, &size);
     free(data);
-    buffer = add_item(g->data, buffers);
-    buffer->size = size;
-    buffer->uri = data_new(png, size, NULL);
-    buffer_view = add_item(g->data, buffer_views);
-    buffer_view->buffer = buffer;
-    buffer_view->size = size;
+    memcpy(add_buffer_view(g, size, 0, cgltf_buffer_view_type_invalid,
+                           &buffer_view), png, size);
     image = add_item(g->data, images);
     image->mime_type = strdup("image/png");
     image->buffer_view = buffer_view;
@@ -390,19 +875,153 @@ static void create_palette_texture(
     free(png);
 }
 
-static void gltf_export(const image_t *img, const char *path,
-                        const export_options_t *options)
+/*
+ * Return the json tokens of a gltf, and set the index of the nodes array
+ * token, or -1 if there is none.
+ */
+static jsmntok_t *parse_json_nodes(const char *json, size_t len, int *nodes)
+{
+    jsmn_parser parser;
+    jsmntok_t *tokens;
+    int i, nb;
+
+    *nodes = -1;
+    jsmn_init(&parser);
+    nb = jsmn_parse(&parser, json, len, NULL, 0);
+    if (nb <= 0) return NULL;
+    tokens = calloc(nb, sizeof(*tokens));
+    jsmn_init(&parser);
+    jsmn_parse(&parser, json, len, tokens, nb);
+    for (i = 1; i < nb; i = cgltf_skip_json(tokens, i + 1)) {
+        if (cgltf_json_strcmp(&tokens[i], (const uint8_t*)json, "nodes") == 0
+                && tokens[i + 1].type == JSMN_ARRAY) {
+            *nodes = i + 1;
+            break;
+        }
+    }
+    return tokens;
+}
+
+/*
+ * Return the json of the gltf data as a newly allocated string.
+ * cgltf doesn't know about KHR_mesh_quantization and MSFT_lod, so we add
+ * the extensions declarations ourself when needed, and the MSFT_lod node
+ * extensions at the end of their nodes objects.
+ */
+static char *get_json(const gltf_t *g, size_t *size)
+{
+    cgltf_options options = {};
+    const bool has_lods = arrlen(g->nodes_lods) > 0;
+    char ext[256] = "";
+    size_t len, ext_len = 0, n, src = 1, end;
+    char *json, *ret;
+    jsmntok_t *tokens = NULL;
+    int i, j, k, t, nodes = -1;
+
+    if (g->quantized || has_lods) {
+        ext_len = snprintf(ext, sizeof(ext), "\"extensionsUsed\":[%s%s%s],",
+                g->quantized ? "\"KHR_mesh_quantization\"" : "",
+                g->quantized && has_lods ? "," : "",
+                has_lods ? "\"MSFT_lod\"" : "");
+    }
+    if (g->quantized) {
+        ext_len += snprintf(ext + ext_len, sizeof(ext) - ext_len,
+                "\"extensionsRequired\":[\"KHR_mesh_quantization\"],");
+    }
+
+    // Note: the returned size includes the null terminator.
+    len = cgltf_write(&options, NULL, 0, g->data);
+    json = malloc(len);
+    cgltf_write(&options, json, len, g->data);
+    len--;
+    if (has_lods) tokens = parse_json_nodes(json, len, &nodes);
+
+    // Each MSFT_lod object takes less than 128 bytes.
+    ret = malloc(len + ext_len + arrlen(g->nodes_lods) * 128 + 1);
+    // The json always starts with '{', followed by at least the asset.
+    ret[0] = '{';
+    memcpy(ret + 1, ext, ext_len);
+    n = 1 + ext_len;
+    for (i = 0, j = 0, t = nodes + 1; nodes >= 0 && i < tokens[nodes].size &&
+            j < arrlen(g->nodes_lods); i++, t = cgltf_skip_json(tokens, t)) {
+        if (g->nodes_lods[j].node != i) continue;
+        // Insert the extension before the closing brace of the node.
+        end = tokens[t].end - 1;
+        memcpy(ret + n, json + src, end - src);
+        n += end - src;
+        src = end;
+        n += sprintf(ret + n, "%s\"extensions\":{\"MSFT_lod\":{\"ids\":[",
+                     tokens[t].size ? "," : "");
+        for (k = 0; k < g->nodes_lods[j].nb; k++) {
+            n += sprintf(ret + n, "%s%d", k ? "," : "",
+                         g->nodes_lods[j].ids[k]);
+        }
+        n += sprintf(ret + n, "]}}");
+        j++;
+    }
+    memcpy(ret + n, json + src, len - src);
+    n += len - src;
+    ret[n] = '\0';
+    *size = n;
+    free(tokens);
+    free(json);
+    return ret;
+}
+
+static void write_le32(FILE *file, uint32_t v)
+{
+    uint8_t buf[4] = {v & 0xff, (v >> 8) & 0xff,
+                      (v >> 16) & 0xff, (v >> 24) & 0xff};
+    fwrite(buf, 4, 1, file);
+}
+
+// Write a glb container with a json chunk and a single binary chunk.
+static void write_glb(FILE *file, const char *json, size_t json_size,
+                      const uint8_t *bin, size_t bin_size)
+{
+    const uint8_t pad[3] = {0};
+    int json_pad = (4 - json_size % 4) % 4;
+    int bin_pad = (4 - bin_size % 4) % 4;
+    size_t total;
+
+    total = 12 + 8 + json_size + json_pad;
+    if (bin_size) total += 8 + bin_size + bin_pad;
+
+    write_le32(file, 0x46546C67); // 'glTF'
+    write_le32(file, 2);
+    write_le32(file, total);
+
+    write_le32(file, json_size + json_pad);
+    write_le32(file, 0x4E4F534A); // 'JSON'
+    fwrite(json, json_size, 1, file);
+    fwrite("   ", json_pad, 1, file);
+
+    if (bin_size) {
+        write_le32(file, bin_size + bin_pad);
+        write_le32(file, 0x004E4942); // 'BIN'
+        fwrite(bin, bin_size, 1, file);
+        fwrite(pad, bin_pad, 1, file);
+    }
+}
+
+static int gltf_export(const image_t *img, const char *path,
+                       const export_options_t *options)
 {
     gltf_t g = {};
     const layer_t *layer;
     cgltf_scene *scene;
     cgltf_node *root_node;
-    cgltf_options gltf_options = {};
+    cgltf_buffer *buffer;
     material_t *mat;
+    FILE *file;
+    char *json;
+    size_t json_size;
+    int i, ret = 0;
     const palette_t *palette = NULL;
     const int palette_pix_size = 4;
 
     gltf_init(&g, options, img);
+    buffer = add_item(g.data, buffers);
 
     if (!options->vertex_color) {
         create_palette_texture(&g, img, palette_pix_size);
@@ -425,21 +1044,77 @@ static void gltf_export(const image_t *img, const char *path,
     *add_item(scene, nodes) = root_node;
 
     ALLOC(root_node->children, DL_SIZE(img->layers));
+    if (options->lods) prepare_lods(&g, img, palette, options);
     DL_FOREACH(img->layers, layer) {
         save_layer(&g, root_node, img, layer,
                    palette, palette_pix_size, options);
     }
 
-    cgltf_write_file(&gltf_options, path, g.data);
+    // For glb the buffer data goes into the binary chunk, without uri.
+    buffer->size = g.bin_size;
+    if (!options->binary && g.bin_size) {
+        buffer->uri = data_new(g.bin, g.bin_size, NULL);
+        free(g.bin);
+        g.bin = NULL;
+    }
+    if (!g.bin_size) g.data->buffers_count = 0;
+
+    file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        ret = -1;
+        goto end;
+    }
+    json = get_json(&g, &json_size);
+    if (options->binary) {
+        write_glb(file, json, json_size, g.bin, g.bin_size);
+    } else {
+        fwrite(json, json_size, 1, file);
+    }
+    free(json);
+    fclose(file);
+
+end:
+    for (i = 0; i < hmlen(g.layers_instances); i++)
+        arrfree(g.layers_instances[i].value);
+    hmfree(g.layers_instances);
+    hmfree(g.tiles_meshes);
+    for (i = 0; i < arrlen(g.lod_jobs); i++)
+        volume_mesh_free(g.lod_jobs[i].mesh);
+    arrfree(g.lod_jobs);
+    arrfree(g.nodes_lods);
     cgltf_free(g.data);
-    free(g.palette.entries);
+    palette_release(&g.palette);
+    free(g.bin);
+    return ret;
 }
 
 static int export_as_gltf(const file_format_t *format, const image_t *img,
                           const char *path)
 {
-    gltf_export(img, path, &g_export_options);
-    return 0;
+    export_options_t options = g_export_options;
+    options.binary = false;
+    return gltf_export(img, path, &options);
+}
+
+static int export_as_glb(const file_format_t *format, const image_t *img,
+                         const char *path)
+{
+    export_options_t options = g_export_options;
+    options.binary = true;
+    return gltf_export(img, path, &options);
+}
+
+int gltf_export_file(const image_t *img, const char *path, bool binary,
+                     bool quantize, int lods)
+{
+    export_options_t options = {
+        .quantize = quantize,
+        .instancing = true,
+        .lods = clamp(lods, 0, MAX_LODS),
+        .binary = binary,
+    };
+    return gltf_export(img, path, &options);
 }
 
 static void export_gui(file_format_t *format)
@@ -448,6 +1123,12 @@ static void export_gui(file_format_t *format)
                  _("Save colors as vertex attribute"));
     gui_input_float(_("Simplify"), &g_export_options.simplify, 0.1,
                     0, 1, "%.1f");
+    gui_checkbox(_("Quantize"), &g_export_options.quantize,
+                 _("Use 16 and 8 bits vertex attributes "
+                   "(KHR_mesh_quantization)"));
+    gui_checkbox(_("Instancing"), &g_export_options.instancing,
+                 _("Share the meshes of clone layers and repeated blocks"));
+    gui_input_int(_("LODs"), &g_export_options.lods, 0, MAX_LODS);
 }
 
 FILE_FORMAT_REGISTER(gltf,
@@ -458,3 +1139,12 @@ FILE_FORMAT_REGISTER(gltf,
     .export_func = export_as_gltf,
     .priority = 100,
 )
+
+FILE_FORMAT_REGISTER(glb,
+    .name = "glb",
+    .exts = {"*.glb"},
+    .exts_desc = "glTF2 binary",
+    .export_gui = export_gui,
+    .export_func = export_as_glb,
+    .priority = 100,
+)
@@ -19,6 +19,10 @@
 
 #include "goxel.h"
 #include "file_format.h"
+#include "utils/mapped_file.h"
+
+#include "../ext_src/stb/stb_ds.h"
+
 #include <errno.h>
 
 #define VERSION 2 // Current version of the file format.
@@ -101,10 +105,29 @@ typedef struct {
     int      length;
     uint32_t crc;
     char     *buffer;   // Used when writing.
+    const char *data;   // Used when reading, points into the mapped file.
 
     int      pos;
 } chunk_t;
 
+// A BL16 chunk, only decoded when a layer uses it.
+typedef struct {
+    const chunk_t *chunk;
+    // First tile written with this block, so that the other tiles using
+    // it can share its data.
+    volume_t    *volume;
+    int         pos[3];
+    uint64_t    id;
+    int         job;        // Decoding job index + 1 in the current batch.
+} gox_block_t;
+
+typedef struct {
+    gox_block_t *blocks;
+    int         *jobs;      // Block index of each job.
+    uint8_t     (*out)[16 * 16 * 16][4];
+    bool        *failed;
+} decode_t;
+
 // Conveniance macro to call snprintf without gcc warning us about
 // possible truncations.
 #define copy_string(dst, src) ({ \
@@ -117,71 +140,86 @@ static void write_int32(FILE *out, int32_t v)
     fwrite((char*)&v, 4, 1, out);
 }
 
-static int32_t read_int32(FILE *in)
-{
-    int32_t v;
-    if (fread(&v, 4, 1, in) != 1) {
-        // XXX: use a better error mechanism!
-        LOG_E("Error reading file");
-    }
-    return v;
-}
-
-static bool chunk_read_start(chunk_t *c, FILE *in)
-{
-    size_t r;
-    memset(c, 0, sizeof(*c));
-    r = fread(c->type, 4, 1, in);
-    if (r == 0) return false; // eof.
-    if (r != 1) LOG_E("Error reading file");
-    c->length = read_int32(in);
-    return true;
-}
-
-static void chunk_read(chunk_t *c, FILE *in, char *buff, int size, int line)
+static void chunk_read(chunk_t *c, char *buff, int size, int line)
 {
     if (size == 0) return;
-    c->pos += size;
-    assert(c->pos <= c->length);
-    if (buff) {
+    if (size < 0 || c->pos + size > c->length) {
         // XXX: use a better error mechanism!
-        if (fread(buff, size, 1, in) != 1) {
-            LOG_E("Error reading file (line %d)", line);
-        }
-    } else {
-        fseek(in, size, SEEK_CUR);
+        LOG_E("Error reading file (line %d)", line);
+        if (buff && size > 0) memset(buff, 0, size);
+        c->pos = c->length;
+        return;
     }
+    if (buff) memcpy(buff, c->data + c->pos, size);
+    c->pos += size;
 }
 
-static int32_t chunk_read_int32(chunk_t *c, FILE *in, int line)
+static int32_t chunk_read_int32(chunk_t *c, int line)
 {
     int32_t v;
-    chunk_read(c, in, (char*)&v, 4, line);
+    chunk_read(c, (char*)&v, 4, line);
     return v;
 }
 
-static void chunk_read_finish(chunk_t *c, FILE *in)
-{
-    assert(c->pos == c->length);
-    read_int32(in); // TODO: check crc.
-}
-
-static bool chunk_read_dict_value(chunk_t *c, FILE *in,
+// Read a dict entry.  The key and value buffers are 256 bytes long, and
+// we stop reading the chunk if an entry doesn't fit in them.
+static bool chunk_read_dict_value(chunk_t *c,
                                   char *key, char *value, int *value_size,
                                   int line) {
     int size;
     assert(c->pos <= c->length);
     if (c->pos == c->length) return 0;
-    size = chunk_read_int32(c, in, line);
+    size = chunk_read_int32(c, line);
     if (size == 0) return false;
-    assert(size < 256);
-    chunk_read(c, in, key, size, line);
+    if (size < 0 || size >= 256) goto error;
+    chunk_read(c, key, size, line);
     key[size] = '\0';
-    size = chunk_read_int32(c, in, line);
-    chunk_read(c, in, value, size, line);
+    size = chunk_read_int32(c, line);
+    if (size < 0 || size >= 256) goto error;
+    chunk_read(c, value, size, line);
     value[size] = '\0';
     *value_size = size;
     return true;
+
+error:
+    LOG_E("Error reading file (line %d): invalid dict size %d", line, size);
+    c->pos = c->length;
+    return false;
+}
+
+/*
+ * Get the list of the chunks of a mapped file, without reading their data.
+ * If 'until_data' is set, we stop at the first block or layer chunk, which
+ * is enough to get the image infos and the preview.
+ */
+static int index_chunks(const mapped_file_t *file, bool until_data,
+                        int *version, chunk_t **chunks)
+{
+    size_t ofs = 8;
+    int32_t length;
+    chunk_t c;
+
+    if (file->size < 8 || strncmp(file->data, "GOX ", 4) != 0) return -1;
+    memcpy(version, file->data + 4, 4);
+    while (ofs < file->size) {
+        memset(&c, 0, sizeof(c));
+        if (file->size - ofs < 12) goto truncated;
+        memcpy(c.type, file->data + ofs, 4);
+        memcpy(&length, file->data + ofs + 4, 4);
+        if (length < 0 || length > file->size - ofs - 12) goto truncated;
+        if (until_data && (strncmp(c.type, "BL16", 4) == 0 ||
+                           strncmp(c.type, "LAYR", 4) == 0))
+            break;
+        c.length = length;
+        c.data = file->data + ofs + 8;
+        arrput(*chunks, c);
+        ofs += 12 + length; // TODO: check crc.
+    }
+    return 0;
+
+truncated:
+    LOG_W("Truncated gox file");
+    return 0;
 }
 
 static void chunk_write_start(chunk_t *c, FILE *out, const char *type)
@@ -438,50 +476,140 @@ int gox_iter_infos(const char *path,
                                    void *value, void *user),
                    void *user)
 {
-    FILE *in;
-    chunk_t c;
+    mapped_file_t file;
+    chunk_t *chunks = NULL;
     uint8_t *png;
-    char magic[4];
-
-    in = fopen(path, "rb");
+    int i, version;
 
-    if (fread(magic, 4, 1, in) != 1) goto error;
-    if (strncmp(magic, "GOX ", 4) != 0) goto error;
-    read_int32(in);
-
-    while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) break;
-        if (strncmp(c.type, "LAYR", 4) == 0) break;
-        if (strncmp(c.type, "PREV", 4) == 0) {
-            png = calloc(1, c.length);
-            chunk_read(&c, in, (char*)png, c.length, __LINE__);
-            callback(c.type, c.length, png, user);
+    if (mapped_file_open(&file, path) != 0) goto error;
+    if (index_chunks(&file, true, &version, &chunks) != 0) {
+        mapped_file_close(&file);
+        goto error;
+    }
+    for (i = 0; i < arrlen(chunks); i++) {
+        if (strncmp(chunks[i].type, "PREV", 4) == 0) {
+            png = calloc(1, chunks[i].length);
+            memcpy(png, chunks[i].data, chunks[i].length);
+            callback(chunks[i].type, chunks[i].length, png, user);
             free(png);
-        } else {
-            // Ignore other blocks.
-            chunk_read(&c, in, NULL, c.length, __LINE__);
         }
-        chunk_read_finish(&c, in);
     }
-    fclose(in);
+    arrfree(chunks);
+    mapped_file_close(&file);
     return 0;
 
 error:
-    fclose(in);
     LOG_W("Cannot get gox file info");
     return -1;
 }
 
+static bool is_tile_pos(const int pos[3])
+{
+    return (pos[0] & 15) == 0 && (pos[1] & 15) == 0 && (pos[2] & 15) == 0;
+}
 
-static block_hash_t *hash_find_at(block_hash_t *hash, int index)
+static void decode_block(void *user, int i, int thread)
 {
-    int i;
-    for (i = 0; i < index; i++) {
-        hash = hash->hh.next;
-    }
-    return hash;
+    decode_t *d = user;
+    const chunk_t *c = d->blocks[d->jobs[i]].chunk;
+    int w, h, bpp = 4;
+    uint8_t *data;
+
+    data = img_read_from_mem(c->data, c->length, &w, &h, &bpp);
+    d->failed[i] = !data || w != 64 || h != 64 || bpp != 4;
+    if (d->failed[i])
+        memset(d->out[i], 0, sizeof(d->out[i]));
+    else
+        memcpy(d->out[i], data, sizeof(d->out[i]));
+    free(data);
 }
 
+/*
+ * Read the blocks list of a layer chunk, and write them into the volume.
+ *
+ * The blocks png are decoded by batches, in parallel.  Once a block has
+ * been written into a tile, the other tiles using it share its data, so
+ * each block is usually decoded only once.
+ */
+static void load_layer_blocks(chunk_t *c, volume_t *volume,
+                              gox_block_t *blocks, int nb_blocks,
+                              int version)
+{
+    const int batch_size = 256;
+    decode_t d = {.blocks = blocks};
+    int i, j, nb, n, batch, nb_jobs, (*refs)[4];
+    gox_block_t *block;
+    uint64_t id;
+
+    nb = chunk_read_int32(c, __LINE__);
+    if (nb < 0 || nb > (c->length - c->pos) / 20) {
+        LOG_E("Wrong number of blocks in layer: %d", nb);
+        c->pos = c->length;
+        return;
+    }
+    refs = calloc(nb, sizeof(*refs));
+    for (i = 0; i < nb; i++) {
+        refs[i][0] = chunk_read_int32(c, __LINE__);
+        for (j = 0; j < 3; j++)
+            refs[i][j + 1] = chunk_read_int32(c, __LINE__);
+        if (version == 1) { // Previous version blocks pos.
+            for (j = 0; j < 3; j++) refs[i][j + 1] -= 8;
+        }
+        chunk_read_int32(c, __LINE__);
+        if (refs[i][0] < 0 || refs[i][0] >= nb_blocks) {
+            LOG_E("Wrong block index: %d", refs[i][0]);
+            refs[i][0] = -1;
+        }
+    }
+
+    d.jobs = calloc(batch_size, sizeof(*d.jobs));
+    d.out = calloc(batch_size, sizeof(*d.out));
+    d.failed = calloc(batch_size, sizeof(*d.failed));
+    for (batch = 0; batch < nb; batch += batch_size) {
+        n = min(nb - batch, batch_size);
+
+        // Decode the blocks we cannot get from an already written tile.
+        nb_jobs = 0;
+        for (i = batch; i < batch + n; i++) {
+            if (refs[i][0] == -1) continue;
+            block = &blocks[refs[i][0]];
+            if (block->job) continue;
+            if (block->volume && is_tile_pos(refs[i] + 1)) {
+                volume_get_tile_data(block->volume, NULL, block->pos, &id);
+                if (id == block->id) continue;
+            }
+            d.jobs[nb_jobs++] = refs[i][0];
+            block->job = nb_jobs;
+        }
+        parallel_for(nb_jobs, decode_block, &d);
+
+        for (i = batch; i < batch + n; i++) {
+            if (refs[i][0] == -1) continue;
+            block = &blocks[refs[i][0]];
+            if (!block->job) {
+                volume_copy_tile(block->volume, block->pos,
+                                 volume, refs[i] + 1);
+                continue;
+            }
+            volume_write(volume, refs[i] + 1, (int[]){16, 16, 16},
+                         (uint8_t*)d.out[block->job - 1]);
+            if (is_tile_pos(refs[i] + 1)) {
+                block->volume = volume;
+                memcpy(block->pos, refs[i] + 1, sizeof(block->pos));
+                volume_get_tile_data(volume, NULL, block->pos, &block->id);
+            }
+        }
+
+        for (j = 0; j < nb_jobs; j++) {
+            if (d.failed[j]) LOG_E("Cannot decode block %d", d.jobs[j]);
+            blocks[d.jobs[j]].job = 0;
+        }
+    }
+    free(d.jobs);
+    free(d.out);
+    free(d.failed);
+    free(refs);
+}
 
 // Ugly macro that check dict key/value and copy them if needed.
 #define DICT_CPY(key, dst) ({ \
@@ -497,32 +625,27 @@ static block_hash_t *hash_find_at(block_hash_t *hash, int index)
     r; })
 
 
+/*
+ * The file is mapped in memory, and we first build the list of its chunks.
+ * The blocks are only decoded when a layer uses them, directly from the
+ * mapped data.
+ */
 int load_from_file(const char *path, bool replace)
 {
     layer_t *layer, *layer_tmp;
-    block_hash_t *blocks_table = NULL, *data, *data_tmp;
-    FILE *in;
-    char magic[4] = {};
-    uint8_t *voxel_data;
-    int nb_blocks;
-    int w, h, bpp;
-    uint8_t *png;
-    chunk_t c;
-    int i, index, version, x, y, z, material_idx = 0;
+    mapped_file_t file;
+    chunk_t *chunks = NULL, *c;
+    gox_block_t *blocks = NULL;
+    int i, chunk_idx, version, material_idx = 0;
     int  dict_value_size;
     char dict_key[256];
     char dict_value[256];
-    uint64_t uid = 1;
     int aabb[2][3];
     camera_t *camera, *camera_tmp;
     material_t *mat, *mat_tmp;
 
-    in = fopen(path, "rb");
-    if (!in) return -1;
-
-    if (fread(magic, 4, 1, in) != 1) goto error;
-    if (strncmp(magic, "GOX ", 4) != 0) goto error;
-    version = read_int32(in);
+    if (mapped_file_open(&file, path) != 0) return -1;
+    if (index_chunks(&file, false, &version, &chunks) != 0) goto error;
     if (version > VERSION) {
         LOG_W("Cannot open gox file version %d", version);
         goto error;
@@ -551,40 +674,16 @@ int load_from_file(const char *path, bool replace)
         memset(&goxel.image->box, 0, sizeof(goxel.image->box));
     }
 
-    while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) {
-            png = calloc(1, c.length);
-            chunk_read(&c, in, (char*)png, c.length, __LINE__);
-            bpp = 4;
-            voxel_data = img_read_from_mem((void*)png, c.length, &w, &h, &bpp);
-            assert(w == 64 && h == 64 && bpp == 4);
-            data = calloc(1, sizeof(*data));
-            data->v = calloc(1, 64 * 64 * 4);
-            memcpy(data->v, voxel_data, 64 * 64 * 4);
-            data->uid = ++uid;
-            HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
-            free(voxel_data);
-            free(png);
+    for (chunk_idx = 0; chunk_idx < arrlen(chunks); chunk_idx++) {
+        c = &chunks[chunk_idx];
+        if (strncmp(c->type, "BL16", 4) == 0) {
+            arrput(blocks, ((gox_block_t){.chunk = c}));
 
-        } else if (strncmp(c.type, "LAYR", 4) == 0) {
+        } else if (strncmp(c->type, "LAYR", 4) == 0) {
             layer = image_add_layer(goxel.image, NULL);
-            nb_blocks = chunk_read_int32(&c, in, __LINE__);
-            assert(nb_blocks >= 0);
-            for (i = 0; i < nb_blocks; i++) {
-                index = chunk_read_int32(&c, in, __LINE__);
-                assert(index >= 0);
-                x = chunk_read_int32(&c, in, __LINE__);
-                y = chunk_read_int32(&c, in, __LINE__);
-                z = chunk_read_int32(&c, in, __LINE__);
-                if (version == 1) { // Previous version blocks pos.
-                    x -= 8; y -= 8; z -= 8;
-                }
-                chunk_read_int32(&c, in, __LINE__);
-                data = hash_find_at(blocks_table, index);
-                assert(data);
-                volume_blit(layer->volume, data->v, x, y, z, 16, 16, 16, NULL);
-            }
-            while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
+            load_layer_blocks(c, layer->volume, blocks, arrlen(blocks),
+                              version);
+            while ((chunk_read_dict_value(c, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 if (strcmp(dict_key, "name") == 0)
                     sprintf(layer->name, "%s", dict_value);
@@ -617,10 +716,10 @@ int load_from_file(const char *path, bool replace)
                 if (DICT_CPY("material", material_idx))
                     layer->material = get_material(goxel.image, material_idx);
             }
-        } else if (strncmp(c.type, "CAMR", 4) == 0) {
+        } else if (strncmp(c->type, "CAMR", 4) == 0) {
             camera = camera_new("unnamed");
             DL_APPEND(goxel.image->cameras, camera);
-            while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
+            while ((chunk_read_dict_value(c, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 if (strcmp(dict_key, "name") == 0) {
                     copy_string(camera->name, dict_value);
@@ -631,9 +730,9 @@ int load_from_file(const char *path, bool replace)
                 if (strcmp(dict_key, "active") == 0)
                     goxel.image->active_camera = camera;
             }
-        } else if (strncmp(c.type, "MATE", 4) == 0) {
+        } else if (strncmp(c->type, "MATE", 4) == 0) {
             mat = image_add_material(goxel.image, NULL);
-            while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
+            while ((chunk_read_dict_value(c, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 if (strcmp(dict_key, "name") == 0)
                     copy_string(mat->name, dict_value);
@@ -642,13 +741,13 @@ int load_from_file(const char *path, bool replace)
                 DICT_CPY("roughness", mat->roughness);
                 DICT_CPY("emission", mat->emission);
             }
-        } else if (strncmp(c.type, "IMG ", 4) == 0) {
-            while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
+        } else if (strncmp(c->type, "IMG ", 4) == 0) {
+            while ((chunk_read_dict_value(c, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 DICT_CPY("box", goxel.image->box);
             }
-        } else if (strncmp(c.type, "LIGH", 4) == 0) {
-            while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
+        } else if (strncmp(c->type, "LIGH", 4) == 0) {
+            while ((chunk_read_dict_value(c, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
                 DICT_CPY("pitch", goxel.rend.light.pitch);
                 DICT_CPY("yaw", goxel.rend.light.yaw);
@@ -657,26 +756,20 @@ int load_from_file(const char *path, bool replace)
                 DICT_CPY("ambient", goxel.rend.settings.ambient);
                 DICT_CPY("shadow", goxel.rend.settings.shadow);
             }
-        } else {
-            // Ignore other blocks.
-            chunk_read(&c, in, NULL, c.length, __LINE__);
         }
-        chunk_read_finish(&c, in);
-    }
-
-    // Free the block hash table.  We do not delete the block data because
-    // they have been used by the volumes.
-    HASH_ITER(hh, blocks_table, data, data_tmp) {
-        HASH_DEL(blocks_table, data);
-        free(data->v);
-        free(data);
     }
+    arrfree(blocks);
+    arrfree(chunks);
+    mapped_file_close(&file);
 
     if (replace) {
         goxel.image->path = strdup(path);
         goxel.image->saved_key = image_get_key(goxel.image);
     }
-    fclose(in);
+
+    // Add a default layer if there is none, as with truncated files.
+    if (!goxel.image->layers)
+        image_add_layer(goxel.image, NULL);
 
     // Add a default camera if there is none.
     if (!goxel.image->cameras) {
@@ -706,7 +799,8 @@ int load_from_file(const char *path, bool replace)
     return 0;
 
 error:
-    fclose(in);
+    arrfree(chunks);
+    mapped_file_close(&file);
     return -1;
 }
 
@@ -169,7 +169,7 @@ static int import_matrix(FILE *file)
 
     volume_blit(goxel.image->active_layer->volume, (uint8_t*)cube,
               pos[0], pos[2], pos[1],
-              size[0], size[2], size[1], NULL);
+              size[0], size[2], size[1]);
 
     free(cube);
 
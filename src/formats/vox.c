@@ -21,6 +21,8 @@
 #include "file_format.h"
 #include "goxel.h"
 
+#include "../ext_src/stb/stb_ds.h"
+
 #include <limits.h>
 #include <errno.h>
 
@@ -86,7 +88,7 @@ static int vox_import_old(const char *path)
     }
 
     volume_blit(goxel.image->active_layer->volume, (uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+              -w / 2, -h / 2, -d / 2, w, h, d);
     ret = 0;
 
 error:
@@ -486,48 +488,190 @@ error:
     return -1;
 }
 
-static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
+// Set the palette used to search the colors indices: the vox palette
+// without the index 0, reserved for the empty voxels.
+static void set_search_palette(palette_t *out, uint8_t (*palette)[4])
 {
-    const uint8_t *c;
-    int i, dist, best = -1, best_dist = 1024;
-    for (i = 1; i < 255; i++) {
-        c = palette[i];
-        dist = abs((int)c[0] - (int)v[0]) +
-               abs((int)c[1] - (int)v[1]) +
-               abs((int)c[2] - (int)v[2]);
-        if (dist == 0) return i;
-        if (exact) continue;
-        if (dist < best_dist) {
-            best_dist = dist;
-            best = i;
-        }
-    }
-    return best;
+    int i;
+    palette_release(out);
+    out->size = out->allocated = 255;
+    out->entries = calloc(255, sizeof(*out->entries));
+    for (i = 0; i < 255; i++)
+        memcpy(out->entries[i].color, palette[i + 1], 4);
+    palette_update_index(out);
+}
+
+// Hash map of the colors index, by rgb value.
+typedef struct {
+    uint32_t key;
+    uint8_t value;
+} color_lut_t;
+
+static uint32_t color_key(const uint8_t c[4])
+{
+    return c[0] | (c[1] << 8) | (c[2] << 16);
+}
+
+static void color_from_key(uint32_t key, uint8_t c[4])
+{
+    c[0] = key & 0xff;
+    c[1] = (key >> 8) & 0xff;
+    c[2] = (key >> 16) & 0xff;
+    c[3] = 255;
 }
 
-static int voxel_cmp(const void *a_, const void *b_)
+static int tile_cmp(const void *a_, const void *b_)
 {
-    const uint8_t *a = a_;
-    const uint8_t *b = b_;
+    const int *a = a_, *b = b_;
     if (a[2] != b[2]) return cmp(a[2], b[2]);
     if (a[1] != b[1]) return cmp(a[1], b[1]);
-    if (a[0] != b[0]) return cmp(a[0], b[0]);
-    return 0;
+    return cmp(a[0], b[0]);
+}
+
+// Write a chunk header, and return its position so that we can fix the
+// sizes once the chunk has been written.
+static long write_chunk_header(FILE *file, const char *id, int size,
+                               int children_size)
+{
+    long ret = ftell(file);
+    fwrite(id, 4, 1, file);
+    WRITE(uint32_t, size, file);
+    WRITE(uint32_t, children_size, file);
+    return ret;
+}
+
+// Set the size (or children size) of a chunk that ends at the current
+// position.
+static void fix_chunk_size(FILE *file, long chunk, bool children)
+{
+    long end = ftell(file);
+    fseek(file, chunk + (children ? 8 : 4), SEEK_SET);
+    WRITE(uint32_t, end - chunk - 12, file);
+    fseek(file, end, SEEK_SET);
+}
+
+static void write_string(FILE *file, const char *str)
+{
+    WRITE(uint32_t, strlen(str), file);
+    fwrite(str, strlen(str), 1, file);
+}
+
+/*
+ * Write all the voxels of the volume inside a model box, reading the
+ * tiles in order.  Return the number of voxels written.
+ */
+static int write_model_voxels(FILE *file, const volume_t *volume,
+                              const int (*tiles)[3], int nb_tiles,
+                              const int box[2][3], color_lut_t *lut)
+{
+    const uint8_t (*data)[4];
+    uint8_t (*out)[4];
+    int i, j, x, y, z, nb, ret = 0, a[3], b[3];
+    const int n = TILE_SIZE;
+
+    out = malloc(n * n * n * 4);
+    for (i = 0; i < nb_tiles; i++) {
+        for (j = 0; j < 3; j++) {
+            a[j] = max(tiles[i][j], box[0][j]) - tiles[i][j];
+            b[j] = min(tiles[i][j] + n, box[1][j]) - tiles[i][j];
+        }
+        if (a[0] >= b[0] || a[1] >= b[1] || a[2] >= b[2]) continue;
+        data = volume_get_tile_data(volume, NULL, tiles[i], NULL);
+        nb = 0;
+        for (z = a[2]; z < b[2]; z++)
+        for (y = a[1]; y < b[1]; y++)
+        for (x = a[0]; x < b[0]; x++) {
+            if (data[(z * n + y) * n + x][3] < 127) continue;
+            out[nb][0] = tiles[i][0] + x - box[0][0];
+            out[nb][1] = tiles[i][1] + y - box[0][1];
+            out[nb][2] = tiles[i][2] + z - box[0][2];
+            out[nb][3] = hmget(lut, color_key(data[(z * n + y) * n + x]));
+            nb++;
+        }
+        fwrite(out, 4, nb, file);
+        ret += nb;
+    }
+    free(out);
+    return ret;
+}
+
+// Write the scene graph placing all the models: a root transform and
+// group, then one transform and shape node per model.
+static void write_scene_graph(FILE *file, int nb_models,
+                              const int (*translations)[3])
+{
+    int i;
+    long chunk;
+    char buf[64];
+
+    chunk = write_chunk_header(file, "nTRN", 0, 0);
+    WRITE(int32_t, 0, file);        // Node id.
+    WRITE(uint32_t, 0, file);       // Empty dict.
+    WRITE(int32_t, 1, file);        // Child id.
+    WRITE(int32_t, -1, file);       // Reserved.
+    WRITE(int32_t, -1, file);       // Layer id.
+    WRITE(uint32_t, 1, file);       // Number of frames.
+    WRITE(uint32_t, 0, file);       // Empty frame dict.
+    fix_chunk_size(file, chunk, false);
+
+    chunk = write_chunk_header(file, "nGRP", 0, 0);
+    WRITE(int32_t, 1, file);
+    WRITE(uint32_t, 0, file);
+    WRITE(uint32_t, nb_models, file);
+    for (i = 0; i < nb_models; i++)
+        WRITE(int32_t, 2 + i * 2, file);
+    fix_chunk_size(file, chunk, false);
+
+    for (i = 0; i < nb_models; i++) {
+        chunk = write_chunk_header(file, "nTRN", 0, 0);
+        WRITE(int32_t, 2 + i * 2, file);
+        WRITE(uint32_t, 0, file);
+        WRITE(int32_t, 3 + i * 2, file);
+        WRITE(int32_t, -1, file);
+        WRITE(int32_t, 0, file);
+        WRITE(uint32_t, 1, file);
+        WRITE(uint32_t, 1, file);   // Frame dict with the translation.
+        write_string(file, "_t");
+        snprintf(buf, sizeof(buf), "%d %d %d", translations[i][0],
+                 translations[i][1], translations[i][2]);
+        write_string(file, buf);
+        fix_chunk_size(file, chunk, false);
+
+        chunk = write_chunk_header(file, "nSHP", 0, 0);
+        WRITE(int32_t, 3 + i * 2, file);
+        WRITE(uint32_t, 0, file);
+        WRITE(uint32_t, 1, file);   // Number of models.
+        WRITE(int32_t, i, file);
+        WRITE(uint32_t, 0, file);
+        fix_chunk_size(file, chunk, false);
+    }
 }
 
+/*
+ * Export the volume, split into models of at most 256^3 voxels placed with
+ * the scene graph when it doesn't fit into a single one.
+ *
+ * The voxels are streamed tile by tile, with the chunks sizes fixed once
+ * they are written, and the colors indices are computed only once per
+ * distinct color.
+ */
 static int vox_export(const file_format_t *format, const image_t *image,
                       const char *path)
 {
+    const int n = TILE_SIZE, max_size = 256;
     FILE *file;
-    int children_size, nb_vox = 0, i, pos[3];
-    int xmin = INT_MAX, ymin = INT_MAX, zmin = INT_MAX;
-    int xmax = INT_MIN, ymax = INT_MIN, zmax = INT_MIN;
-    uint8_t (*palette)[4];
+    int i, j, x, y, z, pos[3], nb_models, nb_vox, nb_tiles = 0;
+    int bbox[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                      {INT_MIN, INT_MIN, INT_MIN}};
+    int box[2][3], grid[3], (*tiles)[3] = NULL, (*translations)[3];
+    uint8_t (*palette)[4], color[4];
+    palette_t search_palette = {};
     bool use_default_palette = true;
-    uint8_t *voxels;
-    uint8_t v[4];
+    const uint8_t (*data)[4];
     volume_iterator_t iter;
     const volume_t *volume;
+    color_lut_t *lut = NULL;
+    long main_chunk, chunk;
 
     file = fopen(path, "wb");
     if (!file) {
@@ -540,75 +684,86 @@ static int vox_export(const file_format_t *format, const image_t *image,
     for (i = 0; i < 256; i++)
         hexcolor(VOX_DEFAULT_PALETTE[i], palette[i]);
 
-    // Iter all the voxels to get the count and the size.
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
+    // Get the bounding box, the tiles, and all the distinct colors.
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
     while (volume_iter(&iter, pos)) {
-        volume_get_at(volume, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        use_default_palette = use_default_palette &&
-                            get_color_index(v, palette, true) != -1;
-        nb_vox++;
-        xmin = min(xmin, pos[0]);
-        ymin = min(ymin, pos[1]);
-        zmin = min(zmin, pos[2]);
-        xmax = max(xmax, pos[0] + 1);
-        ymax = max(ymax, pos[1] + 1);
-        zmax = max(zmax, pos[2] + 1);
-    }
-    if (!use_default_palette)
-        quantization_gen_palette(volume, 255, (void*)(palette + 1));
-
-    children_size = 12 + 4 * 3 +      // SIZE chunk
-                    12 + 4 + 4 * nb_vox + // XYZI chunk
-                    (use_default_palette ? 0 : (12 + 4 * 256)); // RGBA chunk.
+        data = volume_get_tile_data(volume, NULL, pos, NULL);
+        memcpy(arraddnptr(tiles, 1), pos, sizeof(pos));
+        for (z = 0; z < n; z++)
+        for (y = 0; y < n; y++)
+        for (x = 0; x < n; x++) {
+            if (data[(z * n + y) * n + x][3] < 127) continue;
+            bbox[0][0] = min(bbox[0][0], pos[0] + x);
+            bbox[0][1] = min(bbox[0][1], pos[1] + y);
+            bbox[0][2] = min(bbox[0][2], pos[2] + z);
+            bbox[1][0] = max(bbox[1][0], pos[0] + x + 1);
+            bbox[1][1] = max(bbox[1][1], pos[1] + y + 1);
+            bbox[1][2] = max(bbox[1][2], pos[2] + z + 1);
+            hmput(lut, color_key(data[(z * n + y) * n + x]), 0);
+        }
+    }
+    nb_tiles = arrlen(tiles);
+    qsort(tiles, nb_tiles, sizeof(*tiles), tile_cmp);
+    if (bbox[0][0] == INT_MAX) {
+        memset(bbox, 0, sizeof(bbox));
+        bbox[1][0] = bbox[1][1] = bbox[1][2] = 1;
+    }
 
-    fprintf(file, "VOX ");
-    WRITE(uint32_t, 150, file);     // Version
-    fprintf(file, "MAIN");
-    WRITE(uint32_t, 0, file);       // Main chunck size.
-    WRITE(uint32_t, children_size, file);
+    set_search_palette(&search_palette, palette);
+    for (i = 0; use_default_palette && i < hmlen(lut); i++) {
+        color_from_key(lut[i].key, color);
+        use_default_palette =
+            palette_search(&search_palette, color, true) != -1;
+    }
+    if (!use_default_palette) {
+        quantization_gen_palette(volume, 255, 4, (void*)(palette + 1));
+        set_search_palette(&search_palette, palette);
+    }
+    for (i = 0; i < hmlen(lut); i++) {
+        color_from_key(lut[i].key, color);
+        lut[i].value = palette_search(&search_palette, color, false) + 1;
+    }
+    palette_release(&search_palette);
 
-    fprintf(file, "SIZE");
-    WRITE(uint32_t, 4 * 3, file);
-    WRITE(uint32_t, 0, file);
-    WRITE(uint32_t, xmax - xmin, file);
-    WRITE(uint32_t, ymax - ymin, file);
-    WRITE(uint32_t, zmax - zmin, file);
+    for (i = 0; i < 3; i++)
+        grid[i] = (bbox[1][i] - bbox[0][i] + max_size - 1) / max_size;
+    nb_models = grid[0] * grid[1] * grid[2];
+    translations = calloc(nb_models, sizeof(*translations));
 
-    fprintf(file, "XYZI");
-    WRITE(uint32_t, 4 * nb_vox + 4, file);
-    WRITE(uint32_t, 0, file);
-    WRITE(uint32_t, nb_vox, file);
+    fprintf(file, "VOX ");
+    WRITE(uint32_t, 150, file);     // Version
+    main_chunk = write_chunk_header(file, "MAIN", 0, 0);
+
+    for (i = 0; i < nb_models; i++) {
+        pos[0] = i % grid[0];
+        pos[1] = i / grid[0] % grid[1];
+        pos[2] = i / grid[0] / grid[1];
+        for (j = 0; j < 3; j++) {
+            box[0][j] = bbox[0][j] + pos[j] * max_size;
+            box[1][j] = min(box[0][j] + max_size, bbox[1][j]);
+            // The models are centered on their translation.
+            translations[i][j] = box[0][j] + (box[1][j] - box[0][j]) / 2;
+        }
+        write_chunk_header(file, "SIZE", 4 * 3, 0);
+        WRITE(uint32_t, box[1][0] - box[0][0], file);
+        WRITE(uint32_t, box[1][1] - box[0][1], file);
+        WRITE(uint32_t, box[1][2] - box[0][2], file);
 
-    voxels = calloc(nb_vox, 4);
-    i = 0;
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
-    while (volume_iter(&iter, pos)) {
-        volume_get_at(volume, &iter, pos, v);
-        if (v[3] < 127) continue;
-        pos[0] -= xmin;
-        pos[1] -= ymin;
-        pos[2] -= zmin;
-        assert(pos[0] >= 0 && pos[0] < 255);
-        assert(pos[1] >= 0 && pos[1] < 255);
-        assert(pos[2] >= 0 && pos[2] < 255);
-
-        voxels[i * 4 + 0] = pos[0];
-        voxels[i * 4 + 1] = pos[1];
-        voxels[i * 4 + 2] = pos[2];
-        voxels[i * 4 + 3] = get_color_index(v, palette, false);
-        i++;
+        chunk = write_chunk_header(file, "XYZI", 0, 0);
+        WRITE(uint32_t, 0, file);
+        nb_vox = write_model_voxels(file, volume, tiles, nb_tiles, box, lut);
+        fix_chunk_size(file, chunk, false);
+        fseek(file, chunk + 12, SEEK_SET);
+        WRITE(uint32_t, nb_vox, file);
+        fseek(file, 0, SEEK_END);
     }
-    qsort(voxels, nb_vox, 4, voxel_cmp);
-    for (i = 0; i < nb_vox; i++)
-        fwrite(voxels + i * 4, 4, 1, file);
-    free(voxels);
+
+    if (nb_models > 1)
+        write_scene_graph(file, nb_models, translations);
 
     if (!use_default_palette) {
-        fprintf(file, "RGBA");
-        WRITE(uint32_t, 4 * 256, file);
-        WRITE(uint32_t, 0, file);
+        write_chunk_header(file, "RGBA", 4 * 256, 0);
         for (i = 1; i < 256; i++) {
             WRITE(uint8_t, palette[i][0], file);
             WRITE(uint8_t, palette[i][1], file);
@@ -618,7 +773,11 @@ static int vox_export(const file_format_t *format, const image_t *image,
         WRITE(uint32_t, 0, file);
     }
 
+    fix_chunk_size(file, main_chunk, true);
     fclose(file);
+    arrfree(tiles);
+    hmfree(lut);
+    free(translations);
     free(palette);
     return 0;
 }
@@ -143,7 +143,7 @@ static int kv6_import(const file_format_t *format, image_t *image,
     }
 
     volume_blit(image->active_layer->volume, (const uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+              -w / 2, -h / 2, -d / 2, w, h, d);
 end:
     free(cube);
     free(blocks);
@@ -245,7 +245,7 @@ static int kvx_import(const file_format_t *format, image_t *image,
     bbox_from_aabb(image->box, aabb);
     bbox_from_aabb(image->active_layer->box, aabb);
     volume_blit(image->active_layer->volume, (uint8_t*)cube,
-              -px, -py, pz - d, w, h, d, NULL);
+              -px, -py, pz - d, w, h, d);
 
 end:
     free(palette);
@@ -257,23 +257,16 @@ end:
 }
 
 
-static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
+// Set the palette used to search the colors indices: only the entries
+// from 1 to 254 are used for the voxels.
+static void set_search_palette(palette_t *out, uint8_t (*palette)[4])
 {
-    const uint8_t *c;
-    int i, dist, best = -1, best_dist = 1024;
-    for (i = 1; i < 255; i++) {
-        c = palette[i];
-        dist = abs((int)c[0] - (int)v[0]) +
-               abs((int)c[1] - (int)v[1]) +
-               abs((int)c[2] - (int)v[2]);
-        if (dist == 0) return i;
-        if (exact) continue;
-        if (dist < best_dist) {
-            best_dist = dist;
-            best = i;
-        }
-    }
-    return best;
+    int i;
+    out->size = out->allocated = 254;
+    out->entries = calloc(254, sizeof(*out->entries));
+    for (i = 0; i < 254; i++)
+        memcpy(out->entries[i].color, palette[i + 1], 4);
+    palette_update_index(out);
 }
 
 // Sort the voxels as they appear in the slabs.
@@ -317,6 +310,7 @@ static int kvx_export(const file_format_t *format, const image_t *image,
 {
     FILE *file;
     uint8_t (*palette)[4];
+    palette_t search_palette = {};
     volume_iterator_t iter;
     volume_accessor_t acc;
     uint8_t v[4];
@@ -369,8 +363,9 @@ static int kvx_export(const file_format_t *format, const image_t *image,
             memcpy(palette[i], goxel.palette->entries[i].color, 4);
         }
     } else {
-        quantization_gen_palette(volume, 256, (void*)(palette));
+        quantization_gen_palette(volume, 256, 4, (void*)(palette));
     }
+    set_search_palette(&search_palette, palette);
 
     // Iter the voxels and only keep the visible ones, plus the visible
     // faces mask.  Put them all into an array.
@@ -405,7 +400,7 @@ static int kvx_export(const file_format_t *format, const image_t *image,
 
         #undef vis_test
         if (!voxel.vis) continue; // No visible faces.
-        voxel.color = get_color_index(v, palette, false);
+        voxel.color = palette_search(&search_palette, v, false) + 1;
         voxel.pos[0] -= orig[0];
         voxel.pos[1] -= orig[1];
         voxel.pos[2] -= orig[2];
@@ -508,6 +503,7 @@ static int kvx_export(const file_format_t *format, const image_t *image,
     utarray_free(voxels);
     free(xoffsets);
     free(xyoffsets);
+    palette_release(&search_palette);
     free(palette);
     fclose(file);
     return 0;
@@ -152,7 +152,7 @@ static int vxl_import(const file_format_t *format, image_t *image,
     }
 
     volume_blit(image->active_layer->volume, (uint8_t*)cube,
-          -width / 2, -depth / 2, -height / 2, width, depth, height, NULL);
+          -width / 2, -depth / 2, -height / 2, width, depth, height);
     if (box_is_null(image->box)) {
         bbox_from_extents(image->box, vec3_zero, width / 2, depth / 2, height / 2);
     }
@@ -29,6 +29,12 @@
 #define TINYOBJ_LOADER_C_IMPLEMENTATION
 #include "../ext_src/tinyobjloader/tinyobj_loader_c.h"
 
+#include "../ext_src/stb/stb_ds.h"
+
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+
 typedef struct {
     union {
         struct {
@@ -36,182 +42,480 @@ typedef struct {
             uint8_t  c[3];
         };
         float vn[3];
-        struct {
-            int  vs[4];
-            int vns[4];
-        };
     };
 } line_t;
 
+// Hash map key of a line.  stb_ds hashes the keys bytes with a signed int
+// shift that overflows if the high byte of a 32 bits word is >= 128, so we
+// split the floats bits into 16 bits values.
+typedef struct {
+    uint32_t w[7];
+} line_key_t;
+
+typedef struct {
+    line_key_t key;
+    int value;
+} line_index_t;
+
+// A list of lines, with a hash map of their indices to find duplicates.
+typedef struct {
+    line_t *data;           // stb_ds array.
+    line_index_t *index;    // stb_ds hash map.
+    int last;               // Last returned index.
+} lines_t;
+
+// Buffered output, since fprintf is slow for big meshes.
+typedef struct {
+    FILE *file;
+    int  len;
+    char buf[1 << 16];
+} writer_t;
+
 typedef struct {
     bool y_up;
+    bool ply_binary;
 } export_options_t;
 
 static export_options_t g_export_options = {
     .y_up = true,
+    .ply_binary = true,
 };
 
-static UT_icd line_icd = {sizeof(line_t), NULL, NULL, NULL};
-
-static int lines_find(UT_array *lines, const line_t *line, int search_nb)
+static line_key_t line_get_key(const line_t *line)
 {
-    int i, len;
-    line_t *l;
-    len = utarray_len(lines);
-    for (i = len - 1; (i >= 0) && (i > len - 1 - search_nb); i--) {
-        l = (line_t*)utarray_eltptr(lines, i);
-        if (memcmp(l, line, sizeof(*line)) == 0) return i + 1;
+    line_key_t key;
+    uint32_t u;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        memcpy(&u, &line->v[i], 4);
+        key.w[i * 2 + 0] = u & 0xffff;
+        key.w[i * 2 + 1] = u >> 16;
     }
-    return 0;
+    key.w[6] = line->c[0] | line->c[1] << 8 | line->c[2] << 16;
+    return key;
 }
 
 /*
  * Function: lines_add
- * Add a line entry into a list and return its index.
+ * Add a line entry into a list and return its index (starting at 1).
  *
  * Parameters:
  *   lines      - The list.
- *   line       - The new line we want to add.
- *   search_nb  - How far into the list we search for a similar line.  If
- *                a similar line is found we just return its index insead
- *                of adding a new one.
+ *   line       - The new line we want to add.  Must be zeroed before
+ *                setting the values, since we hash all its bytes.
+ *   dedup      - If set and a similar line is already in the list we just
+ *                return its index instead of adding a new one.
  */
-static int lines_add(UT_array *lines, const line_t *line, int search_nb)
+static int lines_add(lines_t *lines, const line_t *line, bool dedup)
 {
     int idx;
-    idx = lines_find(lines, line, search_nb);
-    if (idx) return idx;
-    utarray_push_back(lines, line);
-    return utarray_len(lines);
+    line_key_t key;
+    if (dedup) {
+        // Most normals are the same as the previous one.
+        if (lines->last && memcmp(&lines->data[lines->last - 1], line,
+                                  sizeof(*line)) == 0)
+            return lines->last;
+        key = line_get_key(line);
+        idx = hmgeti(lines->index, key);
+        if (idx >= 0) return lines->last = lines->index[idx].value;
+        hmput(lines->index, key, arrlen(lines->data) + 1);
+    }
+    arrput(lines->data, *line);
+    return lines->last = arrlen(lines->data);
+}
+
+/*
+ * Function: tile_lines_add
+ * Add a line of a tile vertex and return its index in the file (starting
+ * at 1).
+ *
+ * The lines of a tile are only merged together, except for the vertices
+ * on the tile borders, that are also merged with the ones of the previous
+ * tiles using a map of the global indices of all the borders lines.
+ *
+ * Parameters:
+ *   lines      - The lines of the current tile.
+ *   borders    - The map of the borders lines of all the tiles.
+ *   line       - The new line.
+ *   on_border  - Set if the vertex is on the tile border.
+ *   ofs        - Number of lines written for the previous tiles.
+ */
+static int tile_lines_add(lines_t *lines, line_index_t **borders,
+                          const line_t *line, bool on_border, int ofs)
+{
+    line_key_t key;
+    int idx;
+
+    if (!on_border) return ofs + lines_add(lines, line, true);
+    key = line_get_key(line);
+    idx = hmgeti(*borders, key);
+    if (idx >= 0) return (*borders)[idx].value;
+    idx = ofs + lines_add(lines, line, false);
+    hmput(*borders, key, idx);
+    return idx;
+}
+
+static void lines_free(lines_t *lines)
+{
+    arrfree(lines->data);
+    hmfree(lines->index);
+}
+
+static void writer_flush(writer_t *w)
+{
+    fwrite(w->buf, 1, w->len, w->file);
+    w->len = 0;
+}
+
+static void write_str(writer_t *w, const char *str)
+{
+    int len = strlen(str);
+    if (w->len + len > sizeof(w->buf)) writer_flush(w);
+    memcpy(w->buf + w->len, str, len);
+    w->len += len;
+}
+
+static void write_uint(writer_t *w, uint64_t v)
+{
+    char tmp[24];
+    int n = 0;
+    if (w->len + 24 > sizeof(w->buf)) writer_flush(w);
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n) w->buf[w->len++] = tmp[--n];
+}
+
+// Write a float with up to six decimals, and no trailing zeros.
+static void write_float(writer_t *w, float v)
+{
+    uint64_t n;
+    int i, decimals;
+    char tmp[6];
+
+    n = llround(fabs((double)v) * 1000000.0);
+    if (n && v < 0) write_str(w, "-");
+    write_uint(w, n / 1000000);
+    n %= 1000000;
+    if (!n) return;
+    for (i = 5; i >= 0; i--, n /= 10) tmp[i] = '0' + n % 10;
+    for (decimals = 6; tmp[decimals - 1] == '0'; decimals--);
+    if (w->len + 8 > sizeof(w->buf)) writer_flush(w);
+    w->buf[w->len++] = '.';
+    memcpy(w->buf + w->len, tmp, decimals);
+    w->len += decimals;
+}
+
+static void write_bytes(writer_t *w, const void *data, int len)
+{
+    if (w->len + len > sizeof(w->buf)) writer_flush(w);
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void write_le32(writer_t *w, uint32_t v)
+{
+    const uint8_t data[4] = {v, v >> 8, v >> 16, v >> 24};
+    write_bytes(w, data, 4);
+}
+
+static void write_le_float(writer_t *w, float v)
+{
+    uint32_t u;
+    memcpy(&u, &v, 4);
+    write_le32(w, u);
+}
+
+// Get the transformation from a tile mesh to the exported coordinates.
+static void get_tile_mat(const int bpos[3], float mat[4][4])
+{
+    static const float ZUP2YUP[4][4] = {
+        {1, 0, 0, 0}, {0, 0, -1, 0}, {0, 1, 0, 0}, {0, 0, 0, 1},
+    };
+    mat4_set_identity(mat);
+    if (g_export_options.y_up) {
+        mat4_mul(ZUP2YUP, mat, mat);
+    }
+    mat4_itranslate(mat, bpos[0], bpos[1], bpos[2]);
 }
 
-static int export(const volume_t *volume, const char *path, bool ply)
+// Check if a tile mesh vertex is on one of the tile faces, and so can be
+// shared with the adjacent tiles.
+static bool vertex_on_border(const voxel_vertex_t *vert, int subdivide)
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (vert->pos[i] == 0 || vert->pos[i] == BLOCK_SIZE * subdivide)
+            return true;
+    }
+    return false;
+}
+
+// Get the vertex and normal lines of a mesh vertex.
+static void get_vertex_lines(const voxel_vertex_t *vert, int subdivide,
+                             const float mat[4][4], line_t *v, line_t *vn)
+{
+    int i;
+    float p[3];
+
+    memset(v, 0, sizeof(*v));
+    for (i = 0; i < 3; i++) p[i] = vert->pos[i] / (float)subdivide;
+    mat4_mul_vec3(mat, p, p);
+    // Adding zero turns -0 into 0 so that they hash the same.
+    for (i = 0; i < 3; i++) v->v[i] = p[i] + 0.0f;
+    memcpy(v->c, vert->color, 3);
+    if (!vn) return;
+    memset(vn, 0, sizeof(*vn));
+    for (i = 0; i < 3; i++) p[i] = vert->normal[i];
+    mat4_mul_dir3(mat, p, p);
+    for (i = 0; i < 3; i++) vn->vn[i] = p[i] + 0.0f;
+}
+
+/*
+ * Export to obj, streaming the tiles meshes to the file so that the memory
+ * usage doesn't depend on the model size.  The vertex, normal and face
+ * lines of each tile are written together, with the indices offset by the
+ * lines of the previous tiles.  The vertices and normals are merged inside
+ * each tile, and across the tiles for the vertices on the tiles borders, so
+ * that the mesh stays welded.
+ */
+static int export_obj(const volume_t *volume, const char *path)
 {
     // XXX: Merge faces that can be merged into bigger ones.
     //      Allow to chose between quads or triangles.
     //      Also export mlt file for the colors.
     voxel_vertex_t* verts;
-    float v[3];
-    uint8_t c[3];
-    int nb_elems, i, j, bpos[3];
+    int nb_elems, i, j, bpos[3], ofs_v = 0, ofs_vn = 0, *idx_v, *idx_vn;
     float mat[4][4];
     FILE *out;
     const int N = BLOCK_SIZE;
     int size = 0, subdivide;
-    UT_array *lines_f, *lines_v, *lines_vn;
-    line_t line, face, *line_ptr = NULL;
+    lines_t lines_v = {0}, lines_vn = {0};
+    line_index_t *borders_v = NULL, *borders_vn = NULL;
+    line_t line, line_n;
+    bool on_border;
+    const line_t *l;
+    writer_t *w;
     volume_iterator_t iter;
-    static const float ZUP2YUP[4][4] = {
-        {1, 0, 0, 0}, {0, 0, -1, 0}, {0, 1, 0, 0}, {0, 0, 0, 1},
-    };
 
-    utarray_new(lines_f, &line_icd);
-    utarray_new(lines_v, &line_icd);
-    utarray_new(lines_vn, &line_icd);
+    out = fopen(path, "w");
+    if (!out) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
     verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    face = (line_t){};
+    idx_v = calloc(N * N * N * 6 * 4, sizeof(*idx_v));
+    idx_vn = calloc(N * N * N * 6 * 4, sizeof(*idx_vn));
+    w = calloc(1, sizeof(*w));
+    w->file = out;
+
     iter = volume_get_iterator(volume,
             VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
     while (volume_iter(&iter, bpos)) {
-        mat4_set_identity(mat);
-        if (g_export_options.y_up) {
-            mat4_mul(ZUP2YUP, mat, mat);
-        }
-        mat4_itranslate(mat, bpos[0], bpos[1], bpos[2]);
         nb_elems = volume_generate_vertices(volume, bpos,
                                     goxel.rend.settings.effects, verts,
                                     &size, &subdivide);
-        for (i = 0; i < nb_elems; i++) {
-            // Put the vertices.
-            for (j = 0; j < size; j++) {
-                v[0] = verts[i * size + j].pos[0] / (float)subdivide;
-                v[1] = verts[i * size + j].pos[1] / (float)subdivide;
-                v[2] = verts[i * size + j].pos[2] / (float)subdivide;
-                mat4_mul_vec3(mat, v, v);
-                memcpy(c, verts[i * size + j].color, 3);
-                line = (line_t){
-                    .v = {v[0], v[1], v[2]}, .c = {c[0], c[1], c[2]}};
-                // XXX: not sure about the search nb value to use here.
-                face.vs[j] = lines_add(lines_v, &line, 1024);
+        if (!nb_elems) continue;
+        get_tile_mat(bpos, mat);
+        for (i = 0; i < nb_elems * size; i++) {
+            get_vertex_lines(&verts[i], subdivide, mat, &line, &line_n);
+            on_border = vertex_on_border(&verts[i], subdivide);
+            idx_v[i] = tile_lines_add(&lines_v, &borders_v, &line,
+                                      on_border, ofs_v);
+            idx_vn[i] = tile_lines_add(&lines_vn, &borders_vn, &line_n,
+                                       on_border, ofs_vn);
+        }
+
+        for (i = 0; i < arrlen(lines_v.data); i++) {
+            l = &lines_v.data[i];
+            write_str(w, "v ");
+            for (j = 0; j < 3; j++) {
+                write_float(w, l->v[j]);
+                write_str(w, " ");
             }
-            // Put the normals
+            for (j = 0; j < 3; j++) {
+                write_float(w, l->c[j] / 255.f);
+                write_str(w, j < 2 ? " " : "\n");
+            }
+        }
+        for (i = 0; i < arrlen(lines_vn.data); i++) {
+            l = &lines_vn.data[i];
+            write_str(w, "vn ");
+            for (j = 0; j < 3; j++) {
+                write_float(w, l->vn[j]);
+                write_str(w, j < 2 ? " " : "\n");
+            }
+        }
+        for (i = 0; i < nb_elems; i++) {
+            write_str(w, "f");
             for (j = 0; j < size; j++) {
-                v[0] = verts[i * size + j].normal[0];
-                v[1] = verts[i * size + j].normal[1];
-                v[2] = verts[i * size + j].normal[2];
-                mat4_mul_dir3(mat, v, v);
-                line = (line_t){.vn = {v[0], v[1], v[2]}};
-                face.vns[j] = lines_add(lines_vn, &line, 512);
+                write_str(w, " ");
+                write_uint(w, idx_v[i * size + j]);
+                write_str(w, "//");
+                write_uint(w, idx_vn[i * size + j]);
             }
-            lines_add(lines_f, &face, 0);
+            write_str(w, "\n");
         }
+
+        ofs_v += arrlen(lines_v.data);
+        ofs_vn += arrlen(lines_vn.data);
+        arrsetlen(lines_v.data, 0);
+        arrsetlen(lines_vn.data, 0);
+        hmfree(lines_v.index);
+        hmfree(lines_vn.index);
+        lines_v.last = lines_vn.last = 0;
     }
-    out = fopen(path, "w");
-    if (ply) {
-        fprintf(out, "ply\n");
-        fprintf(out, "format ascii 1.0\n");
-        fprintf(out, "comment Generated from Goxel " GOXEL_VERSION_STR "\n");
-        fprintf(out, "element vertex %d\n", utarray_len(lines_v));
-        fprintf(out, "property float x\n");
-        fprintf(out, "property float y\n");
-        fprintf(out, "property float z\n");
+    writer_flush(w);
+    fclose(out);
+    lines_free(&lines_v);
+    lines_free(&lines_vn);
+    hmfree(borders_v);
+    hmfree(borders_vn);
+    free(w);
+    free(idx_vn);
+    free(idx_v);
+    free(verts);
+    return 0;
+}
+
+/*
+ * Write the ply header.  We only know the number of vertices and faces at
+ * the end of the export, so the header is written a second time once we
+ * have them.  A padding comment keeps its size constant.
+ */
+static void ply_write_header(FILE *out, bool binary, int nb_verts,
+                             int nb_faces)
+{
+    char counts[32];
+    int len;
+
+    len = snprintf(counts, sizeof(counts), "%d%d", nb_verts, nb_faces);
+    fprintf(out, "ply\n");
+    fprintf(out, "format %s 1.0\n", binary ? "binary_little_endian" : "ascii");
+    fprintf(out, "comment Generated from Goxel " GOXEL_VERSION_STR "\n");
+    fprintf(out, "comment%*s\n", 20 - len, "");
+    fprintf(out, "element vertex %d\n", nb_verts);
+    fprintf(out, "property float x\n");
+    fprintf(out, "property float y\n");
+    fprintf(out, "property float z\n");
+    if (binary) {
+        fprintf(out, "property uchar red\n");
+        fprintf(out, "property uchar green\n");
+        fprintf(out, "property uchar blue\n");
+    } else {
         fprintf(out, "property float red\n");
         fprintf(out, "property float green\n");
         fprintf(out, "property float blue\n");
-        fprintf(out, "element face %d\n", utarray_len(lines_f));
-        fprintf(out, "property list uchar int vertex_indices\n");
-        fprintf(out, "end_header\n");
-        while( (line_ptr = (line_t*)utarray_next(lines_v, line_ptr))) {
-            fprintf(out, "%g %g %g %f %f %f\n",
-                    line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
-                    line_ptr->c[0] / 255.,
-                    line_ptr->c[1] / 255.,
-                    line_ptr->c[2] / 255.);
-        }
-        while( (line_ptr = (line_t*)utarray_next(lines_f, line_ptr))) {
-            if (size == 4) {
-                fprintf(out, "4 %d %d %d %d\n", line_ptr->vs[0] - 1,
-                                                line_ptr->vs[1] - 1,
-                                                line_ptr->vs[2] - 1,
-                                                line_ptr->vs[3] - 1);
-            } else {
-                fprintf(out, "3 %d %d %d\n",    line_ptr->vs[0] - 1,
-                                                line_ptr->vs[1] - 1,
-                                                line_ptr->vs[2] - 1);
+    }
+    fprintf(out, "element face %d\n", nb_faces);
+    fprintf(out, "property list uchar int vertex_indices\n");
+    fprintf(out, "end_header\n");
+}
+
+/*
+ * Export to ply, streaming the tiles meshes to the file so that the memory
+ * usage doesn't depend on the model size.  Since ply wants all the vertices
+ * before the faces, we generate the meshes twice: a first pass writes the
+ * vertices, and a second pass the faces.  The vertices are merged inside
+ * each tile, and across the tiles for the vertices on the tiles borders.
+ */
+static int export_ply(const volume_t *volume, const char *path, bool binary)
+{
+    voxel_vertex_t* verts;
+    int nb_elems, i, j, bpos[3], pass, ofs, *idx;
+    int nb_verts = 0, nb_faces = 0;
+    float mat[4][4];
+    FILE *out;
+    const int N = BLOCK_SIZE;
+    int size = 0, subdivide;
+    lines_t lines = {0};
+    line_index_t *borders = NULL;
+    line_t line;
+    const line_t *l;
+    writer_t *w;
+    volume_iterator_t iter;
+
+    out = fopen(path, "wb");
+    if (!out) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return -1;
+    }
+    ply_write_header(out, binary, 0, 0);
+    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    idx = calloc(N * N * N * 6 * 4, sizeof(*idx));
+    w = calloc(1, sizeof(*w));
+    w->file = out;
+
+    for (pass = 0; pass < 2; pass++) {
+        ofs = 0;
+        hmfree(borders);
+        iter = volume_get_iterator(volume,
+                VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+        while (volume_iter(&iter, bpos)) {
+            nb_elems = volume_generate_vertices(volume, bpos,
+                                        goxel.rend.settings.effects, verts,
+                                        &size, &subdivide);
+            if (!nb_elems) continue;
+            get_tile_mat(bpos, mat);
+            for (i = 0; i < nb_elems * size; i++) {
+                get_vertex_lines(&verts[i], subdivide, mat, &line, NULL);
+                idx[i] = tile_lines_add(&lines, &borders, &line,
+                        vertex_on_border(&verts[i], subdivide), ofs) - 1;
             }
-        }
-    } else {
-        fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
-        while( (line_ptr = (line_t*)utarray_next(lines_v, line_ptr))) {
-            fprintf(out, "v %g %g %g %f %f %f\n",
-                    line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
-                    line_ptr->c[0] / 255.,
-                    line_ptr->c[1] / 255.,
-                    line_ptr->c[2] / 255.);
-        }
-        while( (line_ptr = (line_t*)utarray_next(lines_vn, line_ptr))) {
-            fprintf(out, "vn %g %g %g\n",
-                    line_ptr->vn[0], line_ptr->vn[1], line_ptr->vn[2]);
-        }
-        while( (line_ptr = (line_t*)utarray_next(lines_f, line_ptr))) {
-            if (size == 4) {
-                fprintf(out, "f %d//%d %d//%d %d//%d %d//%d\n",
-                             line_ptr->vs[0], line_ptr->vns[0],
-                             line_ptr->vs[1], line_ptr->vns[1],
-                             line_ptr->vs[2], line_ptr->vns[2],
-                             line_ptr->vs[3], line_ptr->vns[3]);
-            } else {
-                fprintf(out, "f %d//%d %d//%d %d//%d\n",
-                             line_ptr->vs[0], line_ptr->vns[0],
-                             line_ptr->vs[1], line_ptr->vns[1],
-                             line_ptr->vs[2], line_ptr->vns[2]);
+
+            for (i = 0; pass == 0 && i < arrlen(lines.data); i++) {
+                l = &lines.data[i];
+                if (binary) {
+                    for (j = 0; j < 3; j++) write_le_float(w, l->v[j]);
+                    write_bytes(w, l->c, 3);
+                    continue;
+                }
+                for (j = 0; j < 3; j++) {
+                    write_float(w, l->v[j]);
+                    write_str(w, " ");
+                }
+                for (j = 0; j < 3; j++) {
+                    write_float(w, l->c[j] / 255.f);
+                    write_str(w, j < 2 ? " " : "\n");
+                }
+            }
+
+            for (i = 0; pass == 1 && i < nb_elems; i++) {
+                if (binary) {
+                    write_bytes(w, (uint8_t[]){size}, 1);
+                    for (j = 0; j < size; j++)
+                        write_le32(w, idx[i * size + j]);
+                    continue;
+                }
+                write_str(w, size == 4 ? "4" : "3");
+                for (j = 0; j < size; j++) {
+                    write_str(w, " ");
+                    write_uint(w, idx[i * size + j]);
+                }
+                write_str(w, "\n");
             }
+
+            ofs += arrlen(lines.data);
+            if (pass == 1) nb_faces += nb_elems;
+            arrsetlen(lines.data, 0);
+            hmfree(lines.index);
+            lines.last = 0;
         }
+        if (pass == 0) nb_verts = ofs;
     }
+    writer_flush(w);
+
+    // Now that we know the counts, rewrite the header.
+    fseek(out, 0, SEEK_SET);
+    ply_write_header(out, binary, nb_verts, nb_faces);
     fclose(out);
-    utarray_free(lines_f);
-    utarray_free(lines_v);
-    utarray_free(lines_vn);
+    lines_free(&lines);
+    hmfree(borders);
+    free(w);
+    free(idx);
     free(verts);
     return 0;
 }
@@ -220,14 +524,14 @@ static int wavefront_export(const file_format_t *format,
                             const image_t *image, const char *path)
 {
     const volume_t *volume = goxel_get_layers_volume(image);
-    return export(volume, path, false);
+    return export_obj(volume, path);
 }
 
 int ply_export(const file_format_t *format, const image_t *image,
                const char *path)
 {
     const volume_t *volume = goxel_get_layers_volume(image);
-    return export(volume, path, true);
+    return export_ply(volume, path, g_export_options.ply_binary);
 }
 
 static void export_gui(file_format_t *format)
@@ -235,9 +539,23 @@ static void export_gui(file_format_t *format)
     gui_checkbox(_("Y Up"), &g_export_options.y_up, _("Use +Y up convention"));
 }
 
-static void get_file_data(void *ctx, const char *filename, const int is_mtl,
+static void ply_export_gui(file_format_t *format)
+{
+    export_gui(format);
+    gui_checkbox(_("Binary"), &g_export_options.ply_binary,
+                 _("Smaller and faster to load than ascii"));
+}
+
+// Keep track of all the files data read by tinyobj, so that we can free
+// them at the end.
+typedef struct {
+    char **datas;   // stb_ds array.
+} import_ctx_t;
+
+static void get_file_data(void *ctx_, const char *filename, const int is_mtl,
                           const char *obj_filename, char **data, size_t *len)
 {
+    import_ctx_t *ctx = ctx_;
     int size;
 
     if (!filename) {
@@ -247,18 +565,349 @@ static void get_file_data(void *ctx, const char *filename, const int is_mtl,
     }
     *data = read_file(filename, &size);
     *len = size;
+    if (*data) arrput(ctx->datas, *data);
+}
+
+/*
+ * Get the optional vertex colors ('v x y z r g b' lines), that tinyobj
+ * ignores.  Return NULL if the file has no colors, and a zero alpha for
+ * the vertices without a color.
+ */
+static uint8_t (*parse_vertex_colors(const char *data, int nb))[4]
+{
+    uint8_t (*ret)[4] = NULL;
+    const char *line;
+    char *end;
+    float v[6];
+    int i, j = 0;
+
+    for (line = data; line && *line && j < nb; line = strchr(line, '\n')) {
+        while (*line && strchr(" \t\r\n", *line)) line++;
+        if (line[0] != 'v' || (line[1] != ' ' && line[1] != '\t')) continue;
+        end = (char*)line + 2;
+        for (i = 0; i < 6; i++) {
+            v[i] = strtof(end, &end);
+            while (*end == ' ' || *end == '\t') end++;
+            if (*end == '\n' || *end == '\r' || *end == '\0') break;
+        }
+        if (i >= 5) {
+            if (!ret) ret = calloc(nb, sizeof(*ret));
+            for (i = 0; i < 3; i++)
+                ret[j][i] = clamp(v[3 + i], 0.f, 1.f) * 255 + 0.5f;
+            ret[j][3] = 255;
+        }
+        j++;
+    }
+    return ret;
+}
+
+/*
+ * Mesh voxelization.
+ *
+ * The triangles are binned by columns of tiles (all the tiles with the same
+ * x and y), then each column is voxelized independently in parallel.  First
+ * the surface, with a triangle / voxel box overlap test, then optionally
+ * the inside, by casting a ray along z at the center of each voxel column
+ * and filling between pairs of crossings.  The resulting tiles are written
+ * into the volume at once.
+ */
+
+#define N TILE_SIZE
+
+typedef struct {
+    float    p[3][3];       // Vertices in voxel units.
+    uint8_t  c[3][4];       // Vertices colors.
+} import_tri_t;
+
+// The key is the 16 bits halves of the column x and y, since stb_ds hash
+// overflows on keys words with the high bit set.
+typedef struct {
+    struct { uint32_t w[4]; } key;
+    int value;              // Index in the columns array.
+} column_index_t;
+
+typedef struct {
+    int     pos[2];                 // Tile aligned position.
+    int     *tris;                  // stb_ds array of triangle indices.
+    int     z, nb;                  // First tile z and number of tiles.
+    uint8_t (*tiles)[N * N * N][4];
+} column_t;
+
+typedef struct {
+    const import_tri_t *tris;
+    column_t *columns;
+    bool fill;
+} voxelizer_t;
+
+static uint8_t (*column_voxel(column_t *col, int x, int y, int z))[4]
+{
+    return &col->tiles[(z - col->z) / N][
+        ((z - col->z) % N) * N * N +
+        (y - col->pos[1]) * N + (x - col->pos[0])];
 }
 
+static void tri_get_color(const import_tri_t *t, const float p[3],
+                          uint8_t out[4])
+{
+    float v0[3], v1[3], v2[3], w[3], d00, d01, d11, d20, d21, den, sum;
+    int i;
+
+    if (    memcmp(t->c[0], t->c[1], 4) == 0 &&
+            memcmp(t->c[0], t->c[2], 4) == 0) {
+        memcpy(out, t->c[0], 4);
+        return;
+    }
+    // Barycentric coordinates of the point projected on the triangle.
+    vec3_sub(t->p[1], t->p[0], v0);
+    vec3_sub(t->p[2], t->p[0], v1);
+    vec3_sub(p, t->p[0], v2);
+    d00 = vec3_dot(v0, v0);
+    d01 = vec3_dot(v0, v1);
+    d11 = vec3_dot(v1, v1);
+    d20 = vec3_dot(v2, v0);
+    d21 = vec3_dot(v2, v1);
+    den = d00 * d11 - d01 * d01;
+    if (den == 0) {
+        memcpy(out, t->c[0], 4);
+        return;
+    }
+    w[1] = max(0.f, (d11 * d20 - d01 * d21) / den);
+    w[2] = max(0.f, (d00 * d21 - d01 * d20) / den);
+    w[0] = max(0.f, 1 - w[1] - w[2]);
+    sum = w[0] + w[1] + w[2];
+    for (i = 0; i < 4; i++) {
+        out[i] = (w[0] * t->c[0][i] + w[1] * t->c[1][i] +
+                  w[2] * t->c[2][i]) / sum + 0.5f;
+    }
+}
+
+// Get the z range of a triangle plane above a voxel column.
+static void tri_get_column_z(const import_tri_t *t, const float n[3],
+                             int x, int y, float *zmin, float *zmax)
+{
+    int i;
+    float z;
+    *zmin = +FLT_MAX;
+    *zmax = -FLT_MAX;
+    for (i = 0; i < 4; i++) {
+        z = t->p[0][2] - (n[0] * (x + i % 2 - t->p[0][0]) +
+                          n[1] * (y + i / 2 - t->p[0][1])) / n[2];
+        *zmin = min(*zmin, z);
+        *zmax = max(*zmax, z);
+    }
+}
+
+static void voxelize_surface(column_t *col, const import_tri_t *t)
+{
+    int i, x, y, z, lo[3], hi[3], zlo, zhi;
+    float n[3], e1[3], e2[3], zmin, zmax;
+    uint8_t (*v)[4];
+    vx_triangle_t tri;
+    const vx_vertex_t half = {.x = 0.5, .y = 0.5, .z = 0.5};
+    vx_vertex_t center;
+
+    for (i = 0; i < 3; i++) {
+        lo[i] = floorf(min3(t->p[0][i], t->p[1][i], t->p[2][i]));
+        hi[i] = floorf(max3(t->p[0][i], t->p[1][i], t->p[2][i]));
+    }
+    lo[0] = max(lo[0], col->pos[0]);
+    lo[1] = max(lo[1], col->pos[1]);
+    hi[0] = min(hi[0], col->pos[0] + N - 1);
+    hi[1] = min(hi[1], col->pos[1] + N - 1);
+    for (i = 0; i < 3; i++) {
+        tri.p1.v[i] = t->p[0][i];
+        tri.p2.v[i] = t->p[1][i];
+        tri.p3.v[i] = t->p[2][i];
+    }
+    vec3_sub(t->p[1], t->p[0], e1);
+    vec3_sub(t->p[2], t->p[0], e2);
+    vec3_cross(e1, e2, n);
+
+    for (y = lo[1]; y <= hi[1]; y++)
+    for (x = lo[0]; x <= hi[0]; x++) {
+        // Only test the voxels that can touch the triangle plane.
+        zlo = lo[2];
+        zhi = hi[2];
+        if (fabsf(n[2]) > 1e-3f * vec3_norm(n)) {
+            tri_get_column_z(t, n, x, y, &zmin, &zmax);
+            zlo = max(zlo, (int)floorf(zmin));
+            zhi = min(zhi, (int)floorf(zmax));
+        }
+        for (z = zlo; z <= zhi; z++) {
+            center = (vx_vertex_t){.x = x + 0.5, .y = y + 0.5, .z = z + 0.5};
+            if (!vx__triangle_box_overlap(center, half, tri)) continue;
+            v = column_voxel(col, x, y, z);
+            tri_get_color(t, center.v, *v);
+        }
+    }
+}
+
+static int float_cmp(const void *a, const void *b)
+{
+    return (*(float*)a > *(float*)b) - (*(float*)a < *(float*)b);
+}
+
+// Fill the inside of a closed mesh, by casting rays along z and filling
+// between pairs of crossings.  The inside takes the color of the surface
+// where the ray enters.
+static void voxelize_fill(column_t *col, const import_tri_t *tris)
+{
+    // Small offsets so that the rays don't hit the edges of meshes
+    // aligned on the grid.
+    const float ex = 0.000123f, ey = 0.000371f;
+    float *crossings[N * N] = {}, px, py, d[3], n[3], e1[3], e2[3];
+    int i, j, k, x, y, z, lo[2], hi[2];
+    const import_tri_t *t;
+    uint8_t (*v)[4], color[4];
+
+    for (i = 0; i < arrlen(col->tris); i++) {
+        t = &tris[col->tris[i]];
+        vec3_sub(t->p[1], t->p[0], e1);
+        vec3_sub(t->p[2], t->p[0], e2);
+        vec3_cross(e1, e2, n);
+        if (n[2] == 0) continue;
+        for (j = 0; j < 2; j++) {
+            lo[j] = floorf(min3(t->p[0][j], t->p[1][j], t->p[2][j]));
+            hi[j] = floorf(max3(t->p[0][j], t->p[1][j], t->p[2][j]));
+            lo[j] = max(lo[j], col->pos[j]);
+            hi[j] = min(hi[j], col->pos[j] + N - 1);
+        }
+        for (y = lo[1]; y <= hi[1]; y++)
+        for (x = lo[0]; x <= hi[0]; x++) {
+            px = x + 0.5f + ex;
+            py = y + 0.5f + ey;
+            // 2D edge functions, all of the same sign if inside.
+            for (j = 0; j < 3; j++) {
+                k = (j + 1) % 3;
+                d[j] = (t->p[k][0] - t->p[j][0]) * (py - t->p[j][1]) -
+                       (t->p[k][1] - t->p[j][1]) * (px - t->p[j][0]);
+            }
+            if (!((d[0] >= 0 && d[1] >= 0 && d[2] >= 0) ||
+                  (d[0] <= 0 && d[1] <= 0 && d[2] <= 0)))
+                continue;
+            arrput(crossings[(y - col->pos[1]) * N + x - col->pos[0]],
+                   t->p[0][2] - (n[0] * (px - t->p[0][0]) +
+                                 n[1] * (py - t->p[0][1])) / n[2]);
+        }
+    }
+
+    for (i = 0; i < N * N; i++) {
+        if (arrlen(crossings[i]) < 2) {
+            arrfree(crossings[i]);
+            continue;
+        }
+        x = col->pos[0] + i % N;
+        y = col->pos[1] + i / N;
+        qsort(crossings[i], arrlen(crossings[i]), sizeof(float), float_cmp);
+        for (j = 0; j + 1 < arrlen(crossings[i]); j += 2) {
+            z = floorf(crossings[i][j]);
+            v = column_voxel(col, x, y, z);
+            if ((*v)[3]) memcpy(color, *v, 4);
+            else memcpy(color, (uint8_t[]){255, 255, 255, 255}, 4);
+            for (z = ceilf(crossings[i][j] - 0.5f);
+                 z <= floorf(crossings[i][j + 1] - 0.5f); z++) {
+                v = column_voxel(col, x, y, z);
+                if (!(*v)[3]) memcpy(*v, color, 4);
+            }
+        }
+        arrfree(crossings[i]);
+    }
+}
+
+static void voxelize_column(void *user, int idx, int thread)
+{
+    voxelizer_t *vox = user;
+    column_t *col = &vox->columns[idx];
+    const import_tri_t *t;
+    int i, zmin = INT_MAX, zmax = INT_MIN;
+
+    for (i = 0; i < arrlen(col->tris); i++) {
+        t = &vox->tris[col->tris[i]];
+        zmin = min(zmin, (int)floorf(min3(t->p[0][2], t->p[1][2],
+                                          t->p[2][2])));
+        zmax = max(zmax, (int)floorf(max3(t->p[0][2], t->p[1][2],
+                                          t->p[2][2])));
+    }
+    col->z = zmin & ~(int)(N - 1);
+    col->nb = ((zmax & ~(int)(N - 1)) - col->z) / N + 1;
+    col->tiles = calloc(col->nb, sizeof(*col->tiles));
+    for (i = 0; i < arrlen(col->tris); i++)
+        voxelize_surface(col, &vox->tris[col->tris[i]]);
+    if (vox->fill) voxelize_fill(col, vox->tris);
+}
+
+static void voxelize(volume_t *volume, const import_tri_t *tris, int nb,
+                     bool fill)
+{
+    const int batch_size = 64;
+    int i, j, k, x, y, lo[2], hi[2];
+    column_index_t *index = NULL;
+    typeof(index->key) key;
+    column_t *columns = NULL, *col;
+    voxelizer_t vox = {.tris = tris, .fill = fill};
+    const import_tri_t *t;
+
+    // Bin the triangles into the columns of tiles they overlap.
+    for (i = 0; i < nb; i++) {
+        t = &tris[i];
+        for (j = 0; j < 2; j++) {
+            lo[j] = (int)floorf(min3(t->p[0][j], t->p[1][j], t->p[2][j])) &
+                    ~(int)(N - 1);
+            hi[j] = (int)floorf(max3(t->p[0][j], t->p[1][j], t->p[2][j])) &
+                    ~(int)(N - 1);
+        }
+        for (y = lo[1]; y <= hi[1]; y += N)
+        for (x = lo[0]; x <= hi[0]; x += N) {
+            key.w[0] = (uint32_t)x & 0xffff;
+            key.w[1] = (uint32_t)x >> 16;
+            key.w[2] = (uint32_t)y & 0xffff;
+            key.w[3] = (uint32_t)y >> 16;
+            k = hmgeti(index, key);
+            if (k < 0) {
+                hmput(index, key, arrlen(columns));
+                arrput(columns, ((column_t){.pos = {x, y}}));
+                k = arrlen(columns) - 1;
+            } else {
+                k = index[k].value;
+            }
+            arrput(columns[k].tris, i);
+        }
+    }
+    hmfree(index);
+
+    for (i = 0; i < arrlen(columns); i += batch_size) {
+        vox.columns = columns + i;
+        parallel_for(min(arrlen(columns) - i, batch_size), voxelize_column,
+                     &vox);
+        for (j = i; j < min(arrlen(columns), i + batch_size); j++) {
+            col = &columns[j];
+            for (k = 0; k < col->nb; k++) {
+                volume_write(volume,
+                             (int[]){col->pos[0], col->pos[1],
+                                     col->z + k * N},
+                             (int[]){N, N, N}, (uint8_t*)col->tiles[k]);
+            }
+            free(col->tiles);
+            arrfree(col->tris);
+        }
+    }
+    arrfree(columns);
+}
+
+#undef N
+
 static float g_resolution = 1.0;
+static bool g_fill = false;
 
 static void import_gui(file_format_t *format)
 {
     gui_dummy(200, 0); // Just to fix the width.
     gui_input_float("Resolution", &g_resolution, 0.01, 0, 100000, "%.3f");
+    gui_checkbox(_("Fill"), &g_fill, _("Also fill the inside of the mesh"));
 }
 
-static int wavefront_import(const file_format_t *format, image_t *image,
-                            const char *path)
+int obj_import(image_t *image, const char *path, float resolution,
+               bool fill)
 {
     int err;
     tinyobj_attrib_t attrib;
@@ -266,60 +915,74 @@ static int wavefront_import(const file_format_t *format, image_t *image,
     size_t num_shapes;
     tinyobj_material_t *materials = NULL;
     size_t num_materials;
-    int i, pos[3];
-    uint8_t color[4];
-    float res = g_resolution;
+    int i, j, k, ofs, nb = 0, mat;
+    float res = resolution;
+    const float *v;
     unsigned int flags;
-    vx_mesh_t *mesh;
-    vx_point_cloud_t *cloud;
-    volume_iterator_t iter = {0};
+    import_ctx_t ctx = {0};
+    uint8_t (*colors)[4];
+    import_tri_t *tris;
     layer_t *layer;
 
-    // XXX TODO: free the file data at the end!
     flags = TINYOBJ_FLAG_TRIANGULATE;
     err = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
-                            &num_materials, path, get_file_data, NULL, flags);
+                            &num_materials, path, get_file_data, &ctx,
+                            flags);
     if (err != TINYOBJ_SUCCESS) {
         LOG_E("Cannot load %s", path);
+        for (i = 0; i < arrlen(ctx.datas); i++) free(ctx.datas[i]);
+        arrfree(ctx.datas);
         return -1;
     }
+    colors = parse_vertex_colors(ctx.datas[0], attrib.num_vertices);
+    for (i = 0; i < arrlen(ctx.datas); i++) free(ctx.datas[i]);
+    arrfree(ctx.datas);
 
-    mesh = vx_mesh_alloc(attrib.num_vertices, attrib.num_faces);
-    for (i = 0; i < attrib.num_vertices; i++) {
-        mesh->vertices[i].x = attrib.vertices[i * 3 + 0];
-        mesh->vertices[i].z = attrib.vertices[i * 3 + 1];
-        mesh->vertices[i].y = -attrib.vertices[i * 3 + 2];
-        mesh->colors[i].r = 255;
-        mesh->colors[i].g = 255;
-        mesh->colors[i].b = 255;
-    }
-    for (i = 0; i < attrib.num_faces; i++) {
-        mesh->indices[i] = attrib.faces[i].v_idx;
+    // Put all the triangles in voxel units, with z up.  The voxel at
+    // position i covers [i - 0.5, i + 0.5] * res in the mesh.
+    tris = calloc(attrib.num_face_num_verts, sizeof(*tris));
+    for (i = 0, ofs = 0; i < attrib.num_face_num_verts;
+         ofs += attrib.face_num_verts[i++]) {
+        if (attrib.face_num_verts[i] != 3) continue;
+        mat = attrib.material_ids[i];
+        for (j = 0; j < 3; j++) {
+            k = attrib.faces[ofs + j].v_idx;
+            v = &attrib.vertices[k * 3];
+            tris[nb].p[j][0] = +v[0] / res + 0.5f;
+            tris[nb].p[j][1] = -v[2] / res + 0.5f;
+            tris[nb].p[j][2] = +v[1] / res + 0.5f;
+            // Vertices without a color use the material.
+            if (colors && colors[k][3]) {
+                memcpy(tris[nb].c[j], colors[k], 4);
+            } else if (mat >= 0 && mat < num_materials) {
+                for (k = 0; k < 3; k++) {
+                    tris[nb].c[j][k] =
+                        clamp(materials[mat].diffuse[k], 0.f, 1.f) * 255;
+                }
+                tris[nb].c[j][3] = 255;
+            } else {
+                memset(tris[nb].c[j], 255, 4);
+            }
+        }
+        nb++;
     }
-
+    free(colors);
     tinyobj_attrib_free(&attrib);
     tinyobj_shapes_free(shapes, num_shapes);
     tinyobj_materials_free(materials, num_materials);
 
-    cloud = vx_voxelize_pc(mesh, res, res, res, res * 0.1);
-
     layer = image_add_layer(image, NULL);
-    for (i = 0; i < cloud->nvertices; i++) {
-        pos[0] = floor(cloud->vertices[i].x / res);
-        pos[1] = floor(cloud->vertices[i].y / res);
-        pos[2] = floor(cloud->vertices[i].z / res);
-        color[0] = cloud->colors[i].r;
-        color[1] = cloud->colors[i].g;
-        color[2] = cloud->colors[i].b;
-        color[3] = 255;
-        volume_set_at(layer->volume, &iter, pos, color);
-    }
-
-    vx_point_cloud_free(cloud);
-
+    voxelize(layer->volume, tris, nb, fill);
+    free(tris);
     return 0;
 }
 
+static int wavefront_import(const file_format_t *format, image_t *image,
+                            const char *path)
+{
+    return obj_import(image, path, g_resolution, g_fill);
+}
+
 FILE_FORMAT_REGISTER(obj,
     .name = "obj",
     .exts = {"*.obj"},
@@ -334,6 +997,6 @@ FILE_FORMAT_REGISTER(ply,
     .name = "ply",
     .exts = {"*.ply"},
     .exts_desc = "ply",
-    .export_gui = export_gui,
+    .export_gui = ply_export_gui,
     .export_func = ply_export,
 )
@@ -1209,28 +1209,31 @@ void goxel_render_view(const float viewport[4], bool render_mode)
 
 void image_update(image_t *img);
 
-const volume_t *goxel_get_layers_volume(const image_t *img)
+const volume_t *goxel_get_layers_volume(const image_t *img_)
 {
     uint32_t key = 0, k;
     layer_t *layer;
+    // The cache is stored in the image, so that independent images can be
+    // used from different threads.
+    image_t *img = (image_t*)img_;
 
-    image_update((image_t*)img);
+    image_update(img);
     DL_FOREACH(img->layers, layer) {
         if (!layer->visible) continue;
         if (!layer->volume) continue;
         k = layer_get_key(layer);
         key = XXH32(&k, sizeof(k), key);
     }
-    if (key != goxel.layers_volume_hash) {
-        goxel.layers_volume_hash = key;
-        if (!goxel.layers_volume_) goxel.layers_volume_ = volume_new();
-        volume_clear(goxel.layers_volume_);
+    if (!img->layers_volume_ || key != img->layers_volume_hash) {
+        img->layers_volume_hash = key;
+        if (!img->layers_volume_) img->layers_volume_ = volume_new();
+        volume_clear(img->layers_volume_);
         DL_FOREACH(img->layers, layer) {
             if (!layer->visible) continue;
-            volume_merge(goxel.layers_volume_, layer->volume, MODE_OVER, NULL);
+            volume_merge(img->layers_volume_, layer->volume, MODE_OVER, NULL);
         }
     }
-    return goxel.layers_volume_;
+    return img->layers_volume_;
 }
 
 const volume_t *goxel_get_render_volume(const image_t *img)
@@ -1460,6 +1463,44 @@ int goxel_export_to_file(const char *path, const char *format)
     return 0;
 }
 
+/*
+ * Function: goxel_render_to_file
+ * Render the image with the path tracer and save it as a png file.
+ *
+ * The rendering uses the current path tracer settings, the active camera
+ * and the image export size.  This blocks until all the samples are done,
+ * and doesn't need any graphics context.
+ *
+ * Parameters:
+ *   path            - Path of the png file.
+ *   samples_per_sec - If not NULL, get the rendering speed.
+ */
+int goxel_render_to_file(const char *path, double *samples_per_sec)
+{
+    pathtracer_t pt;
+    camera_t *camera = get_camera();
+    int err;
+
+    // Use a separate instance so that we don't mess up with the gui one.
+    pt = goxel.pathtracer;
+    pt.p = NULL;
+    pt.buf = NULL;
+    pt.texture = NULL;
+    pt.w = goxel.image->export_width;
+    pt.h = goxel.image->export_height;
+
+    // The path tracer renders from the active camera, and takes the aspect
+    // from the output size, so the view camera is left untouched.
+    goxel.image->active_camera = camera;
+    camera_update(camera);
+    LOG_I("Rendering %dx%d image (%d samples)", pt.w, pt.h, pt.num_samples);
+    err = pathtracer_render(&pt, samples_per_sec);
+    if (!err) img_write(pt.buf, pt.w, pt.h, 4, path);
+    pathtracer_stop(&pt);
+    free(pt.buf);
+    return err;
+}
+
 static void a_overwrite_export(void)
 {
     if (!goxel.image->export_path) {
@@ -1509,16 +1550,62 @@ void goxel_add_recent_file(const char *path)
     fclose(file);
 }
 
+typedef struct {
+    void (*fn)(void *args, uint8_t color[4]);
+    void *args;
+    const volume_t *volume;
+    int (*tiles)[3];
+    uint8_t (*out)[TILE_SIZE * TILE_SIZE * TILE_SIZE][4];
+    // One color LUT per thread, kept for all the tiles.  The keys are
+    // 8 bytes with the alpha in the 5th byte, since stb_ds hashes the 4th
+    // and 8th bytes with a shift that overflows for values over 127.
+    struct { uint64_t key; uint32_t value; } **luts;
+} color_filter_t;
+
+static void color_filter_tile(void *user, int i, int thread)
+{
+    color_filter_t *cf = user;
+    uint8_t (*data)[4] = cf->out[i];
+    uint64_t c, prev_key = 0;
+    uint32_t prev_value = 0;
+    ptrdiff_t idx;
+    int j;
+
+    volume_read(cf->volume, cf->tiles[i],
+                (int[]){TILE_SIZE, TILE_SIZE, TILE_SIZE}, (uint8_t*)data);
+    for (j = 0; j < TILE_SIZE * TILE_SIZE * TILE_SIZE; j++) {
+        if (!data[j][3]) continue;
+        c = data[j][0] | (data[j][1] << 8) | (data[j][2] << 16) |
+            ((uint64_t)data[j][3] << 32);
+        // Neighbor voxels often have the same color.
+        if (c == prev_key) {
+            memcpy(data[j], &prev_value, 4);
+            continue;
+        }
+        prev_key = c;
+        idx = hmgeti(cf->luts[thread], c);
+        if (idx >= 0) {
+            prev_value = cf->luts[thread][idx].value;
+        } else {
+            cf->fn(cf->args, data[j]);
+            memcpy(&prev_value, data[j], 4);
+            hmput(cf->luts[thread], c, prev_value);
+        }
+        memcpy(data[j], &prev_value, 4);
+    }
+}
+
 void goxel_apply_color_filter(
         void (*fn)(void *args, uint8_t color[4]), void *args)
 {
+    const int batch_size = 256;
     layer_t *layer = goxel.image->active_layer;
     volume_t *volume;
     volume_iterator_t iter;
-    int p[3];
-    uint8_t color[4];
+    int i, p[3], nb = 0, nb_threads, batch;
     painter_t painter;
     image_t *img = goxel.image;
+    color_filter_t cf = {.fn = fn, .args = args};
 
     /* Compute the volume where we want to apply the filter.  Mask, rect
      * selection, or the whole layer.  */
@@ -1533,13 +1620,33 @@ void goxel_apply_color_filter(
         };
         volume_op(volume, &painter, img->selection_box);
     }
+
+    /* Filter the tiles in parallel.  Since a tile usually only has a few
+     * distinct colors, the filter is called once per color and thread.  */
     iter = volume_get_iterator(volume,
-            VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
     while (volume_iter(&iter, p)) {
-        volume_get_at(volume, &iter, p, color);
-        fn(args, color);
-        volume_set_at(volume, &iter, p, color);
+        cf.tiles = realloc(cf.tiles, (nb + 1) * sizeof(*cf.tiles));
+        memcpy(cf.tiles[nb++], p, sizeof(p));
+    }
+    cf.volume = volume;
+    nb_threads = parallel_get_nb_threads();
+    cf.luts = calloc(nb_threads, sizeof(*cf.luts));
+    cf.out = malloc(min(nb, batch_size) * sizeof(*cf.out));
+    for (batch = 0; batch < nb; batch += batch_size) {
+        color_filter_t bcf = cf;
+        bcf.tiles = cf.tiles + batch;
+        parallel_for(min(nb - batch, batch_size), color_filter_tile, &bcf);
+        for (i = 0; i < min(nb - batch, batch_size); i++) {
+            volume_write(volume, bcf.tiles[i],
+                         (int[]){TILE_SIZE, TILE_SIZE, TILE_SIZE},
+                         (uint8_t*)cf.out[i]);
+        }
     }
+    for (i = 0; i < nb_threads; i++) hmfree(cf.luts[i]);
+    free(cf.luts);
+    free(cf.out);
+    free(cf.tiles);
 
     // Merge back into the original layer.
     volume_merge(layer->volume, volume, MODE_OVER, NULL);
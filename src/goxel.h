@@ -64,6 +64,7 @@
 #include "utils/geometry.h"
 #include "utils/gl.h"
 #include "utils/img.h"
+#include "utils/parallel.h"
 #include "utils/path.h"
 #include "utils/plane.h"
 #include "utils/sound.h"
@@ -433,8 +434,9 @@ enum {
 #define BLOCK_SIZE 16
 #define VOXEL_TEXTURE_SIZE 8
 
-// Generate an optimal palette whith a fixed number of colors from a volume.
-void quantization_gen_palette(const volume_t *volume, int nb,
+// Generate an optimal palette whith a fixed number of colors from a volume,
+// using median cut followed by 'refine' iterations of k-means (can be 0).
+void quantization_gen_palette(const volume_t *volume, int nb, int refine,
                               uint8_t (*palette)[4]);
 
 // #### Goxel : core object ####
@@ -484,9 +486,6 @@ typedef struct goxel
     // during render.
     volume_t   *tool_volume;
 
-    volume_t   *layers_volume_;
-    uint32_t   layers_volume_hash;
-
     volume_t   *render_volume_; // All the layers + tool volume.
     uint32_t   render_volume_hash;
 
@@ -643,6 +642,7 @@ void goxel_import_image_plane(const char *path);
 
 int goxel_import_file(const char *path, const char *format);
 int goxel_export_to_file(const char *path, const char *format);
+int goxel_render_to_file(const char *path, double *samples_per_sec);
 
 // Render the view into an RGB[A] buffer.
 void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp);
@@ -659,6 +659,17 @@ int gox_iter_infos(const char *path,
                                    void *value, void *user),
                    void *user);
 
+// Voxelize a wavefront obj mesh into a new layer of an image.
+// The resolution is the size of a voxel in the mesh units, and fill also
+// fills the inside of closed meshes.
+int obj_import(image_t *img, const char *path, float resolution, bool fill);
+
+// Export an image to a gltf file, or glb if binary is set, with the default
+// options.  quantize uses KHR_mesh_quantization, and lods is the number of
+// extra levels of detail saved with MSFT_lod.
+int gltf_export_file(const image_t *img, const char *path, bool binary,
+                     bool quantize, int lods);
+
 
 void settings_load(void);
 void settings_save(void);
@@ -671,6 +682,10 @@ void goxel_add_recent_file(const char *path);
  *
  * This is a conveniance function so that we don't have to handle the case
  * where we have a selection mask or not.
+ *
+ * The tiles are processed in parallel, and the filter is only called once
+ * per distinct color and thread, so it must be thread safe and only
+ * depend on the input color.
  */
 void goxel_apply_color_filter(
         void (*fn)(void *args, uint8_t color[4]), void *args);
@@ -48,6 +48,14 @@ void gui_render_panel(void)
     if (gui_input_int(_("Samples"), &pt->num_samples, 0, 0))
         pt->num_samples = clamp(pt->num_samples, 1, 10000);
 
+    gui_group_begin(_("Geometry"));
+    gui_selectable_toggle(_("Mesh"), &pt->backend, PT_BACKEND_MESH,
+                          NULL, -1);
+    gui_selectable_toggle(_("Voxels"), &pt->backend, PT_BACKEND_VOXELS,
+                          _("Directly trace the voxels, faster to start "
+                            "and uses less memory for large volumes"), -1);
+    gui_group_end();
+
     if (pt->status == PT_STOPPED && gui_button(_("Start"), 1, 0))
         pt->status = PT_RUNNING;
     if (pt->status == PT_RUNNING && gui_button(_("Stop"), 1, 0)) {
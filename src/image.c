@@ -134,7 +134,7 @@ void image_update(image_t *img)
             if (key != layer->shape_key) {
                 painter.mode = MODE_OVER;
                 painter.shape = layer->shape;
-                painter.box = &goxel.image->box;
+                painter.box = &img->box;
                 vec4_copy(layer->color, painter.color);
                 volume_clear(layer->volume);
                 volume_op(layer->volume, &painter, layer->mat);
@@ -302,6 +302,7 @@ void image_delete(image_t *img)
         material_delete(mat);
     }
 
+    volume_delete(img->layers_volume_);
     free(img->path);
     free(img->export_path);
 
@@ -360,7 +361,7 @@ void image_delete_layer(image_t *img, layer_t *layer)
     if (layer == img->active_layer) img->active_layer = NULL;
 
     // Unclone all layers cloned from this one.
-    DL_FOREACH(goxel.image->layers, other) {
+    DL_FOREACH(img->layers, other) {
         if (other->base_id == layer->id) {
             other->base_id = 0;
         }
@@ -441,7 +442,7 @@ void image_merge_visible_layers(image_t *img)
 
         if (last) {
             // Unclone all layers cloned from this one.
-            DL_FOREACH(goxel.image->layers, other) {
+            DL_FOREACH(img->layers, other) {
                 if (other->base_id == last->id) {
                     other->base_id = 0;
                 }
@@ -469,7 +470,7 @@ void image_merge_layer_down(image_t *img, layer_t *layer)
     image_unclone_layer(img, target);
 
     // Unclone all layers cloned from this one.
-    DL_FOREACH(goxel.image->layers, other) {
+    DL_FOREACH(img->layers, other) {
         if (other->base_id == layer->id) {
             other->base_id = 0;
         }
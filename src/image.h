@@ -45,6 +45,10 @@ struct image {
     float       selection_box[4][4];
     volume_t    *selection_mask;
 
+    // Merged visible layers, see goxel_get_layers_volume.
+    volume_t    *layers_volume_;
+    uint32_t    layers_volume_hash;
+
     // For saving.
     // XXX: I think those should be persistend data of export code instead.
     char     *path;         // Path to save the gox file.
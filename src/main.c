@@ -68,11 +68,45 @@ typedef struct
     const char *script;
     int script_args_nb;
     const char *script_args[32];
+
+    // Offline path tracer rendering.
+    const char *render;
+    int render_size[2];
+    int samples;
+    const char *world;
+    const char *floor;
+    const char *camera;
+    const char *render_backend;
+    int region[4];
+    const char *checkpoint;
+    float checkpoint_interval;
+
+    // Merge of path tracer checkpoints.
+    const char *merge;
+    int merge_inputs_nb;
+    const char *merge_inputs[64];
+
+    // Scripts run in parallel.
+    bool batch;
+    int batch_scripts_nb;
+    const char *batch_scripts[1024];
 } args_t;
 
 #define OPT_HELP 1
 #define OPT_VERSION 2
 #define OPT_SCRIPT 3
+#define OPT_RENDER 4
+#define OPT_RENDER_SIZE 5
+#define OPT_SAMPLES 6
+#define OPT_WORLD 7
+#define OPT_FLOOR 8
+#define OPT_CAMERA 9
+#define OPT_RENDER_BACKEND 10
+#define OPT_REGION 11
+#define OPT_CHECKPOINT 12
+#define OPT_CHECKPOINT_EVERY 13
+#define OPT_MERGE 14
+#define OPT_BATCH 15
 
 typedef struct {
     const char *name;
@@ -88,6 +122,30 @@ static const gox_option_t OPTIONS[] = {
     {"scale", 's', required_argument, "FLOAT", .help="Set UI scale"},
     {"script", OPT_SCRIPT, required_argument, "FILENAME",
         .help="Run a script and exit"},
+    {"render", OPT_RENDER, required_argument, "FILENAME",
+        .help="Render the image with the path tracer to a png file"},
+    {"render-size", OPT_RENDER_SIZE, required_argument, "WxH",
+        .help="Size of the rendered image"},
+    {"samples", OPT_SAMPLES, required_argument, "INT",
+        .help="Number of samples of the rendering"},
+    {"world", OPT_WORLD, required_argument, "NAME",
+        .help="Rendering world: none, uniform or sky"},
+    {"floor", OPT_FLOOR, required_argument, "NAME",
+        .help="Rendering floor: none or plane"},
+    {"camera", OPT_CAMERA, required_argument, "NAME",
+        .help="Name of the camera to use for the rendering"},
+    {"render-backend", OPT_RENDER_BACKEND, required_argument, "NAME",
+        .help="Path tracer geometry: mesh or voxels"},
+    {"region", OPT_REGION, required_argument, "X,Y,W,H",
+        .help="Only render a region of the image"},
+    {"checkpoint", OPT_CHECKPOINT, required_argument, "FILENAME",
+        .help="Resume the rendering from and save it to a file"},
+    {"checkpoint-every", OPT_CHECKPOINT_EVERY, required_argument, "SEC",
+        .help="Seconds between checkpoint saves (default 60)"},
+    {"merge", OPT_MERGE, required_argument, "FILENAME",
+        .help="Merge the rendering checkpoints given as inputs into a png"},
+    {"batch", OPT_BATCH,
+        .help="Run the scripts given as inputs in parallel and exit"},
     {"help", OPT_HELP, .help="Give this help list"},
     {"version", OPT_VERSION, .help="Print program version"},
     {}
@@ -153,10 +211,67 @@ static void parse_options(int argc, char **argv, args_t *args)
         case OPT_SCRIPT:
             args->script = optarg;
             break;
+        case OPT_RENDER:
+            args->render = optarg;
+            break;
+        case OPT_RENDER_SIZE:
+            if (sscanf(optarg, "%dx%d", &args->render_size[0],
+                       &args->render_size[1]) != 2) {
+                fprintf(stderr, "Invalid size '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_SAMPLES:
+            args->samples = atoi(optarg);
+            break;
+        case OPT_WORLD:
+            args->world = optarg;
+            break;
+        case OPT_FLOOR:
+            args->floor = optarg;
+            break;
+        case OPT_CAMERA:
+            args->camera = optarg;
+            break;
+        case OPT_RENDER_BACKEND:
+            args->render_backend = optarg;
+            break;
+        case OPT_REGION:
+            if (sscanf(optarg, "%d,%d,%d,%d", &args->region[0],
+                       &args->region[1], &args->region[2],
+                       &args->region[3]) != 4) {
+                fprintf(stderr, "Invalid region '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+        case OPT_CHECKPOINT:
+            args->checkpoint = optarg;
+            break;
+        case OPT_CHECKPOINT_EVERY:
+            args->checkpoint_interval = atof(optarg);
+            break;
+        case OPT_MERGE:
+            args->merge = optarg;
+            break;
+        case OPT_BATCH:
+            args->batch = true;
+            break;
         case '?':
             exit(-1);
         }
     }
+    if (args->merge) {
+        while (optind < argc &&
+               args->merge_inputs_nb < ARRAY_SIZE(args->merge_inputs)) {
+            args->merge_inputs[args->merge_inputs_nb++] = argv[optind++];
+        }
+    }
+    if (args->batch) {
+        while (optind < argc &&
+               args->batch_scripts_nb < ARRAY_SIZE(args->batch_scripts)) {
+            args->batch_scripts[args->batch_scripts_nb++] = argv[optind++];
+        }
+    }
     if (optind < argc) {
         if (args->script) {
             args->script_args[args->script_args_nb++] = argv[optind];
@@ -166,6 +281,84 @@ static void parse_options(int argc, char **argv, args_t *args)
     }
 }
 
+// Return the index of a name in a NULL terminated list, or -1.
+static int parse_enum(const char *value, const char *const *names)
+{
+    int i;
+    for (i = 0; names[i]; i++) {
+        if (strcmp(value, names[i]) == 0) return i;
+    }
+    fprintf(stderr, "Invalid value '%s'\n", value);
+    return -1;
+}
+
+/*
+ * Render the input image with the path tracer, without creating any
+ * window.
+ */
+static int render_offline(const args_t *args)
+{
+    pathtracer_t *pt = &goxel.pathtracer;
+    camera_t *camera;
+    double samples_per_sec;
+    double start_time;
+    int ret, nb_pixels;
+
+    if (!args->input) {
+        LOG_E("trying to render an empty image");
+        return -1;
+    }
+    if (goxel_import_file(args->input, NULL) != 0) return -1;
+
+    if (args->render_size[0] > 0 && args->render_size[1] > 0) {
+        goxel.image->export_width = args->render_size[0];
+        goxel.image->export_height = args->render_size[1];
+    }
+    if (args->samples > 0)
+        pt->num_samples = args->samples;
+    if (args->world) {
+        pt->world.type = parse_enum(args->world,
+                (const char*[]){"none", "uniform", "sky", NULL});
+        if (pt->world.type < 0) return -1;
+    }
+    if (args->floor) {
+        pt->floor.type = parse_enum(args->floor,
+                (const char*[]){"none", "plane", NULL});
+        if (pt->floor.type < 0) return -1;
+    }
+    if (args->render_backend) {
+        pt->backend = parse_enum(args->render_backend,
+                (const char*[]){"mesh", "voxels", NULL});
+        if (pt->backend < 0) return -1;
+    }
+    if (args->camera) {
+        DL_FOREACH(goxel.image->cameras, camera) {
+            if (strcmp(camera->name, args->camera) == 0) break;
+        }
+        if (!camera) {
+            fprintf(stderr, "No camera named '%s'\n", args->camera);
+            return -1;
+        }
+        goxel.image->active_camera = camera;
+    }
+
+    memcpy(pt->region, args->region, sizeof(pt->region));
+    pt->checkpoint.path = args->checkpoint;
+    pt->checkpoint.interval = args->checkpoint_interval;
+
+    start_time = sys_get_time();
+    ret = goxel_render_to_file(args->render, &samples_per_sec);
+    if (ret) return ret;
+    nb_pixels = goxel.image->export_width * goxel.image->export_height;
+    if (args->region[2] > 0 && args->region[3] > 0)
+        nb_pixels = args->region[2] * args->region[3];
+    printf("Rendered %s: %dx%d, %d samples in %.1fs (%.2f samples/s, "
+           "%.2f Msamples/s)\n", args->render,
+           goxel.image->export_width, goxel.image->export_height,
+           pt->num_samples, sys_get_time() - start_time, samples_per_sec,
+           samples_per_sec * nb_pixels / 1e6);
+    return 0;
+}
 
 static void loop_function(void *arg)
 {
@@ -367,7 +560,7 @@ static bool open_dialog(
 
 int main(int argc, char **argv)
 {
-    args_t args = {.scale = 1};
+    args_t args = {.scale = 1, .checkpoint_interval = 60};
     GLFWwindow *window;
     GLFWmonitor *monitor;
     const GLFWvidmode *mode;
@@ -384,6 +577,28 @@ int main(int argc, char **argv)
 
     g_scale = args.scale;
 
+    if (args.merge) {
+        return pathtracer_merge_checkpoints(
+                args.merge_inputs_nb, args.merge_inputs, args.merge);
+    }
+
+    // Batch scripts each work on their own image, without any window.
+    if (args.batch) {
+        goxel_init();
+        ret = script_run_parallel(args.batch_scripts_nb, args.batch_scripts,
+                                  0, NULL) ? -1 : 0;
+        goxel_release();
+        return ret;
+    }
+
+    // Offline rendering doesn't need any window or graphics context.
+    if (args.render) {
+        goxel_init();
+        ret = render_offline(&args);
+        goxel_release();
+        return ret;
+    }
+
     glfwSetErrorCallback(on_glfw_error);
     glfwInit();
     glfwWindowHint(GLFW_SAMPLES, 4);
@@ -98,6 +98,37 @@ static void compute_triangle_normal(const mc_vert_t t[3], float out[3])
     vec3_normalize(out, out);
 }
 
+// Compute a vertex normal from the density gradient at the two cube
+// corners of the vertex, using a 3x3x3 Sobel operator on the voxels alpha.
+// The data block starts one voxel before the tile and has a size of N + 3.
+static bool mc_density_normal(const uint8_t *data, const int pos[3],
+                              const mc_vert_t *vert, float out[3])
+{
+    int i, j, x, y, z, d, p[3];
+    const int s = N + 3;
+    float g[2][3] = {};
+
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < 3; i++)
+            p[i] = pos[i] + VERTICES_POSITIONS[j ? vert->v1 : vert->v0][i];
+        for (z = -1; z <= 1; z++)
+        for (y = -1; y <= 1; y++)
+        for (x = -1; x <= 1; x++) {
+            d = data[((p[2] + z + 1) * s * s + (p[1] + y + 1) * s +
+                      (p[0] + x + 1)) * 4 + 3];
+            if (!d) continue;
+            // The density decreases toward the outside.
+            g[j][0] -= x * (2 - abs(y)) * (2 - abs(z)) * d;
+            g[j][1] -= y * (2 - abs(x)) * (2 - abs(z)) * d;
+            g[j][2] -= z * (2 - abs(x)) * (2 - abs(y)) * d;
+        }
+    }
+    vec3_mix(g[0], g[1], vert->mu, out);
+    if (vec3_norm2(out) < 1e-6) return false;
+    vec3_normalize(out, out);
+    return true;
+}
+
 static void mix_pos(const float a[3], const float b[3], float out[3])
 {
     int i;
@@ -255,6 +286,7 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
     int i, vi, x, y, z, v, vx, vy, vz, nb_tri, nb_tri_tot = 0;
     uint8_t tmp[4];
     uint8_t *data;
+    float vn[3];
 
     int densities[8];
     int p[3], s[3];
@@ -269,20 +301,21 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
     *subdivide = MC_VOXEL_SUB_POS;
 
     // To speed things up we first get the voxel cube around the block.
-    data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
+    // There is one more voxel after the block, for the smooth normals.
+    data = malloc((N + 3) * (N + 3) * (N + 3) * 4);
     p[0] = block_pos[0] - 1;
     p[1] = block_pos[1] - 1;
     p[2] = block_pos[2] - 1;
-    s[0] = N + 2;
-    s[1] = N + 2;
-    s[2] = N + 2;
+    s[0] = N + 3;
+    s[1] = N + 3;
+    s[2] = N + 3;
     volume_read(volume, p, s, data);
 
 #define get_at(d, x, y, z, out) do { \
     memcpy(out, &data[( \
                 (x + 1) + \
-                (y + 1) * (N + 2) + \
-                (z + 1) * (N + 2) * (N + 2)) * 4], 4); \
+                (y + 1) * (N + 3) + \
+                (z + 1) * (N + 3) * (N + 3)) * 4], 4); \
 } while (0)
 
     // Get the smallest rect we need to consider.
@@ -347,9 +380,12 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
                 out[vi].pos[0] = tri[i][v].pos[0] + x * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
                 out[vi].pos[1] = tri[i][v].pos[1] + y * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
                 out[vi].pos[2] = tri[i][v].pos[2] + z * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
-                out[vi].normal[0] = n[0] * 64;
-                out[vi].normal[1] = n[1] * 64;
-                out[vi].normal[2] = n[2] * 64;
+                if (flat || !mc_density_normal(data, (int[]){x, y, z},
+                                               &tri[i][v], vn))
+                    vec3_copy(n, vn);
+                out[vi].normal[0] = vn[0] * 64;
+                out[vi].normal[1] = vn[1] * 64;
+                out[vi].normal[2] = vn[2] * 64;
                 // XXX: this shouldn't matter.
                 memset(out[vi].occlusion_uv, 0, sizeof(out[vi].occlusion_uv));
                 memset(out[vi].bump_uv, 0, sizeof(out[vi].bump_uv));
@@ -18,29 +18,172 @@
 
 #include "goxel.h"
 
+#include "../ext_src/stb/stb_ds.h"
+
+#include <limits.h>
+
+// The nearest color search uses a grid of 8x8x8 cells of 32 values.
+#define GRID_SHIFT 5
+#define GRID_SIZE (256 >> GRID_SHIFT)
+
+typedef struct {
+    uint64_t key;   // rgba color, see color_key.
+    int value;      // First entry with this color.
+} color_index_t;
+
+struct palette_index {
+    int size;               // Number of entries indexed.
+    color_index_t *colors;
+    int *cells[GRID_SIZE][GRID_SIZE][GRID_SIZE]; // Entries of each cell.
+};
+
+/*
+ * Perceptual distance between two colors, using the 'redmean' weighting:
+ * https://www.compuphase.com/cmetric.htm
+ *
+ * All the weights are at least two, which gives us a lower bound of the
+ * distance from the difference along any channel.
+ */
+static int color_dist(const uint8_t a[4], const uint8_t b[4])
+{
+    int rmean = (a[0] + b[0]) / 2;
+    int dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+    return (((512 + rmean) * dr * dr) >> 8) + 4 * dg * dg +
+           (((767 - rmean) * db * db) >> 8);
+}
+
+// stb_ds hashes the 4th and 8th bytes of the keys with a signed shift
+// that overflows for values of 128 or more, so we use 8 bytes keys with
+// those bytes set to zero.
+static uint64_t color_key(const uint8_t c[4])
+{
+    return c[0] | (c[1] << 8) | (c[2] << 16) | ((uint64_t)c[3] << 32);
+}
+
+static void index_delete(palette_index_t *index)
+{
+    int x, y, z;
+    if (!index) return;
+    hmfree(index->colors);
+    for (x = 0; x < GRID_SIZE; x++)
+    for (y = 0; y < GRID_SIZE; y++)
+    for (z = 0; z < GRID_SIZE; z++)
+        arrfree(index->cells[x][y][z]);
+    free(index);
+}
+
+void palette_update_index(palette_t *p)
+{
+    const uint8_t *c;
+    uint64_t key;
+    int i;
+
+    if (p->index && p->index->size > p->size) {
+        index_delete(p->index);
+        p->index = NULL;
+    }
+    if (!p->index) {
+        p->index = calloc(1, sizeof(*p->index));
+        hmdefault(p->index->colors, -1);
+    }
+    for (i = p->index->size; i < p->size; i++) {
+        c = p->entries[i].color;
+        key = color_key(c);
+        if (hmgeti(p->index->colors, key) == -1)
+            hmput(p->index->colors, key, i);
+        arrput(p->index->cells[c[0] >> GRID_SHIFT][c[1] >> GRID_SHIFT]
+                              [c[2] >> GRID_SHIFT], i);
+    }
+    p->index->size = p->size;
+}
+
+/*
+ * Search the grid cells at an increasing distance from the color, until
+ * the remaining cells are all further than the best match so far.
+ */
+static int search_nearest(const palette_t *palette,
+                          const palette_index_t *index, const uint8_t col[4])
+{
+    int c[3], r, x, y, z, i, j, d, bound, best = -1, best_dist = INT_MAX;
+    int *cell;
+
+    for (i = 0; i < 3; i++) c[i] = col[i] >> GRID_SHIFT;
+    for (r = 0; r < GRID_SIZE; r++) {
+        bound = r ? ((r - 1) << GRID_SHIFT) : 0;
+        if (best_dist <= 2 * bound * bound) break;
+        for (x = max(c[0] - r, 0); x <= min(c[0] + r, GRID_SIZE - 1); x++)
+        for (y = max(c[1] - r, 0); y <= min(c[1] + r, GRID_SIZE - 1); y++)
+        for (z = max(c[2] - r, 0); z <= min(c[2] + r, GRID_SIZE - 1); z++) {
+            // Only the cells on the border of the cube.
+            if (max(max(abs(x - c[0]), abs(y - c[1])), abs(z - c[2])) != r)
+                continue;
+            cell = index->cells[x][y][z];
+            for (j = 0; j < arrlen(cell); j++) {
+                i = cell[j];
+                d = color_dist(col, palette->entries[i].color);
+                if (d < best_dist || (d == best_dist && i < best)) {
+                    best = i;
+                    best_dist = d;
+                }
+            }
+        }
+    }
+    return best;
+}
+
 /*
  * Function: palette_search
  * Search a given color in a palette
  *
+ * The entries added since the last call to palette_update_index are
+ * searched linearly.  The palette is not modified, so concurrent searches
+ * are safe.
+ *
  * Parameters:
  *   palette    - A palette.
  *   col        - The color we are looking for.
  *   exact      - If set to true, return -1 if no color is found, else
- *                return the closest color.
+ *                return the closest color (ignoring alpha), using the
+ *                'redmean' perceptual distance.
  *
  * Return:
- *   The index of the color in the palette.
+ *   The index of the color in the palette.  If several entries match, the
+ *   first one.
  */
 int palette_search(const palette_t *palette, const uint8_t col[4],
                    bool exact)
 {
-    int i;
-    assert(exact); // For the moment.
-    for (i = 0; i < palette->size; i++) {
-        if (memcmp(col, palette->entries[i].color, 4) == 0)
-            return i;
+    const palette_index_t *index = palette->index;
+    color_index_t *colors;
+    ptrdiff_t tmp;
+    int i, d, start = 0, ret = -1, best_dist = INT_MAX;
+
+    // An index bigger than the palette is out of date.
+    if (index && index->size <= palette->size) {
+        // Use the thread safe version of hmget, since the normal one
+        // stores the result in the hash map.
+        colors = index->colors;
+        ret = hmget_ts(colors, color_key(col), tmp);
+        if (ret != -1) return ret;
+        start = index->size;
+    }
+    for (i = start; i < palette->size; i++) {
+        if (memcmp(palette->entries[i].color, col, 4) == 0) return i;
+    }
+    if (exact) return -1;
+
+    if (start) {
+        ret = search_nearest(palette, index, col);
+        best_dist = color_dist(col, palette->entries[ret].color);
+    }
+    for (i = start; i < palette->size; i++) {
+        d = color_dist(col, palette->entries[i].color);
+        if (d < best_dist) {
+            ret = i;
+            best_dist = d;
+        }
     }
-    return -1;
+    return ret;
 }
 
 void palette_insert(palette_t *p, const uint8_t col[4], const char *name)
@@ -57,6 +200,29 @@ void palette_insert(palette_t *p, const uint8_t col[4], const char *name)
     if (name)
         snprintf(e->name, sizeof(e->name), "%s", name);
     p->size++;
+    palette_update_index(p);
+}
+
+void palette_copy(const palette_t *src, palette_t *dst)
+{
+    memset(dst, 0, sizeof(*dst));
+    memcpy(dst->name, src->name, sizeof(dst->name));
+    dst->columns = src->columns;
+    dst->size = src->size;
+    dst->allocated = src->size;
+    dst->entries = malloc(src->size * sizeof(*dst->entries));
+    memcpy(dst->entries, src->entries, src->size * sizeof(*dst->entries));
+    palette_update_index(dst);
+}
+
+void palette_release(palette_t *palette)
+{
+    index_delete(palette->index);
+    palette->index = NULL;
+    free(palette->entries);
+    palette->entries = NULL;
+    palette->size = 0;
+    palette->allocated = 0;
 }
 
 
@@ -29,6 +29,9 @@ typedef struct {
     char     name[256];
 } palette_entry_t;
 
+// Index of the palette colors, used by palette_search.
+typedef struct palette_index palette_index_t;
+
 typedef struct palette palette_t;
 struct palette {
     palette_t *next, *prev; // For the global list of palettes.
@@ -37,6 +40,7 @@ struct palette {
     int     size;
     int     allocated;
     palette_entry_t *entries;
+    palette_index_t *index; // Updated by palette_update_index.
 };
 
 // Load all the available palettes into a list.
@@ -46,18 +50,53 @@ void palette_load_all(palette_t **list);
  * Function: palette_search
  * Search a given color in a palette
  *
+ * The entries added since the last call to palette_update_index are
+ * searched linearly.  The palette is not modified, so concurrent searches
+ * are safe.
+ *
  * Parameters:
  *   palette    - A palette.
  *   col        - The color we are looking for.
  *   exact      - If set to true, return -1 if no color is found, else
- *                return the closest color.
+ *                return the closest color (ignoring alpha), using the
+ *                'redmean' perceptual distance.
  *
  * Return:
- *   The index of the color in the palette.
+ *   The index of the color in the palette.  If several entries match, the
+ *   first one.
  */
 int palette_search(const palette_t *palette, const uint8_t col[4],
                    bool exact);
 
+/*
+ * Function: palette_insert
+ * Add a color at the end of a palette if it is not already in it, and
+ * update the index.
+ */
 void palette_insert(palette_t *p, const uint8_t col[4], const char *name);
 
+/*
+ * Function: palette_update_index
+ * Add the new entries of a palette to its index of colors
+ *
+ * Entries already indexed should not be modified in place.  Call this
+ * after adding entries directly, and before searching the palette from
+ * several threads.
+ */
+void palette_update_index(palette_t *palette);
+
+/*
+ * Function: palette_copy
+ * Copy the entries of a palette into an other one, and index them.
+ *
+ * The destination should be released with <palette_release>.
+ */
+void palette_copy(const palette_t *src, palette_t *dst);
+
+/*
+ * Function: palette_release
+ * Free the entries and the index of a palette, but not the palette itself.
+ */
+void palette_release(palette_t *palette);
+
 #endif // PALETTE_H
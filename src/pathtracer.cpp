@@ -39,6 +39,9 @@
 #include <iterator>
 #include <future>
 #include <deque>
+#include <unordered_map>
+#include <array>
+#include <climits>
 
 extern "C" {
 #include "goxel.h"
@@ -60,6 +63,36 @@ enum {
     CHANGE_MATERIAL     = 1 << 7,
 };
 
+// Identify the mesh of a tile: since the mesh depends on the tile
+// neighbors, we use all the 27 data ids around the tile, as the renderer
+// does for its own cache.  The effects are stored on 64 bits so that the
+// struct has no padding, since we hash and compare it as raw bytes.
+struct tile_key_t {
+    uint64_t effects;
+    uint64_t ids[27];
+
+    bool operator==(const tile_key_t &other) const {
+        return memcmp(this, &other, sizeof(*this)) == 0;
+    }
+};
+static_assert(sizeof(tile_key_t) == 28 * sizeof(uint64_t), "");
+
+struct tile_key_hash_t {
+    size_t operator()(const tile_key_t &key) const {
+        return XXH32(&key, sizeof(key), 0);
+    }
+};
+
+// A layer used by the voxels traversal backend.
+struct voxels_layer_t {
+    volume_t *volume;       // Copy of the layer volume (cheap with COW).
+    int instance;           // Scene instance used for the material.
+    int tiles_min[3];       // Position of the first tile, in tiles unit.
+    int tiles_size[3];      // Size of the tiles grid.
+    // Dense grid of the tiles voxels data, NULL for empty tiles.
+    vector<const uint8_t*> tiles;
+};
+
 struct pathtracer_internal {
 
     // Different hash keys to quickly check for state changes.
@@ -74,6 +107,14 @@ struct pathtracer_internal {
 
     scene_data scene;
     trace_bvh bvh;
+
+    // Index of the tile shapes of the current scene, -1 for empty shapes.
+    // Used to only regenerate the shapes of the modified tiles.
+    unordered_map<tile_key_t, int, tile_key_hash_t> tiles_shapes;
+    int nb_tiles_instances;
+
+    // Used instead of the tiles shapes with PT_BACKEND_VOXELS.
+    vector<voxels_layer_t> voxels_layers;
     trace_context context;
 
     // image_data image;
@@ -87,6 +128,15 @@ struct pathtracer_internal {
     int trace_sample;
 };
 
+// Run func(i) for i in [0, n) with parallel_for.
+template <typename Func>
+static void run_parallel(size_t n, Func &&func)
+{
+    parallel_for(n, [](void *user, int i, int thread) {
+        (*(typename remove_reference<Func>::type*)user)(i);
+    }, &func);
+}
+
 // Add a material to the scene and return its id.
 static int add_material(pathtracer_t *pt, const material_t *mat)
 {
@@ -152,6 +202,221 @@ end:
 }
 
 
+static void release_voxels_layers(pathtracer_internal_t *p)
+{
+    for (auto &layer : p->voxels_layers) volume_delete(layer.volume);
+    p->voxels_layers.clear();
+}
+
+// Create a voxels layer for the direct traversal backend.
+static voxels_layer_t create_voxels_layer(const volume_t *volume,
+                                          int instance)
+{
+    voxels_layer_t layer = {};
+    volume_iterator_t iter;
+    int i, pos[3], bmin[3] = {INT_MAX, INT_MAX, INT_MAX},
+        bmax[3] = {INT_MIN, INT_MIN, INT_MIN};
+    uint64_t id;
+    const uint8_t *data;
+    size_t idx;
+
+    layer.volume = volume_copy(volume);
+    layer.instance = instance;
+
+    iter = volume_get_iterator(layer.volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        volume_get_tile_data(layer.volume, &iter, pos, &id);
+        if (id == 0) continue;
+        for (i = 0; i < 3; i++) {
+            bmin[i] = min(bmin[i], pos[i] / TILE_SIZE);
+            bmax[i] = max(bmax[i], pos[i] / TILE_SIZE + 1);
+        }
+    }
+    if (bmin[0] >= bmax[0]) return layer;
+    for (i = 0; i < 3; i++) {
+        layer.tiles_min[i] = bmin[i];
+        layer.tiles_size[i] = bmax[i] - bmin[i];
+    }
+    layer.tiles.resize((size_t)layer.tiles_size[0] * layer.tiles_size[1] *
+                       layer.tiles_size[2]);
+
+    iter = volume_get_iterator(layer.volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        data = (const uint8_t*)volume_get_tile_data(
+                layer.volume, &iter, pos, &id);
+        if (id == 0) continue;
+        idx = (pos[0] / TILE_SIZE - bmin[0]) +
+              (pos[1] / TILE_SIZE - bmin[1]) * (size_t)layer.tiles_size[0] +
+              (pos[2] / TILE_SIZE - bmin[2]) * (size_t)layer.tiles_size[0] *
+                                               layer.tiles_size[1];
+        layer.tiles[idx] = data;
+    }
+    return layer;
+}
+
+// Intersect a ray with an aabb, also return the axis of the entry face.
+static bool intersect_aabb(const ray3f &ray, const vec3f &bmin,
+                           const vec3f &bmax, float &t0, float &t1,
+                           int &axis)
+{
+    float ta, tb;
+    int i;
+
+    t0 = ray.tmin;
+    t1 = ray.tmax;
+    axis = -1;
+    for (i = 0; i < 3; i++) {
+        if (ray.d[i] == 0) {
+            if (ray.o[i] < bmin[i] || ray.o[i] > bmax[i]) return false;
+            continue;
+        }
+        ta = (bmin[i] - ray.o[i]) / ray.d[i];
+        tb = (bmax[i] - ray.o[i]) / ray.d[i];
+        if (ta > tb) swap(ta, tb);
+        if (ta > t0) {
+            t0 = ta;
+            axis = i;
+        }
+        t1 = min(t1, tb);
+        if (t0 > t1) return false;
+    }
+    return true;
+}
+
+static float srgb8_to_linear(uint8_t v)
+{
+    static const auto table = []() {
+        array<float, 256> ret;
+        for (int i = 0; i < 256; i++) ret[i] = srgb_to_rgb(i / 255.f);
+        return ret;
+    }();
+    return table[v];
+}
+
+// Voxels DDA traversal inside a single tile, between t0 and t1.
+// axis is the axis of the face we entered the tile from, or -1 if the ray
+// starts inside the tile.
+static bool intersect_tile(const uint8_t *data, const int tile_pos[3],
+                           const ray3f &ray, float t0, float t1, int axis,
+                           const int step[3], scene_intersection &out)
+{
+    const int N = TILE_SIZE;
+    int i, v[3];
+    float t = t0, tnext[3], tdelta[3];
+    vec3f p = ray.o + ray.d * t0;
+    const uint8_t *voxel;
+
+    for (i = 0; i < 3; i++) {
+        v[i] = clamp((int)floor(p[i]) - tile_pos[i], 0, N - 1);
+        if (step[i] == 0) {
+            tnext[i] = tdelta[i] = flt_max;
+            continue;
+        }
+        tnext[i] = (tile_pos[i] + v[i] + (step[i] > 0 ? 1 : 0) - ray.o[i]) /
+                   ray.d[i];
+        tdelta[i] = 1.f / fabs(ray.d[i]);
+    }
+
+    while (true) {
+        voxel = &data[(v[0] + v[1] * N + v[2] * N * N) * 4];
+        // Note: if the ray starts inside a voxel we ignore it, this
+        // prevents self intersections of the secondary rays.
+        if (voxel[3] >= 127 && axis != -1) {
+            out.hit = true;
+            out.custom = true;
+            out.distance = t;
+            out.position = ray.o + ray.d * t;
+            out.normal = {0, 0, 0};
+            out.normal[axis] = (float)-step[axis];
+            out.color = {srgb8_to_linear(voxel[0]),
+                         srgb8_to_linear(voxel[1]),
+                         srgb8_to_linear(voxel[2]), 1.0f};
+            return true;
+        }
+        axis = (tnext[0] < tnext[1]) ? (tnext[0] < tnext[2] ? 0 : 2)
+                                     : (tnext[1] < tnext[2] ? 1 : 2);
+        t = tnext[axis];
+        if (t > t1) return false;
+        v[axis] += step[axis];
+        if (v[axis] < 0 || v[axis] >= N) return false;
+        tnext[axis] += tdelta[axis];
+    }
+}
+
+// Two level DDA traversal of a voxels layer: first over the tiles grid,
+// skipping the empty tiles, then over the voxels of the non empty tiles.
+static bool intersect_voxels_layer(const voxels_layer_t &layer,
+                                   const ray3f &ray,
+                                   scene_intersection &out)
+{
+    const int N = TILE_SIZE;
+    int i, axis, step[3], ti[3], tile_pos[3];
+    float t0, t1, t, tnext[3], tdelta[3];
+    vec3f bmin, bmax, p;
+    const uint8_t *data;
+
+    if (layer.tiles.empty()) return false;
+    for (i = 0; i < 3; i++) {
+        bmin[i] = layer.tiles_min[i] * N;
+        bmax[i] = (layer.tiles_min[i] + layer.tiles_size[i]) * N;
+    }
+    if (!intersect_aabb(ray, bmin, bmax, t0, t1, axis)) return false;
+
+    p = ray.o + ray.d * t0;
+    for (i = 0; i < 3; i++) {
+        step[i] = ray.d[i] > 0 ? 1 : ray.d[i] < 0 ? -1 : 0;
+        ti[i] = clamp((int)floor(p[i] / N) - layer.tiles_min[i],
+                      0, layer.tiles_size[i] - 1);
+        if (step[i] == 0) {
+            tnext[i] = tdelta[i] = flt_max;
+            continue;
+        }
+        tnext[i] = ((layer.tiles_min[i] + ti[i] + (step[i] > 0 ? 1 : 0)) * N
+                    - ray.o[i]) / ray.d[i];
+        tdelta[i] = N / fabs(ray.d[i]);
+    }
+
+    t = t0;
+    while (true) {
+        data = layer.tiles[ti[0] + ti[1] * (size_t)layer.tiles_size[0] +
+                           ti[2] * (size_t)layer.tiles_size[0] *
+                                   layer.tiles_size[1]];
+        if (data) {
+            for (i = 0; i < 3; i++)
+                tile_pos[i] = (layer.tiles_min[i] + ti[i]) * N;
+            if (intersect_tile(data, tile_pos, ray, t,
+                               min(t1, min(tnext[0], min(tnext[1], tnext[2]))),
+                               axis, step, out)) {
+                out.instance = layer.instance;
+                return true;
+            }
+        }
+        axis = (tnext[0] < tnext[1]) ? (tnext[0] < tnext[2] ? 0 : 2)
+                                     : (tnext[1] < tnext[2] ? 1 : 2);
+        t = tnext[axis];
+        if (t > t1) return false;
+        ti[axis] += step[axis];
+        if (ti[axis] < 0 || ti[axis] >= layer.tiles_size[axis]) return false;
+        tnext[axis] += tdelta[axis];
+    }
+}
+
+static scene_intersection intersect_voxels(const pathtracer_internal_t *p,
+                                           const ray3f &ray_, bool find_any)
+{
+    scene_intersection ret = {}, hit;
+    ray3f ray = ray_;
+
+    for (const auto &layer : p->voxels_layers) {
+        hit = {};
+        if (!intersect_voxels_layer(layer, ray, hit)) continue;
+        ret = hit;
+        if (find_any) break;
+        ray.tmax = hit.distance;
+    }
+    return ret;
+}
+
 static int check_changes(pathtracer_t *pt)
 {
     uint32_t key, k;
@@ -174,6 +439,7 @@ static int check_changes(pathtracer_t *pt)
                 sizeof(goxel.rend.settings.effects), key);
     key = XXH32(&pt->floor.type, sizeof(pt->floor.type), key);
     key = XXH32(&pt->floor, sizeof(pt->floor), key);
+    key = XXH32(&pt->backend, sizeof(pt->backend), key);
     if (key != p->volume_key) {
         p->volume_key = key;
         changes |= CHANGE_VOLUME;
@@ -260,47 +526,164 @@ static void update_camera(pathtracer_t *pt)
     }
 }
 
-static void update_scene(pathtracer_t *pt)
+static tile_key_t get_tile_key(const volume_t *volume, const int tile_pos[3],
+                               int effects)
+{
+    tile_key_t key;
+    int i, x, y, z, p[3];
+
+    memset(&key, 0, sizeof(key));
+    key.effects = effects;
+    for (i = 0, z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++, i++) {
+        p[0] = tile_pos[0] + x * TILE_SIZE;
+        p[1] = tile_pos[1] + y * TILE_SIZE;
+        p[2] = tile_pos[2] + z * TILE_SIZE;
+        volume_get_tile_data(volume, NULL, p, &key.ids[i]);
+    }
+    return key;
+}
+
+// Add all the layers tiles shapes and instances into the scene.
+// The shapes (and their bvh) of the tiles that didn't change since the
+// last update are moved from the previous scene instead of being
+// regenerated.
+static void update_volume_shapes(pathtracer_t *pt, scene_data &old_scene,
+                                 vector<shape_bvh> &old_bvhs)
 {
-    volume_iterator_t iter;
-    const volume_t *volume;
-    int tile_pos[3];
-    shape_data shape;
     pathtracer_internal_t *p = pt->p;
     const layer_t *layers, *layer;
-    float light_dir[3];
-    float ke;
-    const float d = 10000;
-    bool has_sun = false;
-    float turbidity = 3;
-    float pos[3];
-    vec4f color;
-    image_data image;
+    const volume_t *volume;
+    volume_iterator_t iter;
+    int tile_pos[3], idx, material, voxels_shape = -1;
+    int effects = goxel.rend.settings.effects;
+    bool use_voxels = pt->backend == PT_BACKEND_VOXELS &&
+                      !(effects & EFFECT_MARCHING_CUBES);
+    tile_key_t key;
+    unordered_map<tile_key_t, int, tile_key_hash_t> old_tiles_shapes;
+    vector<pair<const volume_t*, vec3i>> new_tiles;
+    vector<int> new_shapes;
 
-    p->scene = {};
-    p->lights = {};
+    swap(old_tiles_shapes, p->tiles_shapes);
+    release_voxels_layers(p);
 
     layers = goxel_get_render_layers(false);
     DL_FOREACH(layers, layer) {
         if (!layer->visible || !layer->volume) continue;
         volume = layer->volume;
+        material = add_material(pt, layer->material);
+
+        // With the voxels backend we only need a single instance per layer
+        // to hold the material, with a dummy empty shape.
+        if (use_voxels) {
+            if (voxels_shape == -1) {
+                voxels_shape = (int)p->scene.shapes.size();
+                p->scene.shapes.push_back({});
+                p->bvh.bvh.shapes.push_back({});
+            }
+            p->scene.instances.push_back({
+                .shape = voxels_shape,
+                .material = material,
+            });
+            p->voxels_layers.push_back(create_voxels_layer(
+                        volume, (int)p->scene.instances.size() - 1));
+            continue;
+        }
+
         iter = volume_get_iterator(volume,
                         VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
         while (volume_iter(&iter, tile_pos)) {
-            shape = create_shape_for_tile(volume, tile_pos);
-            if (shape.positions.empty()) continue;
-            p->scene.shapes.push_back(shape);
+            key = get_tile_key(volume, tile_pos, effects);
+            auto it = p->tiles_shapes.find(key);
+            if (it != p->tiles_shapes.end()) {
+                idx = it->second;
+            } else {
+                auto old = old_tiles_shapes.find(key);
+                if (old != old_tiles_shapes.end() && old->second == -1) {
+                    idx = -1;
+                } else if (old != old_tiles_shapes.end()) {
+                    idx = (int)p->scene.shapes.size();
+                    p->scene.shapes.push_back(
+                            std::move(old_scene.shapes[old->second]));
+                    p->bvh.bvh.shapes.push_back(
+                            std::move(old_bvhs[old->second]));
+                } else {
+                    // New shape, we generate it later in parallel.
+                    idx = (int)p->scene.shapes.size();
+                    p->scene.shapes.push_back({});
+                    p->bvh.bvh.shapes.push_back({});
+                    new_shapes.push_back(idx);
+                    new_tiles.push_back({volume,
+                            {tile_pos[0], tile_pos[1], tile_pos[2]}});
+                }
+                p->tiles_shapes[key] = idx;
+            }
+            if (idx == -1) continue;
             p->scene.instances.push_back({
                 .frame = translation_frame({
                         (float)tile_pos[0],
                         (float)tile_pos[1],
                         (float)tile_pos[2]}),
-                .shape = (int)(p->scene.shapes.size() - 1),
-                .material = add_material(pt, layer->material),
+                .shape = idx,
+                .material = material,
             });
         }
     }
 
+    // Only read access to the volumes from now, so it is safe to
+    // generate the new shapes in parallel.
+    run_parallel(new_shapes.size(), [&](size_t i) {
+        int idx = new_shapes[i];
+        shape_data &shape = p->scene.shapes[idx];
+        shape = create_shape_for_tile(new_tiles[i].first,
+                                      &new_tiles[i].second.x);
+        if (!shape.positions.empty())
+            p->bvh.bvh.shapes[idx] = make_shape_bvh(shape);
+    });
+
+    // Empty shapes don't need to stay in the scene, but we still keep
+    // their key so that we don't regenerate them next time.
+    for (auto &it : p->tiles_shapes) {
+        if (it.second != -1 && p->scene.shapes[it.second].positions.empty())
+            it.second = -1;
+    }
+    p->scene.instances.erase(
+        remove_if(p->scene.instances.begin(), p->scene.instances.end(),
+            [&](const instance_data &inst) {
+                return inst.shape != voxels_shape &&
+                       p->scene.shapes[inst.shape].positions.empty();
+            }),
+        p->scene.instances.end());
+}
+
+static void update_scene(pathtracer_t *pt)
+{
+    pathtracer_internal_t *p = pt->p;
+    float light_dir[3];
+    float ke;
+    const float d = 10000;
+    bool has_sun = false;
+    float turbidity = 3;
+    float pos[3];
+    vec4f color;
+    image_data image;
+    scene_data old_scene;
+    vector<shape_bvh> old_bvhs;
+    bvh_tree old_tree;
+    int i, nb_instances;
+    bool refit;
+
+    swap(old_scene, p->scene);
+    swap(old_bvhs, p->bvh.bvh.shapes);
+    swap(old_tree, p->bvh.bvh.bvh);
+    p->scene = {};
+    p->bvh = {};
+    p->lights = {};
+
+    update_volume_shapes(pt, old_scene, old_bvhs);
+    nb_instances = (int)p->scene.instances.size();
+
     // Add the floor.
     if (pt->floor.type != PT_FLOOR_NONE) {
         color[0] = pt->floor.color[0] / 255.f;
@@ -375,7 +758,33 @@ static void update_scene(pathtracer_t *pt)
         .material = (int)p->scene.materials.size() - 1,
     });
 
-    p->bvh = make_trace_bvh(p->scene, p->params);
+    // Build the bvh of the extra non tile shapes (floor, light).
+    for (i = p->bvh.bvh.shapes.size(); i < (int)p->scene.shapes.size(); i++)
+        p->bvh.bvh.shapes.push_back(make_shape_bvh(p->scene.shapes[i]));
+
+    // If the tiles positions didn't change we can just refit the instances
+    // bvh, otherwise we rebuild it, but in any case we don't need to touch
+    // the shapes bvh.
+    refit = p->voxels_layers.empty() &&
+            !old_tree.nodes.empty() &&
+            nb_instances == p->nb_tiles_instances &&
+            old_scene.instances.size() == p->scene.instances.size();
+    for (i = 0; refit && i < nb_instances; i++) {
+        if (p->scene.instances[i].frame != old_scene.instances[i].frame)
+            refit = false;
+    }
+    if (refit) {
+        p->bvh.bvh.bvh = std::move(old_tree);
+        update_scene_bvh(p->bvh.bvh, p->scene, {}, {});
+    } else {
+        rebuild_scene_bvh(p->bvh.bvh, p->scene);
+    }
+    p->nb_tiles_instances = nb_instances;
+    if (!p->voxels_layers.empty()) {
+        p->bvh.custom = [p](const ray3f &ray, bool find_any) {
+            return intersect_voxels(p, ray, find_any);
+        };
+    }
     p->lights = make_trace_lights(p->scene, p->params);
 }
 
@@ -459,6 +868,308 @@ void pathtracer_iter(pathtracer_t *pt, const float viewport[4])
     }
 }
 
+// Checkpoint files header.  The header is followed by the region pixels
+// accumulated colors (vec4f) and random generators states (rng_state).
+// Everything is stored in the machine native byte order.
+struct checkpoint_header_t {
+    char magic[8];
+    int32_t version;
+    uint32_t scene_hash;
+    int32_t w, h;
+    int32_t region[4];
+    int32_t samples;
+};
+
+static const char CHECKPOINT_MAGIC[8] = "GOXPTCK";
+static const int CHECKPOINT_VERSION = 1;
+
+// Hash of everything that affects the rendering.  Contrary to the keys
+// used by check_changes, this only depends on the content, so that
+// checkpoints can be shared between processes.
+static uint32_t get_scene_hash(const pathtracer_t *pt)
+{
+    uint32_t hash = 0, crc;
+    const layer_t *layers, *layer;
+    const material_t *mat;
+    const camera_t *camera = goxel.image->active_camera;
+    float light_dir[3];
+
+    layers = goxel_get_render_layers(false);
+    DL_FOREACH(layers, layer) {
+        if (!layer->visible || !layer->volume) continue;
+        crc = volume_crc32(layer->volume);
+        hash = XXH32(&crc, sizeof(crc), hash);
+        mat = layer->material;
+        if (mat) {
+            hash = XXH32(&mat->metallic, sizeof(*mat) -
+                         offsetof(material_t, metallic), hash);
+        }
+    }
+    hash = XXH32(goxel.back_color, sizeof(goxel.back_color), hash);
+    hash = XXH32(&goxel.rend.settings.effects,
+                 sizeof(goxel.rend.settings.effects), hash);
+    hash = XXH32(&pt->world, sizeof(pt->world), hash);
+    hash = XXH32(&pt->floor.type, sizeof(pt->floor.type), hash);
+    hash = XXH32(pt->floor.color, sizeof(pt->floor.color), hash);
+    hash = XXH32(pt->floor.size, sizeof(pt->floor.size), hash);
+    hash = XXH32(&pt->backend, sizeof(pt->backend), hash);
+    render_get_light_dir(&goxel.rend, light_dir);
+    hash = XXH32(light_dir, sizeof(light_dir), hash);
+    hash = XXH32(&goxel.rend.light.intensity,
+                 sizeof(goxel.rend.light.intensity), hash);
+    hash = XXH32(camera->mat, sizeof(camera->mat), hash);
+    hash = XXH32(&camera->fovy, sizeof(camera->fovy), hash);
+    hash = XXH32(&camera->dist, sizeof(camera->dist), hash);
+    hash = XXH32(&camera->ortho, sizeof(camera->ortho), hash);
+    return hash;
+}
+
+static int read_checkpoint_header(FILE *file, checkpoint_header_t *header)
+{
+    if (fread(header, sizeof(*header), 1, file) != 1) return -1;
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, 8) != 0) return -1;
+    if (header->version != CHECKPOINT_VERSION) return -1;
+    return 0;
+}
+
+// Restore the state of the region from a checkpoint file, if it matches
+// the current rendering.
+static int load_checkpoint(pathtracer_t *pt, const int region[4],
+                           uint32_t scene_hash, const char *path)
+{
+    FILE *file;
+    checkpoint_header_t header;
+    trace_state &state = pt->p->state;
+    int x, y, idx, ret = -1;
+
+    file = fopen(path, "rb");
+    if (!file) return -1;
+    if (read_checkpoint_header(file, &header) != 0) {
+        LOG_W("Invalid checkpoint file %s", path);
+        goto end;
+    }
+    if (    header.scene_hash != scene_hash ||
+            header.w != state.width || header.h != state.height ||
+            memcmp(header.region, region, sizeof(header.region)) != 0) {
+        LOG_W("Checkpoint %s doesn't match the current rendering", path);
+        goto end;
+    }
+    for (y = region[1]; y < region[1] + region[3]; y++) {
+        for (x = region[0]; x < region[0] + region[2]; x++) {
+            idx = y * state.width + x;
+            if (    fread(&state.image[idx], sizeof(vec4f), 1, file) != 1 ||
+                    fread(&state.rngs[idx], sizeof(rng_state), 1, file) != 1)
+            {
+                LOG_W("Truncated checkpoint file %s", path);
+                state = make_trace_state(pt->p->scene, pt->p->params);
+                goto end;
+            }
+        }
+    }
+    state.samples = header.samples;
+    LOG_I("Resume rendering from %s (%d samples)", path, state.samples);
+    ret = 0;
+end:
+    fclose(file);
+    return ret;
+}
+
+// Save the state of the region.  We first write into a temporary file so
+// that a killed process never leaves a corrupted checkpoint behind.
+static int save_checkpoint(const pathtracer_t *pt, const int region[4],
+                           uint32_t scene_hash, const char *path)
+{
+    FILE *file;
+    checkpoint_header_t header = {};
+    const trace_state &state = pt->p->state;
+    char tmp_path[1024];
+    int x, y, idx;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    file = fopen(tmp_path, "wb");
+    if (!file) {
+        LOG_E("Cannot save checkpoint to %s", tmp_path);
+        return -1;
+    }
+    memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+    header.version = CHECKPOINT_VERSION;
+    header.scene_hash = scene_hash;
+    header.w = state.width;
+    header.h = state.height;
+    memcpy(header.region, region, sizeof(header.region));
+    header.samples = state.samples;
+    fwrite(&header, sizeof(header), 1, file);
+    for (y = region[1]; y < region[1] + region[3]; y++) {
+        for (x = region[0]; x < region[0] + region[2]; x++) {
+            idx = y * state.width + x;
+            fwrite(&state.image[idx], sizeof(vec4f), 1, file);
+            fwrite(&state.rngs[idx], sizeof(rng_state), 1, file);
+        }
+    }
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        LOG_E("Cannot save checkpoint to %s", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Add one batch of samples to a region of the image.
+static void trace_region(pathtracer_internal_t *p, const int region[4])
+{
+    trace_state &state = p->state;
+    run_parallel(region[3], [&](size_t j) {
+        int x, y = region[1] + (int)j, sample;
+        for (x = region[0]; x < region[0] + region[2]; x++) {
+            for (sample = state.samples;
+                 sample < state.samples + p->params.batch; sample++) {
+                trace_sample(state, p->scene, p->bvh, p->lights, x, y,
+                             sample, p->params);
+            }
+        }
+    });
+    state.samples += p->params.batch;
+}
+
+/*
+ * Function: pathtracer_render
+ * Render the current image synchronously, using all the cores.
+ */
+int pathtracer_render(pathtracer_t *pt, double *samples_per_sec)
+{
+    pathtracer_internal_t *p;
+    double start_time, last_save_time, time;
+    int region[4], start_samples;
+    uint32_t scene_hash = 0;
+    const char *checkpoint = pt->checkpoint.path;
+
+    if (pt->w <= 0 || pt->h <= 0 || pt->num_samples <= 0) return -1;
+    if (!pt->buf) pt->buf = (uint8_t*)calloc(pt->w * pt->h, 4);
+    if (!pt->p) {
+        pt->p = new pathtracer_internal_t {
+            .context = make_trace_context({}),
+        };
+    }
+    p = pt->p;
+    trace_cancel(p->context);
+    check_changes(pt);
+    pt->status = PT_RUNNING;
+
+    update_scene(pt);
+    update_camera(pt);
+    p->params.samples = pt->num_samples;
+    p->params.resolution = max(pt->w, pt->h);
+    p->state = make_trace_state(p->scene, p->params);
+
+    // Clip the region to the image, zero size meaning the full image.
+    if (pt->region[2] > 0 && pt->region[3] > 0) {
+        region[0] = clamp(pt->region[0], 0, p->state.width);
+        region[1] = clamp(pt->region[1], 0, p->state.height);
+        region[2] = min(pt->region[2], p->state.width - region[0]);
+        region[3] = min(pt->region[3], p->state.height - region[1]);
+    } else {
+        region[0] = region[1] = 0;
+        region[2] = p->state.width;
+        region[3] = p->state.height;
+    }
+
+    if (checkpoint) {
+        scene_hash = get_scene_hash(pt);
+        load_checkpoint(pt, region, scene_hash, checkpoint);
+    }
+
+    start_time = last_save_time = sys_get_time();
+    start_samples = p->state.samples;
+    while (p->state.samples < pt->num_samples) {
+        trace_region(p, region);
+        if (    checkpoint && pt->checkpoint.interval > 0 &&
+                sys_get_time() - last_save_time >= pt->checkpoint.interval) {
+            save_checkpoint(pt, region, scene_hash, checkpoint);
+            last_save_time = sys_get_time();
+        }
+    }
+    time = sys_get_time() - start_time;
+    if (checkpoint)
+        save_checkpoint(pt, region, scene_hash, checkpoint);
+    update_preview(pt, get_image(p->state));
+
+    // Mark the context as done so that pathtracer_iter can take over.
+    p->to_sync = 0;
+    p->context.done = true;
+    pt->samples = p->state.samples;
+    pt->status = PT_FINISHED;
+    if (samples_per_sec) {
+        *samples_per_sec = (p->state.samples - start_samples) /
+                           max(time, 1e-6);
+    }
+    return 0;
+}
+
+/*
+ * Function: pathtracer_merge_checkpoints
+ * Merge several checkpoints of the same rendering into a png image.
+ */
+int pathtracer_merge_checkpoints(int nb, const char **paths, const char *out)
+{
+    FILE *file;
+    checkpoint_header_t header, first = {};
+    vector<vec4f> sums;
+    vector<int> weights;
+    vec4f color;
+    rng_state rng;
+    uint8_t *buf;
+    int i, x, y, idx;
+
+    for (i = 0; i < nb; i++) {
+        file = fopen(paths[i], "rb");
+        if (!file || read_checkpoint_header(file, &header) != 0) {
+            LOG_E("Cannot read checkpoint %s", paths[i]);
+            if (file) fclose(file);
+            return -1;
+        }
+        if (i == 0) {
+            first = header;
+            sums.assign(header.w * header.h, {0, 0, 0, 0});
+            weights.assign(header.w * header.h, 0);
+        }
+        if (    header.scene_hash != first.scene_hash ||
+                header.w != first.w || header.h != first.h ||
+                header.region[0] < 0 || header.region[1] < 0 ||
+                header.region[0] + header.region[2] > header.w ||
+                header.region[1] + header.region[3] > header.h) {
+            LOG_E("Checkpoint %s doesn't match %s", paths[i], paths[0]);
+            fclose(file);
+            return -1;
+        }
+        // Overlapping regions are weighted by their number of samples.
+        for (y = header.region[1]; y < header.region[1] + header.region[3];
+             y++) {
+            for (x = header.region[0];
+                 x < header.region[0] + header.region[2]; x++) {
+                if (    fread(&color, sizeof(color), 1, file) != 1 ||
+                        fread(&rng, sizeof(rng), 1, file) != 1) {
+                    LOG_E("Truncated checkpoint file %s", paths[i]);
+                    fclose(file);
+                    return -1;
+                }
+                idx = y * header.w + x;
+                sums[idx] += color * (float)header.samples;
+                weights[idx] += header.samples;
+            }
+        }
+        fclose(file);
+    }
+    if (nb == 0) return -1;
+
+    buf = (uint8_t*)calloc(first.w * first.h, 4);
+    for (idx = 0; idx < first.w * first.h; idx++) {
+        if (!weights[idx]) continue;
+        color = rgb_to_srgb(sums[idx] / (float)weights[idx]);
+        *(vec4b*)&buf[idx * 4] = float_to_byte(color);
+    }
+    img_write(buf, first.w, first.h, 4, out);
+    free(buf);
+    return 0;
+}
 
 /*
  * Stop the pathtracer thread if it is running.
@@ -468,6 +1179,7 @@ void pathtracer_stop(pathtracer_t *pt)
     pathtracer_internal_t *p = pt->p;
     if (!p) return;
     trace_cancel(p->context);
+    release_voxels_layers(p);
     delete p;
     pt->p = nullptr;
 }
@@ -480,5 +1192,13 @@ extern "C" {
 
 void pathtracer_iter(pathtracer_t *pt, const float viewport[4]) {}
 void pathtracer_stop(pathtracer_t *pt) {}
+int pathtracer_render(pathtracer_t *pt, double *samples_per_sec)
+{
+    return -1;
+}
+int pathtracer_merge_checkpoints(int nb, const char **paths, const char *out)
+{
+    return -1;
+}
 
 #endif // YOCTO
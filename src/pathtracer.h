@@ -29,6 +29,20 @@ enum {
     PT_FLOOR_PLANE,
 };
 
+/*
+ * Enum: PT_BACKEND
+ * How the path tracer intersects rays with the voxels.
+ *
+ * PT_BACKEND_MESH   - Convert the tiles into meshes and use a bvh.
+ * PT_BACKEND_VOXELS - Directly traverse the voxels tiles.  Uses much less
+ *                     memory and needs almost no preprocessing, but doesn't
+ *                     support the marching cube effects.
+ */
+enum {
+    PT_BACKEND_MESH = 0,
+    PT_BACKEND_VOXELS,
+};
+
 enum {
     PT_STOPPED = 0,
     PT_RUNNING,
@@ -47,6 +61,14 @@ typedef struct {
     pathtracer_internal_t *p;
     int num_samples;
     int samples;
+    int backend;        // One of the PT_BACKEND values.
+    // Only used by pathtracer_render.
+    int region[4];      // Rendered area (x, y, w, h), zero for full image.
+    struct {
+        const char *path;   // Resume from and save to this file.
+        float interval;     // Seconds between two saves, zero to only
+                            // save at the end.
+    } checkpoint;
     struct {
         int type;
         float energy;
@@ -70,6 +92,49 @@ typedef struct {
  */
 void pathtracer_iter(pathtracer_t *pt, const float viewport[4]);
 
+/*
+ * Function: pathtracer_render
+ * Render the current image synchronously until all the samples are done.
+ *
+ * Contrary to pathtracer_iter, this blocks until the rendering is finished
+ * and doesn't need a graphics context, so it can be used for offline
+ * rendering.  The buffer is allocated if needed.
+ *
+ * If a region is set, only this part of the image is rendered.  If a
+ * checkpoint path is set, the rendering resumes from the file if it
+ * matches the current scene, region and size, and the accumulated state is
+ * saved back into it regularly, so that a killed rendering can be
+ * continued, and the tiles rendered by different processes merged with
+ * pathtracer_merge_checkpoints.
+ *
+ * Parameters:
+ *   pt              - A pathtracer instance, with its size set.
+ *   samples_per_sec - If not NULL, get the number of samples per second
+ *                     of the full image.
+ *
+ * Return:
+ *   0 on success.
+ */
+int pathtracer_render(pathtracer_t *pt, double *samples_per_sec);
+
+/*
+ * Function: pathtracer_merge_checkpoints
+ * Merge the checkpoints of several regions of a rendering into a png.
+ *
+ * All the checkpoints must come from the same scene and image size.
+ * Overlapping regions are averaged, weighted by their number of samples,
+ * and pixels not covered by any region are left transparent.
+ *
+ * Parameters:
+ *   nb    - Number of checkpoint files.
+ *   paths - Paths of the checkpoint files.
+ *   out   - Path of the png file to create.
+ *
+ * Return:
+ *   0 on success.
+ */
+int pathtracer_merge_checkpoints(int nb, const char **paths, const char *out);
+
 /*
  * Stop the pathtracer thread if it is running.
  */
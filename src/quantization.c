@@ -18,152 +18,324 @@
 
 #include "goxel.h"
 
+#include "../ext_src/stb/stb_ds.h"
+
+#include <limits.h>
+
+/*
+ * The palette is computed from the histogram of the volume colors, so that
+ * the cost only depends on the number of distinct colors.  The histogram is
+ * accumulated in parallel, one hash map per thread, then split with median
+ * cut, and optionally refined with a few iterations of k-means.
+ */
+
+// Number of voxels of each color, by rgb value.
+typedef struct {
+    uint32_t key;
+    uint32_t value;
+} color_count_t;
+
 typedef struct {
     uint8_t c[4];
     uint32_t n;
 } value_t;
 
-static UT_icd value_icd = {sizeof(value_t), NULL, NULL, NULL};
-
+// A range of values of the histogram.
 typedef struct {
-    UT_array *values;
+    int start;
+    int size;
+    uint64_t n;         // Number of voxels.
+    int channel;        // Channel with the max range.
+    int range;
 } bucket_t;
 
-static void bucket_add(bucket_t *b, const uint8_t c[4], int n, bool check)
+typedef struct {
+    const volume_t *volume;
+    int (*tiles)[3];
+    color_count_t **counts;     // One histogram per thread.
+} histogram_t;
+
+typedef struct {
+    const value_t *values;
+    int nb_values;
+    const uint8_t (*palette)[4];
+    int nb;
+    int *labels;
+    int *changed;               // Number of labels changed per job.
+} kmeans_t;
+
+// Number of histogram values per k-means job.
+#define KMEANS_JOB_SIZE 4096
+
+static void count_add(color_count_t **counts, uint32_t key, uint32_t n)
 {
-    assert(b->values);
-    int size = utarray_len(b->values);
-    value_t v, *values = (value_t*)utarray_front(b->values);
-    int i;
+    ptrdiff_t idx = hmgeti(*counts, key);
+    if (idx >= 0)
+        (*counts)[idx].value += n;
+    else
+        hmput(*counts, key, n);
+}
 
-    assert(n);
-    if (check) {
-        for (i = 0; i < size; i++) {
-            if (memcmp(values[i].c, c, 4) == 0) {
-                values[i].n += n;
-                return;
-            }
+static void histogram_tile(void *user, int i, int thread)
+{
+    histogram_t *h = user;
+    const uint8_t (*data)[4];
+    uint32_t key, prev = 0;
+    int j, nb = 0;
+
+    data = volume_get_tile_data(h->volume, NULL, h->tiles[i], NULL);
+    // Neighbor voxels often have the same color, so we only update the
+    // histogram at the end of each run.
+    for (j = 0; j < TILE_SIZE * TILE_SIZE * TILE_SIZE; j++) {
+        if (data[j][3] < 127) continue;
+        key = data[j][0] | (data[j][1] << 8) | (data[j][2] << 16);
+        if (nb && key == prev) {
+            nb++;
+            continue;
         }
+        if (nb) count_add(&h->counts[thread], prev, nb);
+        prev = key;
+        nb = 1;
     }
-    memcpy(v.c, c, 4);
-    v.n = n;
-    utarray_push_back(b->values, &v);
+    if (nb) count_add(&h->counts[thread], prev, nb);
 }
 
-static int g_k; // Used in the sorting algo.
-                // qsort_r is not portable!
-static int value_cmp(const void *a_, const void *b_)
+// Return the list of distinct opaque colors of a volume, with their count.
+static value_t *get_histogram(const volume_t *volume, int *nb)
 {
-    int k = g_k;
-    const value_t *a = a_;
-    const value_t *b = b_;
-    return cmp(a->c[k], b->c[k]);
+    histogram_t h = {.volume = volume};
+    volume_iterator_t iter;
+    int i, j, nb_tiles = 0, nb_threads, pos[3];
+    color_count_t *counts;
+    value_t *ret;
+
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        h.tiles = realloc(h.tiles, (nb_tiles + 1) * sizeof(*h.tiles));
+        memcpy(h.tiles[nb_tiles++], pos, sizeof(pos));
+    }
+    nb_threads = parallel_get_nb_threads();
+    h.counts = calloc(nb_threads, sizeof(*h.counts));
+    parallel_for(nb_tiles, histogram_tile, &h);
+
+    // Merge all the threads histograms into the first one.
+    for (i = 1; i < nb_threads; i++) {
+        for (j = 0; j < hmlen(h.counts[i]); j++)
+            count_add(&h.counts[0], h.counts[i][j].key, h.counts[i][j].value);
+        hmfree(h.counts[i]);
+    }
+    counts = h.counts[0];
+    *nb = hmlen(counts);
+    ret = calloc(max(*nb, 1), sizeof(*ret));
+    for (i = 0; i < *nb; i++) {
+        ret[i].c[0] = counts[i].key & 0xff;
+        ret[i].c[1] = (counts[i].key >> 8) & 0xff;
+        ret[i].c[2] = (counts[i].key >> 16) & 0xff;
+        ret[i].c[3] = 255;
+        ret[i].n = counts[i].value;
+    }
+    hmfree(counts);
+    free(h.counts);
+    free(h.tiles);
+    return ret;
 }
 
-// Split a bucket into two new buckets.
-static void bucket_split(const bucket_t *bucket, bucket_t *a, bucket_t *b)
+// One compare function per channel, since qsort_r is not portable, and
+// a global channel index would not be thread safe.  The other channels
+// break the ties, so that the result doesn't depend on the histogram
+// order.
+#define VALUE_CMP(k) \
+    static int value_cmp_##k(const void *a_, const void *b_) \
+    { \
+        const value_t *a = a_; \
+        const value_t *b = b_; \
+        if (a->c[k] != b->c[k]) return cmp(a->c[k], b->c[k]); \
+        if (a->c[0] != b->c[0]) return cmp(a->c[0], b->c[0]); \
+        if (a->c[1] != b->c[1]) return cmp(a->c[1], b->c[1]); \
+        return cmp(a->c[2], b->c[2]); \
+    }
+VALUE_CMP(0)
+VALUE_CMP(1)
+VALUE_CMP(2)
+#undef VALUE_CMP
+
+static int (*const VALUE_CMPS[3])(const void*, const void*) = {
+    value_cmp_0, value_cmp_1, value_cmp_2,
+};
+
+// Update the voxels count and the max channel range of a bucket.
+static void bucket_update(bucket_t *b, const value_t *values)
 {
-    int size = utarray_len(bucket->values);
-    value_t *values = (value_t*)utarray_front(bucket->values);
-    int i, j, k, nb = 0;
-    uint8_t min_c[4] = {255, 255, 255, 255};
-    uint8_t max_c[4] = {0, 0, 0, 0};
-    // Find the channel with the max range
-    for (i = 0; i < size; i++) {
-        nb += values[i].n;
-        for (k = 0; k < 4; k++) {
+    uint8_t min_c[3] = {255, 255, 255};
+    uint8_t max_c[3] = {0, 0, 0};
+    int i, k;
+
+    b->n = 0;
+    for (i = b->start; i < b->start + b->size; i++) {
+        b->n += values[i].n;
+        for (k = 0; k < 3; k++) {
             min_c[k] = min(min_c[k], values[i].c[k]);
             max_c[k] = max(max_c[k], values[i].c[k]);
         }
     }
-    k = 0;
-    for (i = 0; i < 4; i++)
-        if (max_c[i] - min_c[i] > max_c[k] - min_c[k])
-            k = i;
-    // Sort the values by color.
-    g_k = k;
-    qsort(values, size, sizeof(*values), value_cmp);
-    // Now take the bottom half into the first buket, and the top half into
-    // the second one.
-    utarray_new(a->values, &value_icd);
-    utarray_new(b->values, &value_icd);
-    for (i = 0, j = 0; i < size; i++) {
-        if (j < nb / 2)
-            bucket_add(a, values[i].c, min(values[i].n, nb / 2 - j), false);
-        j += values[i].n;
-        if (j > nb / 2)
-            bucket_add(b, values[i].c, min(values[i].n, j - nb / 2), false);
+    b->channel = 0;
+    for (k = 1; k < 3; k++)
+        if (max_c[k] - min_c[k] > max_c[b->channel] - min_c[b->channel])
+            b->channel = k;
+    b->range = max_c[b->channel] - min_c[b->channel];
+}
+
+// Split a bucket in two at the median voxel along its max range channel.
+// Both halves keep at least one value.
+static void bucket_split(bucket_t *b, bucket_t *out, value_t *values)
+{
+    uint64_t n = 0;
+    int i;
+
+    qsort(values + b->start, b->size, sizeof(*values),
+          VALUE_CMPS[b->channel]);
+    for (i = 0; i < b->size - 2; i++) {
+        n += values[b->start + i].n;
+        if (n * 2 >= b->n) break;
     }
+    out->start = b->start + i + 1;
+    out->size = b->size - i - 1;
+    b->size = i + 1;
+    bucket_update(b, values);
+    bucket_update(out, values);
 }
 
-static void bucket_average_color(const bucket_t *b, uint8_t out[4])
+static void bucket_average_color(const bucket_t *b, const value_t *values,
+                                 uint8_t out[4])
 {
-    int size = utarray_len(b->values);
-    value_t *values = (value_t*)utarray_front(b->values);
-    int s[4] = {}, n = 0, i, k;
-    if (size == 0) {
-        memset(out, 0, 4);
-        return;
+    uint64_t s[3] = {};
+    int i, k;
+
+    for (i = b->start; i < b->start + b->size; i++) {
+        for (k = 0; k < 3; k++)
+            s[k] += (uint64_t)values[i].n * values[i].c[k];
     }
-    for (i = 0; i < size; i++) {
-        assert(values[i].n);
-        n += values[i].n;
-        for (k = 0; k < 4; k++)
-            s[k] += values[i].n * values[i].c[k];
+    for (k = 0; k < 3; k++)
+        out[k] = (s[k] + b->n / 2) / b->n;
+    out[3] = 255;
+}
+
+static void kmeans_job(void *user, int i, int thread)
+{
+    kmeans_t *km = user;
+    const uint8_t *c, *p;
+    int j, k, d, best, best_dist;
+    int end = min((i + 1) * KMEANS_JOB_SIZE, km->nb_values);
+
+    km->changed[i] = 0;
+    for (j = i * KMEANS_JOB_SIZE; j < end; j++) {
+        c = km->values[j].c;
+        best = 0;
+        best_dist = INT_MAX;
+        for (k = 0; k < km->nb; k++) {
+            p = km->palette[k];
+            d = (c[0] - p[0]) * (c[0] - p[0]) +
+                (c[1] - p[1]) * (c[1] - p[1]) +
+                (c[2] - p[2]) * (c[2] - p[2]);
+            if (d < best_dist) {
+                best = k;
+                best_dist = d;
+            }
+        }
+        if (km->labels[j] != best) km->changed[i]++;
+        km->labels[j] = best;
     }
-    out[0] = s[0] / n;
-    out[1] = s[1] / n;
-    out[2] = s[2] / n;
-    out[3] = s[3] / n;
 }
 
-static int bucket_cmp(const void *a_, const void *b_)
+// Lloyd iterations, weighted by the voxels count of each color.
+static void kmeans_refine(const value_t *values, int nb_values,
+                          uint8_t (*palette)[4], int nb, int iterations)
 {
-    const bucket_t *a = (void*)a_;
-    const bucket_t *b = (void*)b_;
-    int na = a->values ? utarray_len(a->values) : -1;
-    int nb = b->values ? utarray_len(b->values) : -1;
-    return cmp(nb, na);
+    kmeans_t km = {.values = values, .nb_values = nb_values,
+                   .palette = (void*)palette, .nb = nb};
+    int it, i, k, nb_jobs, changed;
+    uint64_t (*sums)[4];
+
+    nb_jobs = (nb_values + KMEANS_JOB_SIZE - 1) / KMEANS_JOB_SIZE;
+    km.labels = malloc(nb_values * sizeof(*km.labels));
+    memset(km.labels, 0xff, nb_values * sizeof(*km.labels));
+    km.changed = calloc(nb_jobs, sizeof(*km.changed));
+    sums = calloc(nb, sizeof(*sums));
+
+    for (it = 0; it < iterations; it++) {
+        parallel_for(nb_jobs, kmeans_job, &km);
+        for (i = 0, changed = 0; i < nb_jobs; i++)
+            changed += km.changed[i];
+        if (!changed) break;
+
+        memset(sums, 0, nb * sizeof(*sums));
+        for (i = 0; i < nb_values; i++) {
+            for (k = 0; k < 3; k++)
+                sums[km.labels[i]][k] += (uint64_t)values[i].n *
+                                         values[i].c[k];
+            sums[km.labels[i]][3] += values[i].n;
+        }
+        // Empty clusters keep their color.
+        for (i = 0; i < nb; i++) {
+            if (!sums[i][3]) continue;
+            for (k = 0; k < 3; k++)
+                palette[i][k] = (sums[i][k] + sums[i][3] / 2) / sums[i][3];
+        }
+    }
+    free(sums);
+    free(km.changed);
+    free(km.labels);
 }
 
-// Generate an optimal palette whith a fixed number of colors from a volume.
-// This is based on https://en.wikipedia.org/wiki/Median_cut.
-void quantization_gen_palette(const volume_t *volume, int nb,
+/*
+ * Generate an optimal palette whith a fixed number of colors from a volume.
+ * This is based on https://en.wikipedia.org/wiki/Median_cut, always
+ * splitting the bucket with the biggest voxels count times color range.
+ *
+ * If the volume has less distinct colors than the palette size, the
+ * remaining entries repeat the previous ones.
+ */
+void quantization_gen_palette(const volume_t *volume, int nb, int refine,
                               uint8_t (*palette)[4])
 {
-    uint8_t v[4];
-    int i, pos[3];
-    bucket_t *buckets, b;
-    volume_iterator_t iter;
+    value_t *values;
+    bucket_t *buckets;
+    int i, nb_values, nb_buckets = 0, best;
+    uint64_t score, best_score;
 
+    values = get_histogram(volume, &nb_values);
     buckets = calloc(nb, sizeof(*buckets));
-
-    // Fill the initial bucket.
-    utarray_new(buckets[0].values, &value_icd);
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
-    while (volume_iter(&iter, pos)) {
-        volume_get_at(volume, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        bucket_add(&buckets[0], v, 1, true);
+    if (nb_values) {
+        buckets[0].size = nb_values;
+        bucket_update(&buckets[0], values);
+        nb_buckets = 1;
     }
 
-    // Split until we get nb buckets.  I do it a bit stupidly, by sorting
-    // the buckets at every iterations!  I should use a stack!
-    while (!buckets[nb - 1].values) {
-        assert(!buckets[nb - 1].values);
-        b = buckets[0];
-        memset(&buckets[0], 0, sizeof(buckets[0]));
-        bucket_split(&b, &buckets[0], &buckets[nb - 1]);
-        utarray_free(b.values);
-        qsort(buckets, nb, sizeof(*buckets), bucket_cmp);
+    while (nb_buckets < nb) {
+        best = -1;
+        best_score = 0;
+        for (i = 0; i < nb_buckets; i++) {
+            score = buckets[i].n * buckets[i].range;
+            if (score > best_score) {
+                best = i;
+                best_score = score;
+            }
+        }
+        if (best == -1) break; // All the buckets have a single color.
+        bucket_split(&buckets[best], &buckets[nb_buckets++], values);
     }
 
-    // Fill the palette colors and cleanup.
-    for (i = 0; i < nb; i++) {
-        assert(buckets[i].values);
-        bucket_average_color(&buckets[i], palette[i]);
-        utarray_free(buckets[i].values);
+    for (i = 0; i < nb_buckets; i++)
+        bucket_average_color(&buckets[i], values, palette[i]);
+    if (refine && nb_buckets)
+        kmeans_refine(values, nb_values, palette, nb_buckets, refine);
+    for (i = nb_buckets; i < nb; i++) {
+        if (nb_buckets)
+            memcpy(palette[i], palette[i % nb_buckets], 4);
+        else
+            memset(palette[i], 0, 4);
     }
     free(buckets);
+    free(values);
 }
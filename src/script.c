@@ -20,6 +20,8 @@
 
 #include "file_format.h"
 
+#include <stdatomic.h>
+
 #include "../ext_src/quickjs/quickjs.h"
 #include "../ext_src/quickjs/quickjs-libc.h"
 
@@ -407,6 +409,459 @@ static JSValue js_volume_setAt(JSContext *ctx, JSValueConst this_val,
     return JS_UNDEFINED;
 }
 
+static void free_array_buffer(JSRuntime *rt, void *opaque, void *ptr)
+{
+    free(ptr);
+}
+
+// Create a new typed array that takes ownership of a malloc'ed buffer.
+static JSValue new_js_typed_array(JSContext *ctx, const char *type,
+                                  void *data, size_t size)
+{
+    JSValue global, ctor, buffer, ret;
+
+    buffer = JS_NewArrayBuffer(ctx, data, size, free_array_buffer, NULL,
+                               false);
+    global = JS_GetGlobalObject(ctx);
+    ctor = JS_GetPropertyStr(ctx, global, type);
+    ret = JS_CallConstructor(ctx, ctor, 1, (JSValueConst*)&buffer);
+    JS_FreeValue(ctx, ctor);
+    JS_FreeValue(ctx, global);
+    JS_FreeValue(ctx, buffer);
+    return ret;
+}
+
+static JSValue new_js_uint8_array(JSContext *ctx, uint8_t *data, size_t size)
+{
+    return new_js_typed_array(ctx, "Uint8Array", data, size);
+}
+
+// Get the data of a typed array or array buffer.
+static uint8_t *get_js_buffer(JSContext *ctx, JSValueConst val, size_t *size)
+{
+    JSValue buffer;
+    size_t offset, len, bpe, buffer_size;
+    uint8_t *data;
+
+    buffer = JS_GetTypedArrayBuffer(ctx, val, &offset, &len, &bpe);
+    if (JS_IsException(buffer)) {
+        // Not a typed array, maybe an ArrayBuffer.
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return JS_GetArrayBuffer(ctx, size, val);
+    }
+    data = JS_GetArrayBuffer(ctx, &buffer_size, buffer);
+    JS_FreeValue(ctx, buffer);
+    if (!data) return NULL;
+    *size = len;
+    return data + offset;
+}
+
+/*
+ * volume.getBlock(pos, size)
+ * Return a Uint8Array with the RGBA values of a box, in xyz order.
+ */
+static JSValue js_volume_getBlock(JSContext *ctx, JSValueConst this_val,
+                                  int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    int pos[3], size[3];
+    uint8_t *data;
+    size_t data_size;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume || argc < 2) return JS_EXCEPTION;
+    get_vec_int(ctx, argv[0], 3, pos, 0);
+    get_vec_int(ctx, argv[1], 3, size, 0);
+    if (size[0] <= 0 || size[1] <= 0 || size[2] <= 0)
+        return JS_ThrowRangeError(ctx, "Invalid block size");
+    data_size = (size_t)size[0] * size[1] * size[2] * 4;
+    data = malloc(data_size);
+    if (!data) return JS_ThrowOutOfMemory(ctx);
+    volume_read(volume, pos, size, data);
+    return new_js_uint8_array(ctx, data, data_size);
+}
+
+/*
+ * volume.setBlock(pos, size, data)
+ * Set the voxels of a box from a Uint8Array of RGBA values in xyz order.
+ */
+static JSValue js_volume_setBlock(JSContext *ctx, JSValueConst this_val,
+                                  int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    int pos[3], size[3];
+    const uint8_t *data;
+    size_t data_size;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume || argc < 3) return JS_EXCEPTION;
+    get_vec_int(ctx, argv[0], 3, pos, 0);
+    get_vec_int(ctx, argv[1], 3, size, 0);
+    data = get_js_buffer(ctx, argv[2], &data_size);
+    if (!data) return JS_ThrowTypeError(ctx, "Expected a Uint8Array");
+    if (    size[0] < 0 || size[1] < 0 || size[2] < 0 ||
+            data_size < (size_t)size[0] * size[1] * size[2] * 4)
+        return JS_ThrowRangeError(ctx, "Data too small for the block size");
+    volume_write(volume, pos, size, data);
+    return JS_UNDEFINED;
+}
+
+/*
+ * volume.iterTiles(callback)
+ * Call callback(pos, data) for each non empty tile of the volume, with pos
+ * the tile first corner, and data a Uint8Array of the tile RGBA values in
+ * xyz order.  Any change made to data is written back into the tile.
+ */
+static JSValue js_volume_iterTiles(JSContext *ctx, JSValueConst this_val,
+                                   int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    volume_iterator_t iter;
+    int pos[3], (*tiles_pos)[3] = NULL;
+    int i, nb = 0;
+    const int size[3] = {TILE_SIZE, TILE_SIZE, TILE_SIZE};
+    const size_t data_size = TILE_SIZE * TILE_SIZE * TILE_SIZE * 4;
+    uint8_t *data, *current = NULL;
+    const uint8_t *new_data;
+    size_t new_size;
+    JSValue args[2], val, ret = JS_UNDEFINED;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume || argc < 1) return JS_EXCEPTION;
+
+    // Get all the tiles first, since the callback can modify the volume.
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        tiles_pos = realloc(tiles_pos, (nb + 1) * sizeof(*tiles_pos));
+        memcpy(tiles_pos[nb++], pos, sizeof(pos));
+    }
+
+    current = malloc(data_size);
+    for (i = 0; i < nb; i++) {
+        data = malloc(data_size);
+        volume_read(volume, tiles_pos[i], size, data);
+        memcpy(current, data, data_size);
+        args[0] = new_js_vec3(ctx, tiles_pos[i][0], tiles_pos[i][1],
+                              tiles_pos[i][2]);
+        args[1] = new_js_uint8_array(ctx, data, data_size);
+        val = JS_Call(ctx, argv[0], JS_UNDEFINED, 2, (JSValueConst*)args);
+        if (JS_IsException(val)) {
+            ret = val;
+        } else {
+            JS_FreeValue(ctx, val);
+            new_data = get_js_buffer(ctx, args[1], &new_size);
+            if (    new_data && new_size == data_size &&
+                    memcmp(new_data, current, data_size) != 0) {
+                volume_write(volume, tiles_pos[i], size, new_data);
+            }
+        }
+        JS_FreeValue(ctx, args[0]);
+        JS_FreeValue(ctx, args[1]);
+        if (JS_IsException(ret)) break;
+    }
+    free(current);
+    free(tiles_pos);
+    return ret;
+}
+
+static int parse_fill_mode(JSContext *ctx, JSValueConst val, int *mode)
+{
+    const char *str;
+    int i;
+    const struct {
+        const char *name;
+        int mode;
+    } MODES[] = {
+        {"over", MODE_OVER},
+        {"sub", MODE_SUB},
+        {"paint", MODE_PAINT},
+        {"max", MODE_MAX},
+        {"intersect", MODE_INTERSECT},
+        {"replace", MODE_REPLACE},
+    };
+
+    *mode = MODE_OVER;
+    if (JS_IsUndefined(val)) return 0;
+    str = JS_ToCString(ctx, val);
+    if (!str) return -1;
+    for (i = 0; i < ARRAY_SIZE(MODES); i++) {
+        if (strcmp(str, MODES[i].name) == 0) {
+            *mode = MODES[i].mode;
+            break;
+        }
+    }
+    JS_FreeCString(ctx, str);
+    if (i == ARRAY_SIZE(MODES)) {
+        JS_ThrowRangeError(ctx, "Unknown fill mode");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * volume.fill(box, color|callback, mode = 'over')
+ * Fill all the voxels inside a Box.  The fill value is either a constant
+ * color, either a callback(pos, data) called once per tile intersecting the
+ * box, with pos the tile first corner and data a zero initialized
+ * Uint8Array that the callback sets to the tile RGBA values in xyz order.
+ * Values outside the box are ignored.  The result is merged into the volume
+ * using mode: 'over', 'sub', 'paint', 'max', 'intersect' or 'replace'.
+ *
+ * The voxels selected are the same as with box.iterVoxels.
+ */
+static JSValue js_volume_fill(JSContext *ctx, JSValueConst this_val,
+                              int argc, JSValueConst *argv)
+{
+    volume_t *volume, *tmp = NULL;
+    box_t *box;
+    int mode, x, y, z, i, nb, p[3], pos[3], aabb[2][3], tile_aabb[2][3];
+    int start[3];
+    bool use_callback;
+    uint8_t color[4] = {0, 0, 0, 255};
+    uint8_t mask[TILE_SIZE * TILE_SIZE * TILE_SIZE];
+    uint8_t *src, *dst;
+    const uint8_t *new_data;
+    size_t new_size;
+    float inv[4][4], fp[3], lp[3];
+    const int size[3] = {TILE_SIZE, TILE_SIZE, TILE_SIZE};
+    const size_t data_size = sizeof(mask) * 4;
+    const float L = 1 + 1e-8;
+    JSValue args[2], val, ret = JS_UNDEFINED;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume || argc < 2) return JS_EXCEPTION;
+    box = JS_GetOpaque2(ctx, argv[0], box_klass.id);
+    if (!box) return JS_EXCEPTION;
+    if (parse_fill_mode(ctx, argc > 2 ? argv[2] : JS_UNDEFINED, &mode))
+        return JS_EXCEPTION;
+    use_callback = JS_IsFunction(ctx, argv[1]);
+    if (!use_callback) get_vec_uint8(ctx, argv[1], 4, color, 255);
+
+    mat4_invert(box->mat, inv);
+    box_get_aabb(box->mat, aabb);
+    for (i = 0; i < 3; i++)
+        start[i] = (int)floor(aabb[0][i] / (float)TILE_SIZE) * TILE_SIZE;
+
+    src = malloc(data_size);
+    dst = malloc(data_size);
+    if (mode != MODE_REPLACE) tmp = volume_new();
+
+    for (pos[2] = start[2]; pos[2] < aabb[1][2]; pos[2] += TILE_SIZE)
+    for (pos[1] = start[1]; pos[1] < aabb[1][1]; pos[1] += TILE_SIZE)
+    for (pos[0] = start[0]; pos[0] < aabb[1][0]; pos[0] += TILE_SIZE) {
+        for (i = 0; i < 3; i++) {
+            tile_aabb[0][i] = pos[i];
+            tile_aabb[1][i] = pos[i] + TILE_SIZE;
+        }
+        if (!box_intersect_aabb(box->mat, tile_aabb)) continue;
+
+        // Compute the tile mask, using the same test as js_box_iterVoxels.
+        nb = 0;
+        for (i = 0, z = 0; z < TILE_SIZE; z++)
+        for (y = 0; y < TILE_SIZE; y++)
+        for (x = 0; x < TILE_SIZE; x++, i++) {
+            p[0] = pos[0] + x;
+            p[1] = pos[1] + y;
+            p[2] = pos[2] + z;
+            mask[i] = 0;
+            if (    p[0] < aabb[0][0] || p[0] >= aabb[1][0] ||
+                    p[1] < aabb[0][1] || p[1] >= aabb[1][1] ||
+                    p[2] < aabb[0][2] || p[2] >= aabb[1][2])
+                continue;
+            vec3_set(fp, p[0], p[1], p[2]);
+            mat4_mul_vec3(inv, fp, lp);
+            mask[i] = fabsf(lp[0]) <= L && fabsf(lp[1]) <= L &&
+                      fabsf(lp[2]) <= L;
+            nb += mask[i];
+        }
+        if (!nb) continue;
+
+        if (use_callback) {
+            args[0] = new_js_vec3(ctx, pos[0], pos[1], pos[2]);
+            args[1] = new_js_uint8_array(ctx, calloc(1, data_size),
+                                         data_size);
+            val = JS_Call(ctx, argv[1], JS_UNDEFINED, 2,
+                          (JSValueConst*)args);
+            if (JS_IsException(val)) {
+                ret = val;
+            } else {
+                JS_FreeValue(ctx, val);
+                new_data = get_js_buffer(ctx, args[1], &new_size);
+                if (new_data && new_size == data_size)
+                    memcpy(src, new_data, data_size);
+                else
+                    ret = JS_ThrowRangeError(ctx, "Invalid tile data");
+            }
+            JS_FreeValue(ctx, args[0]);
+            JS_FreeValue(ctx, args[1]);
+            if (JS_IsException(ret)) goto end;
+        } else {
+            for (i = 0; i < ARRAY_SIZE(mask); i++)
+                memcpy(src + i * 4, color, 4);
+        }
+
+        if (mode == MODE_REPLACE) {
+            volume_read(volume, pos, size, dst);
+            for (i = 0; i < ARRAY_SIZE(mask); i++) {
+                if (mask[i]) memcpy(dst + i * 4, src + i * 4, 4);
+            }
+            volume_write(volume, pos, size, dst);
+        } else {
+            for (i = 0; i < ARRAY_SIZE(mask); i++) {
+                if (!mask[i]) memset(src + i * 4, 0, 4);
+            }
+            volume_write(tmp, pos, size, src);
+        }
+    }
+    if (tmp) volume_merge(volume, tmp, mode, NULL);
+
+end:
+    if (tmp) volume_delete(tmp);
+    free(src);
+    free(dst);
+    return ret;
+}
+
+/*
+ * Common implementation of the morphology methods:
+ * volume.dilate(radius = 1, shape = 'sphere') and co.
+ */
+static JSValue js_volume_morphology(JSContext *ctx, JSValueConst this_val,
+                                    int argc, JSValueConst *argv, int op)
+{
+    volume_t *volume;
+    int radius = 1;
+    const char *shape_id = NULL;
+    const shape_t *shape = &shape_sphere;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    if (argc > 0) JS_ToInt32(ctx, &radius, argv[0]);
+    if (argc > 1) {
+        shape_id = JS_ToCString(ctx, argv[1]);
+        if (!shape_id) return JS_EXCEPTION;
+        if (strcmp(shape_id, "cube") == 0) shape = &shape_cube;
+        else if (strcmp(shape_id, "cylinder") == 0) shape = &shape_cylinder;
+        else if (strcmp(shape_id, "sphere") != 0) {
+            JS_FreeCString(ctx, shape_id);
+            return JS_ThrowRangeError(ctx, "Unknown shape");
+        }
+        JS_FreeCString(ctx, shape_id);
+    }
+    volume_morphology(volume, op, shape, radius);
+    return JS_UNDEFINED;
+}
+
+static JSValue js_volume_dilate(JSContext *ctx, JSValueConst this_val,
+                                int argc, JSValueConst *argv)
+{
+    return js_volume_morphology(ctx, this_val, argc, argv,
+                                VOLUME_MORPHO_DILATE);
+}
+
+static JSValue js_volume_erode(JSContext *ctx, JSValueConst this_val,
+                               int argc, JSValueConst *argv)
+{
+    return js_volume_morphology(ctx, this_val, argc, argv,
+                                VOLUME_MORPHO_ERODE);
+}
+
+static JSValue js_volume_open(JSContext *ctx, JSValueConst this_val,
+                              int argc, JSValueConst *argv)
+{
+    return js_volume_morphology(ctx, this_val, argc, argv,
+                                VOLUME_MORPHO_OPEN);
+}
+
+static JSValue js_volume_close(JSContext *ctx, JSValueConst this_val,
+                               int argc, JSValueConst *argv)
+{
+    return js_volume_morphology(ctx, this_val, argc, argv,
+                                VOLUME_MORPHO_CLOSE);
+}
+
+static JSValue js_volume_hollow(JSContext *ctx, JSValueConst this_val,
+                                int argc, JSValueConst *argv)
+{
+    return js_volume_morphology(ctx, this_val, argc, argv,
+                                VOLUME_MORPHO_HOLLOW);
+}
+
+/*
+ * volume.getComponents(connectivity = 26, threshold = 255)
+ * Split the volume into its connected components.  Return an array of
+ * objects {volume, count, min, max}, sorted from the largest to the
+ * smallest.  Two neighbor voxels are connected if none of their color
+ * channels differ by more than threshold.
+ */
+static JSValue js_volume_getComponents(JSContext *ctx, JSValueConst this_val,
+                                       int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    volume_component_t *comps;
+    int i, nb, connectivity = 26, threshold = 255;
+    JSValue ret, obj, vol;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    if (argc > 0) JS_ToInt32(ctx, &connectivity, argv[0]);
+    if (argc > 1) JS_ToInt32(ctx, &threshold, argv[1]);
+    if (connectivity != 6 && connectivity != 18 && connectivity != 26)
+        return JS_ThrowRangeError(ctx, "Connectivity must be 6, 18 or 26");
+
+    nb = volume_get_components(volume, connectivity, threshold, &comps);
+    ret = JS_NewArray(ctx);
+    for (i = 0; i < nb; i++) {
+        obj = JS_NewObject(ctx);
+        vol = JS_NewObjectClass(ctx, volume_klass.id);
+        JS_SetOpaque(vol, comps[i].volume);
+        comps[i].volume = NULL; // Now owned by the JS object.
+        JS_SetPropertyStr(ctx, obj, "volume", vol);
+        JS_SetPropertyStr(ctx, obj, "count",
+                          JS_NewInt32(ctx, comps[i].nb_voxels));
+        JS_SetPropertyStr(ctx, obj, "min", new_js_vec3(ctx,
+                comps[i].aabb[0][0], comps[i].aabb[0][1], comps[i].aabb[0][2]));
+        JS_SetPropertyStr(ctx, obj, "max", new_js_vec3(ctx,
+                comps[i].aabb[1][0], comps[i].aabb[1][1], comps[i].aabb[1][2]));
+        JS_SetPropertyUint32(ctx, ret, i, obj);
+    }
+    volume_components_free(comps, nb);
+    return ret;
+}
+
+/*
+ * volume.getSdf(pos, size, maxDist = 4)
+ * Return a Float32Array with the signed distance field of a box, in xyz
+ * order: the distance to the surface in voxels, negative inside, clamped
+ * to maxDist (at most 15.5).
+ */
+static JSValue js_volume_getSdf(JSContext *ctx, JSValueConst this_val,
+                                int argc, JSValueConst *argv)
+{
+    volume_t *volume;
+    int pos[3], size[3];
+    double max_dist = 4;
+    float *data;
+    size_t data_size;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume || argc < 2) return JS_EXCEPTION;
+    get_vec_int(ctx, argv[0], 3, pos, 0);
+    get_vec_int(ctx, argv[1], 3, size, 0);
+    if (argc > 2) JS_ToFloat64(ctx, &max_dist, argv[2]);
+    if (size[0] <= 0 || size[1] <= 0 || size[2] <= 0)
+        return JS_ThrowRangeError(ctx, "Invalid block size");
+    data_size = (size_t)size[0] * size[1] * size[2] * sizeof(float);
+    data = malloc(data_size);
+    if (!data) return JS_ThrowOutOfMemory(ctx);
+    volume_get_sdf(volume, pos, size, max_dist, data);
+    return new_js_typed_array(ctx, "Float32Array", data, data_size);
+}
+
+int script_format_export_func(const file_format_t *format_,
+                              const image_t *img, const char *path);
+
 static JSValue js_volume_save(JSContext *ctx, JSValueConst this_val,
                             int argc, JSValueConst *argv)
 {
@@ -426,6 +881,9 @@ static JSValue js_volume_save(JSContext *ctx, JSValueConst this_val,
         fprintf(stderr, "Cannot find format for file %s\n", path);
         return JS_EXCEPTION;
     }
+    // Script formats can only run in the main context.
+    if (ctx != g_ctx && f->export_func == script_format_export_func)
+        return JS_ThrowTypeError(ctx, "Format not available here");
     img = image_new();
     volume_set(img->active_layer->volume, volume);
     err = f->export_func(f, img, path);
@@ -448,6 +906,17 @@ static klass_t volume_klass = {
         {"copy", .fn=js_volume_copy},
         {"iter", .fn=js_volume_iter},
         {"setAt", .fn=js_volume_setAt},
+        {"getBlock", .fn=js_volume_getBlock},
+        {"setBlock", .fn=js_volume_setBlock},
+        {"iterTiles", .fn=js_volume_iterTiles},
+        {"fill", .fn=js_volume_fill},
+        {"dilate", .fn=js_volume_dilate},
+        {"erode", .fn=js_volume_erode},
+        {"open", .fn=js_volume_open},
+        {"close", .fn=js_volume_close},
+        {"hollow", .fn=js_volume_hollow},
+        {"getComponents", .fn=js_volume_getComponents},
+        {"getSdf", .fn=js_volume_getSdf},
         {"save", .fn=js_volume_save},
         { .name = NULL }
     }
@@ -519,6 +988,7 @@ static klass_t layer_klass = {
 
 typedef struct {
     palette_t *palette;
+    goxel_t *gox;       // Owner goxel, whose painter color we use.
     JSValue color_vec;
 } js_palette_t;
 
@@ -533,7 +1003,7 @@ static JSValue js_palette_get_color(JSContext *ctx, JSValueConst this_val, int m
         return JS_EXCEPTION;
     }
     
-    color = goxel.painter.color;
+    color = js_palette->gox->painter.color;
     
     // If we already have a color vec, free it first to prevent memory leaks
     if (!JS_IsUndefined(js_palette->color_vec)) {
@@ -566,10 +1036,7 @@ static JSValue js_palette_set_color(JSContext *ctx, JSValueConst this_val,
     get_vec_uint8(ctx, val, 4, new_color_values, 255);
 
     // Update the actual painter color
-    goxel.painter.color[0] = new_color_values[0];
-    goxel.painter.color[1] = new_color_values[1];
-    goxel.painter.color[2] = new_color_values[2];
-    goxel.painter.color[3] = new_color_values[3];
+    memcpy(js_palette->gox->painter.color, new_color_values, 4);
 
     return JS_UNDEFINED; // Standard for successful setters
 }
@@ -599,6 +1066,7 @@ static JSValue js_palette_from_ptr(JSContext *ctx, JSValueConst owner,
     
     js_palette = js_mallocz(ctx, sizeof(*js_palette));
     js_palette->palette = ptr;
+    js_palette->gox = JS_GetOpaque(owner, goxel_klass.id);
     js_palette->color_vec = JS_UNDEFINED;
     
     ret = JS_NewObjectClass(ctx, palette_klass.id);
@@ -662,6 +1130,17 @@ int script_format_export_func(const file_format_t *format_,
     return 0;
 }
 
+/*
+ * Scripts run with script_run_parallel get their own goxel object, and
+ * cannot use the functions that change the global state.
+ */
+static bool is_main_goxel(JSContext *ctx, JSValueConst this_val)
+{
+    if (JS_GetOpaque(this_val, goxel_klass.id) == &goxel) return true;
+    JS_ThrowTypeError(ctx, "Not available in parallel scripts");
+    return false;
+}
+
 static JSValue js_goxel_registerFormat(JSContext *ctx, JSValueConst this_val,
                                        int argc, JSValueConst *argv)
 {
@@ -671,6 +1150,7 @@ static JSValue js_goxel_registerFormat(JSContext *ctx, JSValueConst this_val,
     script_file_format_t *format;
     uint32_t idx;
 
+    if (!is_main_goxel(ctx, this_val)) return JS_EXCEPTION;
     args = argv[0];
     name = JS_ToCString(ctx, JS_GetPropertyStr(ctx, args, "name"));
 
@@ -714,6 +1194,7 @@ static JSValue js_goxel_registerScript(JSContext *ctx, JSValueConst this_val,
     script_t script = {};
     const char *name;
 
+    if (!is_main_goxel(ctx, this_val)) return JS_EXCEPTION;
     data = argv[0];
     name = JS_ToCString(ctx, JS_GetPropertyStr(ctx, data, "name"));
     LOG_I("Register script %s", name);
@@ -724,6 +1205,47 @@ static JSValue js_goxel_registerScript(JSContext *ctx, JSValueConst this_val,
     return JS_UNDEFINED;
 }
 
+// Set an int from an optional object property.
+static void get_prop_int(JSContext *ctx, JSValueConst obj, const char *name,
+                         int *v)
+{
+    JSValue val;
+    val = JS_GetPropertyStr(ctx, obj, name);
+    if (!JS_IsUndefined(val)) JS_ToInt32(ctx, v, val);
+    JS_FreeValue(ctx, val);
+}
+
+/*
+ * goxel.render(path, {width, height, samples, world, floor, backend})
+ * Render the image with the path tracer into a png file, and return the
+ * number of samples per second.
+ */
+static JSValue js_goxel_render(JSContext *ctx, JSValueConst this_val,
+                               int argc, JSValueConst *argv)
+{
+    const char *path;
+    JSValueConst options = argc > 1 ? argv[1] : JS_UNDEFINED;
+    pathtracer_t *pt = &goxel.pathtracer;
+    double samples_per_sec;
+    int err;
+
+    if (!is_main_goxel(ctx, this_val)) return JS_EXCEPTION;
+    path = JS_ToCString(ctx, argv[0]);
+    if (!path) return JS_EXCEPTION;
+    if (JS_IsObject(options)) {
+        get_prop_int(ctx, options, "width", &goxel.image->export_width);
+        get_prop_int(ctx, options, "height", &goxel.image->export_height);
+        get_prop_int(ctx, options, "samples", &pt->num_samples);
+        get_prop_int(ctx, options, "world", &pt->world.type);
+        get_prop_int(ctx, options, "floor", &pt->floor.type);
+        get_prop_int(ctx, options, "backend", &pt->backend);
+    }
+    err = goxel_render_to_file(path, &samples_per_sec);
+    JS_FreeCString(ctx, path);
+    if (err) return JS_ThrowInternalError(ctx, "Rendering failed");
+    return JS_NewFloat64(ctx, samples_per_sec);
+}
+
 static klass_t goxel_klass = {
     .def.class_name = "Goxel",
     .attributes = {
@@ -731,6 +1253,7 @@ static klass_t goxel_klass = {
         {"palette", .klass=&palette_klass, MEMBER(goxel_t, palette)},
         {"registerFormat", .fn=js_goxel_registerFormat},
         {"registerScript", .fn=js_goxel_registerScript},
+        {"render", .fn=js_goxel_render},
         { .name = NULL }
     },
 };
@@ -831,15 +1354,16 @@ static void init_klass(JSContext *ctx, klass_t *klass)
     }
 }
 
-static void init_runtime(void)
+/*
+ * Create a new context with all the classes registered, and a global
+ * 'goxel' object bound to a goxel_t instance.
+ */
+static JSContext *new_context(JSRuntime *rt, goxel_t *gox)
 {
     JSContext *ctx;
     JSValue obj, global_obj;
 
-    if (g_ctx) return;
-    g_rt = JS_NewRuntime();
-    g_ctx = JS_NewContext(g_rt);
-    ctx = g_ctx;
+    ctx = JS_NewContext(rt);
     js_init_module_std(ctx, "std");
     js_init_module_os(ctx, "os");
 
@@ -853,32 +1377,38 @@ static void init_runtime(void)
 
     // Add global 'goxel' object.
     obj = JS_NewObjectClass(ctx, goxel_klass.id);
-    JS_SetOpaque(obj, &goxel);
+    JS_SetOpaque(obj, gox);
     global_obj = JS_GetGlobalObject(ctx);
     JS_SetPropertyStr(ctx, global_obj, "goxel", obj);
     JS_FreeValue(ctx, global_obj);
+    return ctx;
 }
 
-static int script_run_from_str(
-        const char *script, int len, const char *filename, int argc,
-        const char **argv)
+static void init_runtime(void)
+{
+    if (g_ctx) return;
+    g_rt = JS_NewRuntime();
+    g_ctx = new_context(g_rt, &goxel);
+}
+
+static int run_str(JSContext *ctx, const char *script, int len,
+                   const char *filename, int argc, const char **argv)
 {
     int ret = 0;
     JSValue val;
 
-    init_runtime();
-    js_std_add_helpers(g_ctx, argc, (char**)argv);
-
-    val = JS_Eval(g_ctx, script, len, filename, JS_EVAL_TYPE_MODULE);
+    js_std_add_helpers(ctx, argc, (char**)argv);
+    val = JS_Eval(ctx, script, len, filename, JS_EVAL_TYPE_MODULE);
     if (JS_IsException(val)) {
-        js_std_dump_error(g_ctx);
+        js_std_dump_error(ctx);
         ret = -1;
     }
-    JS_FreeValue(g_ctx, val);
+    JS_FreeValue(ctx, val);
     return ret;
 }
 
-int script_run_from_file(const char *filename, int argc, const char **argv)
+static int run_file(JSContext *ctx, const char *filename, int argc,
+                    const char **argv)
 {
     char *script;
     int ret, size;
@@ -888,12 +1418,75 @@ int script_run_from_file(const char *filename, int argc, const char **argv)
         fprintf(stderr, "Cannot read '%s'\n", filename);
         return -1;
     }
-
-    ret = script_run_from_str(script, size, filename, argc, argv);
+    ret = run_str(ctx, script, size, filename, argc, argv);
     free(script);
     return ret;
 }
 
+static int script_run_from_str(
+        const char *script, int len, const char *filename, int argc,
+        const char **argv)
+{
+    init_runtime();
+    return run_str(g_ctx, script, len, filename, argc, argv);
+}
+
+int script_run_from_file(const char *filename, int argc, const char **argv)
+{
+    init_runtime();
+    return run_file(g_ctx, filename, argc, argv);
+}
+
+typedef struct {
+    const char **filenames;
+    int argc;
+    const char **argv;
+    palette_t *palettes;    // Copy of the current palette for each job.
+    atomic_int nb_errors;
+} parallel_run_t;
+
+static void run_parallel_job(void *user, int i, int thread)
+{
+    parallel_run_t *run = user;
+    goxel_t *gox;
+    JSRuntime *rt;
+    JSContext *ctx;
+
+    // Each job gets its own runtime, image, and goxel object, with copies
+    // of the palette and painter color, so that they don't share any
+    // mutable state.
+    gox = calloc(1, sizeof(*gox));
+    gox->image = image_new();
+    gox->palette = &run->palettes[i];
+    memcpy(gox->painter.color, goxel.painter.color, 4);
+    rt = JS_NewRuntime();
+    ctx = new_context(rt, gox);
+    if (run_file(ctx, run->filenames[i], run->argc, run->argv) != 0)
+        run->nb_errors++;
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+    image_delete(gox->image);
+    free(gox);
+}
+
+int script_run_parallel(int nb, const char **filenames, int argc,
+                        const char **argv)
+{
+    parallel_run_t run = {filenames, argc, argv};
+    int i;
+
+    // Make sure the classes ids are allocated before we start the threads.
+    init_runtime();
+    // Copy the palettes here, since creating stb_ds hash maps is not
+    // thread safe.
+    run.palettes = calloc(nb, sizeof(*run.palettes));
+    for (i = 0; i < nb; i++) palette_copy(goxel.palette, &run.palettes[i]);
+    parallel_for(nb, run_parallel_job, &run);
+    for (i = 0; i < nb; i++) palette_release(&run.palettes[i]);
+    free(run.palettes);
+    return run.nb_errors;
+}
+
 static int on_script(int i, const char *path, void *user)
 {
     const char *data;
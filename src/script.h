@@ -25,6 +25,19 @@
  */
 int script_run_from_file(const char *filename, int argc, const char **argv);
 
+/*
+ * Function: script_run_parallel
+ * Run several scripts concurrently, using all the cpu cores.
+ *
+ * Each script runs in its own js runtime, with goxel.image set to a new
+ * empty image.  The functions that change the global state, like
+ * goxel.registerScript or goxel.render, are not available.
+ *
+ * Return the number of scripts that failed.
+ */
+int script_run_parallel(int nb, const char **filenames, int argc,
+                        const char **argv);
+
 void script_init(void);
 
 /*
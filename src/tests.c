@@ -17,9 +17,16 @@
  */
 
 #include "goxel.h"
+#include "script.h"
 
 #include "utils/b64.h"
 
+#include "../ext_src/cgltf/cgltf.h"
+#include "../ext_src/stb/stb_ds.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+
 #define TEST(cond) \
     do { \
         if (!(cond)) { \
@@ -129,9 +136,994 @@ static void test_load_corrupt(void)
     sys_delete_file("/tmp/goxel_test.gox");
 }
 
+// Dict entries bigger than the 256 bytes read buffers are rejected.
+static void test_load_bad_dict(void)
+{
+    FILE *file;
+    char data[1000] = {};
+    int32_t v;
+    int err;
+
+    if (DEFINED(WIN32)) return;
+    file = fopen("/tmp/goxel_test.gox", "w");
+    fwrite("GOX ", 4, 1, file);
+    v = 2;                  fwrite(&v, 4, 1, file);
+    // Value too big.
+    fwrite("IMG ", 4, 1, file);
+    v = 4 + 4 + 4 + 1000;   fwrite(&v, 4, 1, file);
+    v = 4;                  fwrite(&v, 4, 1, file);
+    fwrite("name", 4, 1, file);
+    v = 1000;               fwrite(&v, 4, 1, file);
+    fwrite(data, 1000, 1, file);
+    v = 0;                  fwrite(&v, 4, 1, file); // crc
+    // Key too big.
+    fwrite("IMG ", 4, 1, file);
+    v = 4 + 300;            fwrite(&v, 4, 1, file);
+    v = 300;                fwrite(&v, 4, 1, file);
+    fwrite(data, 300, 1, file);
+    v = 0;                  fwrite(&v, 4, 1, file); // crc
+    fclose(file);
+    err = goxel_import_file("/tmp/goxel_test.gox", NULL);
+    TEST(err == 0);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    sys_delete_file("/tmp/goxel_test.gox");
+}
+
+static void test_volume_read_write(void)
+{
+    volume_t *volume, *ref;
+    const int pos[3] = {-5, 3, 30};
+    const int size[3] = {20, 7, 33};
+    int i, p[3];
+    uint8_t *data, *data2, v[4];
+
+    // Write an unaligned box and compare with a voxel by voxel version.
+    data = calloc(size[0] * size[1] * size[2], 4);
+    data2 = calloc(size[0] * size[1] * size[2], 4);
+    for (i = 0; i < size[0] * size[1] * size[2]; i++) {
+        data[i * 4 + 0] = i % 256;
+        data[i * 4 + 3] = (i % 3) ? 255 : 0;
+    }
+    volume = volume_new();
+    ref = volume_new();
+    volume_write(volume, pos, size, data);
+    for (i = 0; i < size[0] * size[1] * size[2]; i++) {
+        p[0] = pos[0] + i % size[0];
+        p[1] = pos[1] + (i / size[0]) % size[1];
+        p[2] = pos[2] + i / (size[0] * size[1]);
+        volume_set_at(ref, NULL, p, data + i * 4);
+    }
+    TEST(volume_crc32(volume) == volume_crc32(ref));
+    volume_read(volume, pos, size, data2);
+    TEST(memcmp(data, data2, size[0] * size[1] * size[2] * 4) == 0);
+
+    // Writing empty voxels removes the tiles.
+    memset(data, 0, size[0] * size[1] * size[2] * 4);
+    volume_write(volume, pos, size, data);
+    TEST(volume_get_tiles_count(volume) == 0);
+    volume_get_at(volume, NULL, pos, v);
+    TEST(v[3] == 0);
+
+    volume_delete(volume);
+    volume_delete(ref);
+    free(data);
+    free(data2);
+}
+
+// Compare two volumes voxel by voxel.  volume_crc32 depends on the tiles
+// order, so it can't be used for volumes built differently.
+static bool volume_equal(const volume_t *a, const volume_t *b)
+{
+    volume_iterator_t iter;
+    int pos[3];
+    uint8_t v1[4], v2[4];
+    iter = volume_get_union_iterator(a, b, VOLUME_ITER_VOXELS);
+    while (volume_iter(&iter, pos)) {
+        volume_get_at(a, NULL, pos, v1);
+        volume_get_at(b, NULL, pos, v2);
+        if (memcmp(v1, v2, 4) != 0) return false;
+    }
+    return true;
+}
+
+// Check the rigid fast paths of volume_move against the generic resampling,
+// which we force by adding a small noise to the matrices.
+static void test_volume_move(void)
+{
+    volume_t *volume, *fast, *ref;
+    volume_iterator_t iter;
+    int i, j, k, p[3], q[3];
+    uint8_t c[4], c2[4];
+    float v[3], mat[4][4], noisy[4][4];
+    // A translation, and two rotations, each with a tile aligned and an
+    // unaligned offset.
+    const float rots[][3] = {
+        {0, 0, 0}, {0, M_PI, 0}, {M_PI / 2, 0, M_PI / 2},
+    };
+    const int ofs[][3] = {{32, -16, 48}, {5, -3, 17}};
+
+    // Small volume over a few tiles.
+    volume = volume_new();
+    for (p[2] = -6; p[2] < 6; p[2]++)
+    for (p[1] = 3; p[1] < 21; p[1]++)
+    for (p[0] = -10; p[0] < 8; p[0]++) {
+        if ((p[0] * 7 + p[1] * 3 + p[2]) % 5 == 0) continue;
+        c[0] = p[0]; c[1] = p[1]; c[2] = p[2]; c[3] = 255;
+        volume_set_at(volume, NULL, p, c);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(rots); i++)
+    for (j = 0; j < ARRAY_SIZE(ofs); j++) {
+        mat4_set_identity(mat);
+        mat4_itranslate(mat, ofs[j][0], ofs[j][1], ofs[j][2]);
+        mat4_irotate(mat, rots[i][0], 1, 0, 0);
+        mat4_irotate(mat, rots[i][1], 0, 1, 0);
+        mat4_irotate(mat, rots[i][2], 0, 0, 1);
+        mat4_copy(mat, noisy);
+        for (k = 0; k < 3; k++) noisy[3][k] += 0.01;
+
+        fast = volume_copy(volume);
+        volume_move(fast, mat);
+        ref = volume_copy(volume);
+        volume_move(ref, noisy);
+        TEST(volume_equal(fast, ref));
+
+        // Also check that the voxels end up at mat * pos.
+        iter = volume_get_iterator(volume, VOLUME_ITER_SKIP_EMPTY);
+        for (k = 0; k < 1000 && volume_iter(&iter, p); k++) {
+            volume_get_at(volume, &iter, p, c);
+            v[0] = p[0]; v[1] = p[1]; v[2] = p[2];
+            mat4_mul_vec3(mat, v, v);
+            q[0] = round(v[0]); q[1] = round(v[1]); q[2] = round(v[2]);
+            volume_get_at(fast, NULL, q, c2);
+            TEST(memcmp(c, c2, 4) == 0);
+        }
+        volume_delete(fast);
+        volume_delete(ref);
+    }
+    volume_delete(volume);
+}
+
+// Extrude a layer two voxels thick: only its outer slice is swept.
+static void test_volume_extrude(void)
+{
+    volume_t *layer, *volume;
+    volume_iterator_t iter;
+    int p[3], nb = 0, bbox[2][3];
+
+    layer = volume_new();
+    volume = volume_new();
+    for (p[2] = 14; p[2] < 16; p[2]++)
+    for (p[1] = 0; p[1] < 4; p[1]++)
+    for (p[0] = 0; p[0] < 4; p[0]++)
+        volume_set_at(layer, NULL, p, (uint8_t[]){255, 0, 0, 255});
+
+    // Face 3 is +z.
+    volume_extrude(volume, layer, 3, 0, 3);
+    iter = volume_get_iterator(volume, VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, p)) {
+        if (volume_get_alpha_at(volume, &iter, p)) nb++;
+    }
+    TEST(nb == 4 * 4 * 4);
+    volume_get_bbox(volume, bbox, true);
+    TEST(bbox[0][2] == 15 && bbox[1][2] == 19);
+
+    // Face 2 is -z.
+    volume_extrude(volume, layer, 2, 1, 2);
+    volume_get_bbox(volume, bbox, true);
+    TEST(bbox[0][2] == 12 && bbox[1][2] == 14);
+
+    volume_delete(layer);
+    volume_delete(volume);
+}
+
+static void test_volume_components(void)
+{
+    volume_t *volume;
+    volume_component_t *comps;
+    int i, nb, total, p[3];
+    const uint8_t red[4] = {255, 0, 0, 255}, blue[4] = {0, 0, 255, 255};
+
+    volume = volume_new();
+    // A bar crossing a tile boundary, half red and half blue.
+    for (p[0] = -10; p[0] < 10; p[0]++)
+    for (p[1] = 0; p[1] < 3; p[1]++)
+    for (p[2] = 0; p[2] < 3; p[2]++)
+        volume_set_at(volume, NULL, p, p[0] < 0 ? red : blue);
+    // Ten voxels only connected by their edges.
+    for (i = 0; i < 10; i++)
+        volume_set_at(volume, NULL, (int[]){30 + i, 30 + i, 30}, red);
+    // Six voxels only connected by their corners, across tiles.
+    for (i = 0; i < 6; i++)
+        volume_set_at(volume, NULL, (int[]){45 + i, 45 + i, 45 + i}, red);
+
+    nb = volume_get_components(volume, 6, 255, &comps);
+    TEST(nb == 17);
+    TEST(comps[0].nb_voxels == 180);
+    TEST(comps[0].aabb[0][0] == -10 && comps[0].aabb[1][0] == 10);
+    for (i = 0, total = 0; i < nb; i++)
+        total += volume_get_tiles_count(comps[i].volume) ? 1 : 0;
+    TEST(total == nb);
+    volume_components_free(comps, nb);
+
+    nb = volume_get_components(volume, 18, 255, &comps);
+    TEST(nb == 8);
+    TEST(comps[1].nb_voxels == 10);
+    volume_components_free(comps, nb);
+
+    nb = volume_get_components(volume, 26, 255, &comps);
+    TEST(nb == 3);
+    TEST(comps[2].nb_voxels == 6);
+    volume_components_free(comps, nb);
+
+    nb = volume_get_components(volume, 26, 0, &comps);
+    TEST(nb == 4);
+    TEST(comps[0].nb_voxels == 90 && comps[1].nb_voxels == 90);
+    volume_components_free(comps, nb);
+
+    volume_delete(volume);
+}
+
+static int count_voxels(const volume_t *volume)
+{
+    volume_iterator_t iter;
+    int p[3], nb = 0;
+    uint8_t v[4];
+
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, p)) {
+        volume_get_at(volume, &iter, p, v);
+        if (v[3]) nb++;
+    }
+    return nb;
+}
+
+// A 8x8x8 red cube with a hole at its center, plus a lone blue voxel.
+static void test_volume_morphology(void)
+{
+    volume_t *volume, *tmp;
+    int p[3];
+    uint8_t v[4];
+    const uint8_t red[4] = {255, 0, 0, 255}, blue[4] = {0, 0, 255, 255};
+
+    volume = volume_new();
+    for (p[2] = 0; p[2] < 8; p[2]++)
+    for (p[1] = 0; p[1] < 8; p[1]++)
+    for (p[0] = 0; p[0] < 8; p[0]++)
+        volume_set_at(volume, NULL, p, red);
+    volume_set_at(volume, NULL, (int[]){4, 4, 4}, (uint8_t[]){0, 0, 0, 0});
+    volume_set_at(volume, NULL, (int[]){20, 0, 0}, blue);
+
+    // Dilate: the new voxels get the color of their closest neighbor.
+    tmp = volume_copy(volume);
+    volume_morphology(tmp, VOLUME_MORPHO_DILATE, &shape_cube, 1);
+    TEST(count_voxels(tmp) == 10 * 10 * 10 + 3 * 3 * 3);
+    volume_get_at(tmp, NULL, (int[]){-1, -1, -1}, v);
+    TEST(memcmp(v, red, 4) == 0);
+    volume_get_at(tmp, NULL, (int[]){21, 1, 1}, v);
+    TEST(memcmp(v, blue, 4) == 0);
+    volume_delete(tmp);
+
+    // Erode: the lone voxel goes away, and the hole grows.
+    tmp = volume_copy(volume);
+    volume_morphology(tmp, VOLUME_MORPHO_ERODE, &shape_cube, 1);
+    TEST(count_voxels(tmp) == 6 * 6 * 6 - 3 * 3 * 3);
+    volume_delete(tmp);
+
+    // Open: only the lone voxel goes away.
+    tmp = volume_copy(volume);
+    volume_morphology(tmp, VOLUME_MORPHO_OPEN, &shape_cube, 1);
+    TEST(count_voxels(tmp) == 8 * 8 * 8 - 1);
+    volume_get_at(tmp, NULL, (int[]){20, 0, 0}, v);
+    TEST(v[3] == 0);
+    volume_delete(tmp);
+
+    // Close: the hole is filled with the cube color.
+    tmp = volume_copy(volume);
+    volume_morphology(tmp, VOLUME_MORPHO_CLOSE, &shape_cube, 1);
+    TEST(count_voxels(tmp) == 8 * 8 * 8 + 1);
+    volume_get_at(tmp, NULL, (int[]){4, 4, 4}, v);
+    TEST(memcmp(v, red, 4) == 0);
+    volume_delete(tmp);
+
+    // Hollow: remove the eroded voxels.
+    tmp = volume_copy(volume);
+    volume_morphology(tmp, VOLUME_MORPHO_HOLLOW, &shape_cube, 1);
+    TEST(count_voxels(tmp) == 8 * 8 * 8 - (6 * 6 * 6 - 3 * 3 * 3));
+    volume_delete(tmp);
+
+    volume_delete(volume);
+}
+
+// Compare the script Volume.fill with box.iterVoxels, on a rotated box.
+static void test_script_fill(void)
+{
+    const char *path = "/tmp/goxel_test.js";
+    const char *script =
+        "let box = goxel.image.selectionBox\n"
+        "let a = goxel.image.activeLayer.volume\n"
+        "let b = goxel.image.addLayer().volume\n"
+        "let c = goxel.image.addLayer().volume\n"
+        "box.iterVoxels(function(p) { a.setAt(p, [255, 0, 0, 255]) })\n"
+        "b.fill(box, [255, 0, 0, 255])\n"
+        "c.fill(box, function(pos, data) {\n"
+        "  for (let i = 0; i < data.length; i += 4)\n"
+        "    data.set([0, 255, 0, 255], i)\n"
+        "})\n"
+        "c.fill(box, [0, 0, 255, 255], 'paint')\n";
+    const layer_t *layer;
+    FILE *file;
+    float (*box)[4] = goxel.image->selection_box;
+    volume_iterator_t iter;
+    int p[3], nb;
+    uint8_t v[4];
+
+    if (DEFINED(WIN32)) return;
+    bbox_from_extents(box, VEC(3, 4, 5), 10, 6, 4);
+    mat4_irotate(box, 0.5, 0, 0, 1);
+    mat4_irotate(box, 0.3, 1, 0, 0);
+    file = fopen(path, "w");
+    fputs(script, file);
+    fclose(file);
+    TEST(script_run_from_file(path, 0, NULL) == 0);
+    sys_delete_file(path);
+
+    layer = goxel.image->layers;
+    TEST(layer->next && layer->next->next && !layer->next->next->next);
+    nb = count_voxels(layer->volume);
+    TEST(nb > 0);
+    TEST(volume_equal(layer->volume, layer->next->volume));
+    layer = layer->next->next;
+    TEST(count_voxels(layer->volume) == nb);
+    iter = volume_get_iterator(layer->volume,
+            VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, p)) {
+        volume_get_at(layer->volume, &iter, p, v);
+        if (v[3]) TEST(v[0] == 0 && v[1] == 0 && v[2] == 255);
+    }
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Check the tiles based mirror and wrap against a voxel by voxel version,
+// with a box that is not aligned to the tiles.
+static void test_volume_mirror_wrap(void)
+{
+    const int aabb[2][3] = {{-5, 3, -20}, {27, 19, 11}};
+    volume_t *volume, *tmp, *ref;
+    volume_iterator_t iter;
+    int i, axis, op, sign, p[3], q[3], n;
+    uint8_t v[4];
+
+    volume = volume_new();
+    srand(1);
+    for (i = 0; i < 20000; i++) {
+        p[0] = rand() % 60 - 20;
+        p[1] = rand() % 60 - 20;
+        p[2] = rand() % 60 - 20;
+        volume_set_at(volume, NULL, p, (uint8_t[]){
+                rand() % 256, rand() % 256, rand() % 256, 255});
+    }
+
+    // Mirror, then wrap in both directions, along each axis.
+    for (axis = 0; axis < 3; axis++)
+    for (op = 0; op < 3; op++) {
+        tmp = volume_copy(volume);
+        ref = volume_new();
+        sign = op == 1 ? 1 : -1;
+        if (op == 0) volume_mirror(tmp, axis, aabb);
+        else volume_wrap(tmp, axis, sign, aabb);
+        n = aabb[1][axis] - aabb[0][axis];
+        iter = volume_get_iterator(volume,
+                VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+        while (volume_iter(&iter, p)) {
+            volume_get_at(volume, &iter, p, v);
+            if (!v[3]) continue;
+            memcpy(q, p, sizeof(p));
+            if (    p[0] >= aabb[0][0] && p[0] < aabb[1][0] &&
+                    p[1] >= aabb[0][1] && p[1] < aabb[1][1] &&
+                    p[2] >= aabb[0][2] && p[2] < aabb[1][2]) {
+                if (op == 0)
+                    q[axis] = aabb[0][axis] + aabb[1][axis] - 1 - p[axis];
+                else
+                    q[axis] = aabb[0][axis] +
+                              (p[axis] - aabb[0][axis] + sign + n) % n;
+            }
+            volume_set_at(ref, NULL, q, v);
+        }
+        TEST(volume_equal(tmp, ref));
+        volume_delete(tmp);
+        volume_delete(ref);
+    }
+    volume_delete(volume);
+}
+
+static void invert_color(void *args, uint8_t color[4])
+{
+    atomic_int *nb_calls = args;
+    (*nb_calls)++;
+    color[0] = 255 - color[0];
+    color[1] = 255 - color[1];
+    color[2] = 255 - color[2];
+}
+
+// Apply a color filter to the voxels in the selection box, and check that
+// it is only called once per distinct color and thread.
+static void test_color_filter(void)
+{
+    volume_t *volume = goxel.image->active_layer->volume;
+    const uint8_t colors[4][4] = {
+        {255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 255}, {10, 20, 30, 255},
+    };
+    atomic_int nb_calls = 0;
+    int p[3];
+    uint8_t v[4];
+    const uint8_t *c;
+
+    for (p[2] = 0; p[2] < 8; p[2]++)
+    for (p[1] = 0; p[1] < 8; p[1]++)
+    for (p[0] = 0; p[0] < 64; p[0]++)
+        volume_set_at(volume, NULL, p, colors[p[0] / 3 % 4]);
+    bbox_from_extents(goxel.image->selection_box, VEC(16, 4, 4), 16, 4, 4);
+    goxel_apply_color_filter(invert_color, &nb_calls);
+
+    TEST(nb_calls >= 4 && nb_calls <= 4 * parallel_get_nb_threads());
+    for (p[2] = 0; p[2] < 8; p[2]++)
+    for (p[1] = 0; p[1] < 8; p[1]++)
+    for (p[0] = 0; p[0] < 64; p[0]++) {
+        if (p[0] > 30 && p[0] < 34) continue; // Box edge.
+        c = colors[p[0] / 3 % 4];
+        volume_get_at(volume, NULL, p, v);
+        if (p[0] < 32) {
+            TEST(v[0] == 255 - c[0] && v[1] == 255 - c[1] &&
+                 v[2] == 255 - c[2] && v[3] == c[3]);
+        } else {
+            TEST(memcmp(v, c, 4) == 0);
+        }
+    }
+
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static void test_volume_sdf(void)
+{
+    volume_t *volume, *ref;
+    shape_t slow;
+    int p[3], bbox[2][3];
+    float sdf[40];
+    const uint8_t color[4] = {255, 255, 255, 255};
+
+    volume = volume_new();
+    // A 20x20x20 cube crossing tile boundaries.
+    for (p[2] = -10; p[2] < 10; p[2]++)
+    for (p[1] = -10; p[1] < 10; p[1]++)
+    for (p[0] = -10; p[0] < 10; p[0]++)
+        volume_set_at(volume, NULL, p, color);
+
+    // A line along x, through the cube center.
+    volume_get_sdf(volume, (int[]){-20, 0, 0}, (int[]){40, 1, 1}, 4.5, sdf);
+    TEST(sdf[0] == 4.5f);           // Clamped outside.
+    TEST(sdf[9] == 0.5f);           // Just outside the face.
+    TEST(sdf[10] == -0.5f);         // Just inside the face.
+    TEST(sdf[12] == -2.5f);
+    TEST(sdf[20] == -4.5f);         // Clamped inside.
+    TEST(sdf[29] == -0.5f);
+    TEST(sdf[30] == 0.5f);
+
+    // Diagonal from the cube corner, computed again from the cache.
+    volume_get_sdf(volume, (int[]){10, 10, 10}, (int[]){1, 1, 1}, 4.5, sdf);
+    TEST(fabsf(sdf[0] - (sqrtf(3) - 0.5f)) < 1e-5);
+    volume_get_sdf(volume, (int[]){10, 10, 10}, (int[]){1, 1, 1}, 4.5, sdf);
+    TEST(fabsf(sdf[0] - (sqrtf(3) - 0.5f)) < 1e-5);
+
+    // Any non zero alpha is solid.
+    volume_set_at(volume, NULL, (int[]){14, 0, 0}, (uint8_t[]){0, 0, 0, 1});
+    volume_get_sdf(volume, (int[]){13, 0, 0}, (int[]){3, 1, 1}, 4.5, sdf);
+    TEST(sdf[0] == 0.5f && sdf[1] == -0.5f && sdf[2] == 0.5f);
+    volume_set_at(volume, NULL, (int[]){14, 0, 0}, (uint8_t[]){0, 0, 0, 0});
+
+    // The sphere erosion uses the field: check it against the offsets
+    // path, that we force with a copy of the shape.
+    slow = shape_sphere;
+    ref = volume_copy(volume);
+    volume_set_at(volume, NULL, (int[]){0, 10, 0}, color);
+    volume_set_at(ref, NULL, (int[]){0, 10, 0}, color);
+    volume_morphology(volume, VOLUME_MORPHO_ERODE, &shape_sphere, 2);
+    volume_morphology(ref, VOLUME_MORPHO_ERODE, &slow, 2);
+    TEST(volume_equal(volume, ref));
+    volume_get_bbox(volume, bbox, true);
+    TEST(bbox[0][0] == -8 && bbox[1][0] == 8);
+    volume_delete(ref);
+
+    volume_delete(volume);
+}
+
+static void test_volume_downsample(void)
+{
+    volume_t *volume, *half;
+    int p[3], nb = 0;
+    uint8_t v[4];
+    volume_iterator_t iter;
+
+    volume = volume_new();
+    // A 20x20x20 cube crossing tile boundaries, with two colors in equal
+    // proportions.
+    for (p[2] = -10; p[2] < 10; p[2]++)
+    for (p[1] = -10; p[1] < 10; p[1]++)
+    for (p[0] = -10; p[0] < 10; p[0]++) {
+        volume_set_at(volume, NULL, p, (uint8_t[]){
+                      p[0] % 2 ? 100 : 200, 0, 0, 255});
+    }
+    // A single voxel, that should disappear.
+    volume_set_at(volume, NULL, (int[]){40, 0, 0},
+                  (uint8_t[]){255, 255, 255, 255});
+
+    half = volume_downsample(volume);
+    iter = volume_get_iterator(half, VOLUME_ITER_VOXELS);
+    while (volume_iter(&iter, p)) {
+        volume_get_at(half, &iter, p, v);
+        if (v[3]) nb++;
+    }
+    TEST(nb == 10 * 10 * 10);
+    volume_get_at(half, NULL, (int[]){-5, -5, -5}, v);
+    TEST(v[0] == 200 && v[3] == 255);
+    volume_get_at(half, NULL, (int[]){4, 4, 4}, v);
+    TEST(v[0] == 200 && v[3] == 255);
+    volume_get_at(half, NULL, (int[]){5, 0, 0}, v);
+    TEST(v[3] == 0);
+
+    volume_delete(half);
+    volume_delete(volume);
+}
+
+// Check that a stroke gives the same result as painting each stamp in
+// turn, for MODE_MAX and for a mode that needs the fallback.
+static void test_volume_op_stroke(void)
+{
+    volume_t *base, *a, *b;
+    float boxes[12][4][4];
+    int i, m, p[3];
+    painter_t painter = {
+        .shape = &shape_sphere,
+        .smoothness = 1,
+        .symmetry = 1,
+    };
+    const int modes[] = {MODE_MAX, MODE_OVER};
+
+    base = volume_new();
+    for (p[2] = -8; p[2] < 8; p[2]++)
+    for (p[1] = -8; p[1] < 8; p[1]++)
+    for (p[0] = 0; p[0] < 24; p[0]++)
+        volume_set_at(base, NULL, p, (uint8_t[]){0, 255, 0, 255});
+
+    // Overlapping spheres along a line, crossing tiles boundaries.
+    for (i = 0; i < 12; i++) {
+        mat4_set_identity(boxes[i]);
+        mat4_itranslate(boxes[i], 3 + i * 2.5, 5, 2);
+        mat4_iscale(boxes[i], 4, 4, 4);
+    }
+
+    for (m = 0; m < ARRAY_SIZE(modes); m++) {
+        painter.mode = modes[m];
+        memcpy(painter.color, (uint8_t[]){255, 0, 0, 128}, 4);
+        a = volume_copy(base);
+        b = volume_copy(base);
+        volume_op_stroke(a, &painter, (const float (*)[4][4])boxes, 12);
+        for (i = 0; i < 12; i++) volume_op(b, &painter, boxes[i]);
+        TEST(volume_equal(a, b));
+        volume_delete(a);
+        volume_delete(b);
+    }
+    volume_delete(base);
+}
+
+// Check that the meshes of single tiles, simplified separately, join
+// without cracks: each edge should be used once in both directions.
+static void test_tiles_mesh_seams(void)
+{
+    typedef struct { int a[3], b[3]; } edge_t;
+    volume_t *volume;
+    volume_mesh_t *mesh;
+    volume_iterator_t iter;
+    struct { edge_t key; int value; } *edges = NULL;
+    edge_t e, r;
+    const float *a, *b;
+    int i, j, k, n, p[3], nb_bad = 0;
+
+    volume = volume_new();
+    // A sphere crossing tile boundaries, with two colors.
+    for (p[2] = -20; p[2] < 20; p[2]++)
+    for (p[1] = -20; p[1] < 20; p[1]++)
+    for (p[0] = -20; p[0] < 20; p[0]++) {
+        if (p[0] * p[0] + p[1] * p[1] + p[2] * p[2] >= 18 * 18) continue;
+        volume_set_at(volume, NULL, p, (uint8_t[]){
+                      p[2] < 3 ? 255 : 0, 0, 255, 255});
+    }
+
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, p)) {
+        mesh = volume_generate_tiles_mesh(volume, 0, NULL, 0.5,
+                                          (const int (*)[3])p, 1);
+        for (i = 0; i < mesh->indices_count; i++) {
+            j = i - i % 3 + (i + 1) % 3;
+            a = mesh->vertices[mesh->indices[i]].pos;
+            b = mesh->vertices[mesh->indices[j]].pos;
+            // Keep the keys positive: stb_ds hash shifts the high bytes
+            // into the int sign bit.
+            for (k = 0; k < 3; k++) {
+                e.a[k] = lroundf(a[k] * 2) + 1024;
+                e.b[k] = lroundf(b[k] * 2) + 1024;
+            }
+            n = hmget(edges, e);
+            hmput(edges, e, n + 1);
+        }
+        volume_mesh_free(mesh);
+    }
+    TEST(hmlen(edges) > 0);
+    for (i = 0; i < hmlen(edges); i++) {
+        memcpy(r.a, edges[i].key.b, sizeof(r.a));
+        memcpy(r.b, edges[i].key.a, sizeof(r.b));
+        n = hmget(edges, r);
+        if (n != edges[i].value) nb_bad++;
+    }
+    TEST(nb_bad == 0);
+    hmfree(edges);
+    volume_delete(volume);
+}
+
+// Export a box over two adjacent tiles, and check that the vertices on the
+// tiles border are only written once.
+static void test_export_obj_seams(void)
+{
+    const char *path = "/tmp/goxel_test.obj";
+    volume_t *volume = goxel.image->active_layer->volume;
+    char *data, *line, *end, **verts = NULL;
+    int i, j, size, p[3], nb_seam = 0;
+
+    if (DEFINED(WIN32)) return;
+    for (p[2] = 0; p[2] < 4; p[2]++)
+    for (p[1] = 0; p[1] < 4; p[1]++)
+    for (p[0] = 8; p[0] < 24; p[0]++)
+        volume_set_at(volume, NULL, p, (uint8_t[]){255, 0, 0, 255});
+    TEST(goxel_export_to_file(path, "obj") == 0);
+    data = read_file(path, &size);
+    TEST(data);
+    for (line = data; line; line = end ? end + 1 : NULL) {
+        end = strchr(line, '\n');
+        if (end) *end = '\0';
+        if (strncmp(line, "v ", 2) != 0) continue;
+        if (strncmp(line, "v 16 ", 5) == 0) nb_seam++;
+        arrput(verts, line);
+    }
+    TEST(nb_seam > 0);
+    for (i = 0; i < arrlen(verts); i++)
+        for (j = 0; j < i; j++) TEST(strcmp(verts[i], verts[j]) != 0);
+    arrfree(verts);
+    free(data);
+    sys_delete_file(path);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+// Export a layer with two levels of detail and parse the file back to check
+// the MSFT_lod extension.
+static void test_export_gltf_lods(void)
+{
+    const char *path = "/tmp/goxel_test.gltf";
+    image_t *img;
+    volume_t *volume;
+    cgltf_options options = {};
+    cgltf_data *data = NULL;
+    const cgltf_node *node = NULL, *lod;
+    int i, p[3], ids[2];
+    char name[64];
+
+    if (DEFINED(WIN32)) return;
+    img = image_new();
+    volume = img->active_layer->volume;
+    for (p[2] = 0; p[2] < 16; p[2]++)
+    for (p[1] = 0; p[1] < 16; p[1]++)
+    for (p[0] = 0; p[0] < 16; p[0]++)
+        volume_set_at(volume, NULL, p, (uint8_t[]){255, 0, 0, 255});
+    TEST(gltf_export_file(img, path, false, false, 2) == 0);
+
+    TEST(cgltf_parse_file(&options, path, &data) == cgltf_result_success);
+    TEST(cgltf_load_buffers(&options, data, path) == cgltf_result_success);
+    TEST(cgltf_validate(data) == cgltf_result_success);
+    TEST(data->extensions_used_count == 1);
+    TEST(strcmp(data->extensions_used[0], "MSFT_lod") == 0);
+    for (i = 0; i < data->nodes_count; i++) {
+        if (data->nodes[i].extensions_count) node = &data->nodes[i];
+    }
+    TEST(node && node->extensions_count == 1);
+    TEST(strcmp(node->extensions[0].name, "MSFT_lod") == 0);
+    TEST(sscanf(node->extensions[0].data, "{\"ids\":[%d,%d]}",
+                &ids[0], &ids[1]) == 2);
+    for (i = 0; i < 2; i++) {
+        TEST(ids[i] >= 0 && ids[i] < data->nodes_count);
+        lod = &data->nodes[ids[i]];
+        snprintf(name, sizeof(name), "%s_LOD%d", node->name, i + 1);
+        TEST(strcmp(lod->name, name) == 0);
+        TEST(lod->mesh && !lod->parent);
+    }
+    TEST(node->extras.data &&
+         strstr(node->extras.data, "\"MSFT_screencoverage\":[0.5,0.25,0]"));
+
+    cgltf_free(data);
+    sys_delete_file(path);
+    image_delete(img);
+}
+
+// Export a model larger than 256 voxels, that has to be split into several
+// vox models, and check that the voxels are back at the same positions
+// after import.
+static void test_export_vox_large(void)
+{
+    const char *path = "/tmp/goxel_test.vox";
+    const uint8_t colors[3][4] = {
+        {255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 255}};
+    volume_t *volume, *expected;
+    layer_t *layer;
+    int i, p[3], nb_layers = 0;
+
+    if (DEFINED(WIN32)) return;
+    volume = goxel.image->active_layer->volume;
+    // A line from -100 to 299 along x, with some voxels around it.
+    for (p[0] = -100, p[1] = 3, p[2] = -7; p[0] < 300; p[0]++)
+        volume_set_at(volume, NULL, p, colors[(p[0] + 100) / 50 % 3]);
+    srand(1);
+    for (i = 0; i < 1000; i++) {
+        p[0] = rand() % 400 - 100;
+        p[1] = rand() % 20 - 5;
+        p[2] = rand() % 300 - 20;
+        volume_set_at(volume, NULL, p, colors[i % 3]);
+    }
+    expected = volume_copy(volume);
+    TEST(goxel_export_to_file(path, NULL) == 0);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+
+    TEST(goxel_import_file(path, NULL) == 0);
+    for (layer = goxel.image->layers; layer; layer = layer->next)
+        nb_layers++;
+    TEST(nb_layers == 4); // 2x1x2 models.
+    TEST(volume_equal(goxel_get_layers_volume(goxel.image), expected));
+
+    volume_delete(expected);
+    sys_delete_file(path);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
+static uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Export a small quantized glb, and check the container header and chunks
+// lengths, and that the meshes use 16 bits indices.
+static void test_export_glb(void)
+{
+    const char *path = "/tmp/goxel_test.glb";
+    image_t *img;
+    volume_t *volume;
+    cgltf_options options = {};
+    cgltf_data *data = NULL;
+    const cgltf_primitive *primitive;
+    const cgltf_accessor *accessor;
+    uint8_t *glb;
+    int i, j, size, p[3], json_size, nb_primitives = 0;
+
+    if (DEFINED(WIN32)) return;
+    img = image_new();
+    volume = img->active_layer->volume;
+    for (p[2] = 0; p[2] < 16; p[2]++)
+    for (p[1] = 0; p[1] < 16; p[1]++)
+    for (p[0] = 0; p[0] < 16; p[0]++)
+        volume_set_at(volume, NULL, p, (uint8_t[]){255, p[0] * 16, 0, 255});
+    TEST(gltf_export_file(img, path, true, true, 0) == 0);
+
+    glb = (uint8_t*)read_file(path, &size);
+    TEST(glb && size > 28);
+    TEST(read_le32(glb + 0) == 0x46546C67); // 'glTF'
+    TEST(read_le32(glb + 4) == 2);
+    TEST(read_le32(glb + 8) == size);
+    json_size = read_le32(glb + 12);
+    TEST(json_size % 4 == 0);
+    TEST(read_le32(glb + 16) == 0x4E4F534A); // 'JSON'
+    TEST(glb[20] == '{');
+    TEST(20 + json_size + 8 <= size);
+    TEST(read_le32(glb + 20 + json_size) % 4 == 0);
+    TEST(20 + json_size + 8 + read_le32(glb + 20 + json_size) == size);
+    TEST(read_le32(glb + 20 + json_size + 4) == 0x004E4942); // 'BIN'
+    free(glb);
+
+    TEST(cgltf_parse_file(&options, path, &data) == cgltf_result_success);
+    TEST(cgltf_load_buffers(&options, data, path) == cgltf_result_success);
+    TEST(cgltf_validate(data) == cgltf_result_success);
+    TEST(data->extensions_required_count == 1);
+    TEST(strcmp(data->extensions_required[0], "KHR_mesh_quantization") == 0);
+    for (i = 0; i < data->meshes_count; i++) {
+        for (j = 0; j < data->meshes[i].primitives_count; j++) {
+            primitive = &data->meshes[i].primitives[j];
+            accessor = primitive->indices;
+            TEST(accessor->component_type == cgltf_component_type_r_16u);
+            TEST(accessor->buffer_view->size ==
+                 accessor->count * sizeof(uint16_t));
+            TEST(primitive->attributes[0].data->component_type ==
+                 cgltf_component_type_r_16);
+            nb_primitives++;
+        }
+    }
+    TEST(nb_primitives > 0);
+
+    cgltf_free(data);
+    sys_delete_file(path);
+    image_delete(img);
+}
+
+// Import a 5x5x5 voxels cube mesh, with no colors, all the vertices
+// colored, or only some of them, with and without fill.
+static void test_import_obj(void)
+{
+    const char *path = "/tmp/goxel_test.obj";
+    const int faces[6][4] = {
+        {1, 3, 7, 5}, {2, 4, 8, 6}, {1, 2, 6, 5},
+        {3, 4, 8, 7}, {1, 2, 4, 3}, {5, 6, 8, 7}};
+    FILE *file;
+    image_t *img;
+    volume_iterator_t iter;
+    int i, colors, fill, p[3], nb, nb_opaque;
+    uint8_t v[4];
+
+    if (DEFINED(WIN32)) return;
+    for (colors = 0; colors < 3; colors++)
+    for (fill = 0; fill < 2; fill++) {
+        file = fopen(path, "w");
+        for (i = 0; i < 8; i++) {
+            fprintf(file, "v %d %d %d", (i & 1) ? -6 : -10,
+                    (i & 2) ? -6 : -10, (i & 4) ? -6 : -10);
+            if (colors == 1 || (colors == 2 && i % 2))
+                fprintf(file, " 1 0 0");
+            fprintf(file, "\n");
+        }
+        for (i = 0; i < 6; i++) {
+            fprintf(file, "f %d %d %d %d\n", faces[i][0], faces[i][1],
+                    faces[i][2], faces[i][3]);
+        }
+        fclose(file);
+
+        img = image_new();
+        TEST(obj_import(img, path, 1, fill) == 0);
+        nb = nb_opaque = 0;
+        iter = volume_get_iterator(img->active_layer->volume,
+                                   VOLUME_ITER_SKIP_EMPTY);
+        while (volume_iter(&iter, p)) {
+            volume_get_at(img->active_layer->volume, &iter, p, v);
+            if (!v[3]) continue;
+            nb++;
+            if (v[3] == 255) nb_opaque++;
+        }
+        TEST(nb == (fill ? 5 * 5 * 5 : 5 * 5 * 5 - 3 * 3 * 3));
+        TEST(nb_opaque == nb);
+        image_delete(img);
+    }
+    sys_delete_file(path);
+}
+
+static void test_quantization(void)
+{
+    volume_t *volume;
+    uint8_t palette[8][4];
+    const uint8_t colors[3][4] = {
+        {255, 0, 0, 255}, {0, 255, 0, 255}, {0, 0, 255, 255}};
+    int i, j, x, found;
+
+    // Fewer colors than the palette size: they are all kept exactly.
+    volume = volume_new();
+    for (x = 0; x < 30; x++)
+        volume_set_at(volume, NULL, (int[]){x, 0, 0}, colors[x % 3]);
+    quantization_gen_palette(volume, 8, 4, palette);
+    for (i = 0; i < 3; i++) {
+        for (j = 0, found = 0; j < 8; j++)
+            found += memcmp(palette[j], colors[i], 4) == 0;
+        TEST(found);
+    }
+
+    // A full grey gradient, split into four equal ranges.
+    volume_clear(volume);
+    for (x = 0; x < 256; x++)
+        volume_set_at(volume, NULL, (int[]){x, 0, 0},
+                      (uint8_t[]){x, x, x, 255});
+    quantization_gen_palette(volume, 4, 4, palette);
+    for (i = 0; i < 4; i++) {
+        for (j = 0, found = 0; j < 4; j++)
+            found += abs(palette[j][0] - (i * 64 + 32)) <= 1;
+        TEST(found == 1);
+    }
+    volume_delete(volume);
+}
+
+static void test_palette_search(void)
+{
+    palette_t palette = {};
+    uint8_t c[4], q[4];
+    int i, j, k, r, dr, dg, db, d, best, best_dist;
+
+    // Random colors, plus a duplicate of the first one, added directly since
+    // palette_insert would skip it.
+    srand(0);
+    for (i = 0; i < 500; i++) {
+        for (k = 0; k < 3; k++) c[k] = rand() % 256;
+        c[3] = 255;
+        palette_insert(&palette, c, NULL);
+    }
+    memcpy(c, palette.entries[0].color, 4);
+    palette.entries[palette.size++] = palette.entries[0];
+    TEST(palette_search(&palette, c, true) == 0);
+    c[3] = 0;
+    TEST(palette_search(&palette, c, true) == -1);
+    TEST(palette_search(&palette, c, false) == 0);
+
+    // Some entries not indexed yet, searched linearly.
+    for (i = 0; i < 10; i++) {
+        for (k = 0; k < 3; k++) c[k] = rand() % 256;
+        c[3] = 255;
+        memcpy(palette.entries[palette.size++].color, c, 4);
+    }
+
+    // Compare the nearest colors with a brute force search, before and
+    // after updating the index.
+    for (j = 0; j < 2000; j++) {
+        if (j == 1000) palette_update_index(&palette);
+        for (k = 0; k < 3; k++) q[k] = rand() % 256;
+        q[3] = 255;
+        best = -1;
+        best_dist = INT_MAX;
+        for (i = 0; i < palette.size; i++) {
+            r = (q[0] + palette.entries[i].color[0]) / 2;
+            dr = q[0] - palette.entries[i].color[0];
+            dg = q[1] - palette.entries[i].color[1];
+            db = q[2] - palette.entries[i].color[2];
+            d = (((512 + r) * dr * dr) >> 8) + 4 * dg * dg +
+                (((767 - r) * db * db) >> 8);
+            if (d < best_dist) {
+                best = i;
+                best_dist = d;
+            }
+        }
+        TEST(palette_search(&palette, q, false) == best);
+    }
+    palette_release(&palette);
+}
+
 void tests_run(void)
 {
     test_load_file_v2();
     test_load_file_v1_with_preview();
     test_load_corrupt();
+    test_load_bad_dict();
+    test_volume_read_write();
+    test_volume_move();
+    test_volume_extrude();
+    test_volume_components();
+    test_volume_morphology();
+    test_volume_mirror_wrap();
+    test_color_filter();
+    test_volume_sdf();
+    test_script_fill();
+    test_volume_downsample();
+    test_volume_op_stroke();
+    test_tiles_mesh_seams();
+    test_export_obj_seams();
+    test_export_gltf_lods();
+    test_export_glb();
+    test_export_vox_large();
+    test_import_obj();
+    test_quantization();
+    test_palette_search();
 }
@@ -107,7 +107,7 @@ static int on_drag(gesture3d_t *gest)
 {
     tool_brush_t *brush = USER_GET(gest->user, 0);
     painter_t painter = *(painter_t*)USER_GET(gest->user, 1);
-    float box[4][4];
+    float box[4][4], (*boxes)[4][4];
     bool shift = gest->flags & GESTURE3D_FLAG_SHIFT;
     float r = goxel.tool_radius;
     int nb, i;
@@ -137,15 +137,19 @@ static int on_drag(gesture3d_t *gest)
     painter.mode = MODE_MAX;
     vec4_set(painter.color, 255, 255, 255, 255);
 
-    // Render several times if the space between the current pos
-    // and the last pos is larger than the size of the tool shape.
+    // Render several stamps if the space between the current pos
+    // and the last pos is larger than the size of the tool shape, all
+    // in a single pass.
     nb = ceil(vec3_dist(gest->pos, brush->last_pos) / (2 * r));
     nb = max(nb, 1);
+    boxes = malloc(nb * sizeof(*boxes));
     for (i = 0; i < nb; i++) {
         vec3_mix(brush->last_pos, gest->pos, (i + 1.0) / nb, pos);
-        get_box(pos, NULL, gest->normal, r, NULL, box);
-        volume_op(brush->volume, &painter, box);
+        get_box(pos, NULL, gest->normal, r, NULL, boxes[i]);
     }
+    volume_op_stroke(brush->volume, &painter, (const float (*)[4][4])boxes,
+                     nb);
+    free(boxes);
 
     painter = *(painter_t*)USER_GET(gest->user, 1);
     if (!goxel.tool_volume) goxel.tool_volume = volume_new();
@@ -25,6 +25,7 @@ typedef struct {
     volume_t *mask_orig;
 
     volume_t *volume;
+    volume_t *swept;    // Last swept volume applied.
     int    snap_face;
     float  normal[3];
     int    delta;
@@ -80,39 +81,44 @@ static int get_face(const float n[3])
     return -1;
 }
 
-static void extrude(
-        volume_t *volume, const volume_t *origin,
-        const volume_t *selection,
-        const float normal[3], int delta)
+// Replace the previous sweep by the new one.  Only the tiles of the two
+// sweeps are restored from the origin volume and updated, so that the cost
+// doesn't depend on the volume size.
+static void apply_swept(volume_t *volume, const volume_t *origin,
+                        const volume_t *old_swept, const volume_t *swept,
+                        int delta)
 {
-    float box[4][4], pos[3], plane[4][4];
-    int snap_face;
-    volume_t *tmp_volume;
+    volume_iterator_t iter;
+    int pos[3];
 
     if (volume_is_empty(origin)) return;
-    volume_set(volume, origin);
-
-    if (delta == 0) return;
-    snap_face = get_face(normal);
-    volume_get_box(selection, true, box);
-    mat4_mul(box, FACES_MATS[snap_face], plane);
-    tmp_volume = volume_copy(selection);
-    vec3_addk(plane[3], normal, delta, pos);
-
-    if (delta >= 1) {
-        vec3_iaddk(plane[3], normal, -0.5);
-        box_move_face(box, snap_face, pos, box);
-        volume_extrude(tmp_volume, plane, box);
-        volume_merge(volume, tmp_volume, MODE_OVER, NULL);
-    }
-    if (delta < 0) {
-        box_move_face(box, FACES_OPPOSITES[snap_face], pos, box);
-        vec3_imul(plane[2], -1.0);
-        vec3_iaddk(plane[3], normal, -0.5);
-        volume_extrude(tmp_volume, plane, box);
-        volume_merge(volume, tmp_volume, MODE_SUB, NULL);
+    iter = volume_get_union_iterator(old_swept, swept, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        volume_copy_tile(origin, pos, volume, pos);
+        if (delta == 0) continue;
+        volume_merge_tile(volume, swept, pos,
+                          delta > 0 ? MODE_OVER : MODE_SUB, NULL);
     }
-    volume_delete(tmp_volume);
+}
+
+// Extrude the selected face layer by tool->delta voxels, starting from the
+// volume and selection mask saved at the beginning of the drag.
+static void extrude(tool_extrude_t *tool, volume_t *volume, volume_t *mask)
+{
+    volume_t *swept;
+    int delta = tool->delta;
+
+    // Sweep the face layer once, and apply it to both the volume and the
+    // selection mask.
+    swept = volume_new();
+    if (delta > 0)
+        volume_extrude(swept, tool->volume, tool->snap_face, 0, delta);
+    if (delta < 0)
+        volume_extrude(swept, tool->volume, tool->snap_face, delta + 1, 0);
+    apply_swept(volume, tool->volume_orig, tool->swept, swept, delta);
+    apply_swept(mask, tool->mask_orig, tool->swept, swept, delta);
+    volume_delete(tool->swept);
+    tool->swept = swept;
 }
 
 static int on_click(gesture3d_t *gest)
@@ -130,8 +136,7 @@ static int on_drag(gesture3d_t *gest)
     volume_t *volume = goxel.image->active_layer->volume;
     volume_t *mask = goxel.image->selection_mask;
     volume_t *tmp_volume;
-    float face_plane[4][4];
-    float pos[3], v[3], box[4][4];
+    float pos[3], v[3];
     int pi[3];
     float delta;
 
@@ -160,7 +165,8 @@ static int on_drag(gesture3d_t *gest)
         tool->volume_orig = volume_copy(volume);
         volume_delete(tool->mask_orig);
         tool->mask_orig = volume_copy(mask);
-        volume_get_box(tool->volume, true, box);
+        volume_delete(tool->swept);
+        tool->swept = volume_new();
 
         // Once we start dragging, snap to a line along the extrude direction.
         gest->snap_mask = SNAP_SHAPE_LINE;
@@ -170,8 +176,6 @@ static int on_drag(gesture3d_t *gest)
         tool->delta = 0;
     }
 
-    volume_get_box(tool->volume, true, box);
-    mat4_mul(box, FACES_MATS[tool->snap_face], face_plane);
     vec3_project(gest->pos, gest->start_normal, pos);
     vec3_sub(pos, gest->start_pos, v);
     delta = lround(vec3_dot(gest->start_normal, v));
@@ -180,10 +184,7 @@ static int on_drag(gesture3d_t *gest)
     if (delta == tool->delta) goto end;
     tool->delta = delta;
 
-    extrude(volume, tool->volume_orig, tool->volume,
-            gest->start_normal, delta);
-    extrude(mask, tool->mask_orig, tool->volume,
-            gest->start_normal, delta);
+    extrude(tool, volume, mask);
 
 end:
     if (gest->state == GESTURE3D_STATE_END) {
@@ -237,10 +238,7 @@ static int gui(tool_t *tool_)
 
     gui_enabled_begin(tool->volume != NULL);
     if (gui_input_int(_("Delta"), &tool->delta, 0, 0)) {
-        extrude(volume, tool->volume_orig, tool->volume,
-                tool->normal, tool->delta);
-        extrude(goxel.image->selection_mask, tool->mask_orig, tool->volume,
-                tool->normal, tool->delta);
+        extrude(tool, volume, goxel.image->selection_mask);
     }
     if (gui_is_item_deactivated()) {
         image_history_push(goxel.image);
@@ -0,0 +1,100 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024-present Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapped_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__EMSCRIPTEN__)
+#   define HAS_MMAP 1
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#else
+#   define HAS_MMAP 0
+#endif
+
+#if HAS_MMAP
+
+int mapped_file_open(mapped_file_t *file, const char *path)
+{
+    int fd;
+    struct stat st;
+    void *data;
+
+    memset(file, 0, sizeof(*file));
+    fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid.
+    if (data == MAP_FAILED) return -1;
+    file->data = data;
+    file->size = st.st_size;
+    return 0;
+}
+
+void mapped_file_close(mapped_file_t *file)
+{
+    if (file->data) munmap((void*)file->data, file->size);
+    memset(file, 0, sizeof(*file));
+}
+
+#else
+
+int mapped_file_open(mapped_file_t *file, const char *path)
+{
+    FILE *in;
+    long size;
+    char *data;
+
+    memset(file, 0, sizeof(*file));
+    in = fopen(path, "rb");
+    if (!in) return -1;
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if (size <= 0) {
+        fclose(in);
+        return -1;
+    }
+    data = malloc(size);
+    if (fread(data, size, 1, in) != 1) {
+        free(data);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+    file->data = data;
+    file->size = size;
+    return 0;
+}
+
+void mapped_file_close(mapped_file_t *file)
+{
+    free((void*)file->data);
+    memset(file, 0, sizeof(*file));
+}
+
+#endif
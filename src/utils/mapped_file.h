@@ -0,0 +1,51 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024-present Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Minimal helper to access a whole file in memory without reading it first,
+ * using mmap.  On platforms without mmap the file is read into memory
+ * instead.
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    const char  *data;
+    size_t      size;
+} mapped_file_t;
+
+/*
+ * Function: mapped_file_open
+ * Map a file in memory, read only.
+ *
+ * Return:
+ *   0 on success, -1 if the file cannot be opened or is empty.
+ */
+int mapped_file_open(mapped_file_t *file, const char *path);
+
+/*
+ * Function: mapped_file_close
+ * Release a file opened with mapped_file_open.
+ */
+void mapped_file_close(mapped_file_t *file);
+
+#endif // MAPPED_FILE_H
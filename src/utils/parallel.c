@@ -0,0 +1,132 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024-present Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "parallel.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#if defined(__EMSCRIPTEN__)
+#   define HAS_THREADS 0
+#else
+#   define HAS_THREADS 1
+#   include <pthread.h>
+#endif
+
+#if defined(_WIN32)
+#   include <windows.h>
+#elif HAS_THREADS
+#   include <unistd.h>
+#endif
+
+// Don't spawn more threads than that, even on huge machines.
+#define MAX_THREADS 64
+
+typedef struct {
+    void (*f)(void *user, int i, int thread);
+    void *user;
+    int n;
+    atomic_int next;
+} job_t;
+
+typedef struct {
+    job_t *job;
+    int thread;
+} worker_t;
+
+static int g_nb_threads = 1;
+
+#if HAS_THREADS
+static pthread_once_t g_nb_threads_once = PTHREAD_ONCE_INIT;
+
+// Set while a thread runs jobs, so that nested calls to parallel_for run
+// serially instead of spawning more threads.
+static _Thread_local bool g_in_worker = false;
+
+static void init_nb_threads(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    g_nb_threads = info.dwNumberOfProcessors;
+#else
+    g_nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (g_nb_threads < 1) g_nb_threads = 1;
+    if (g_nb_threads > MAX_THREADS) g_nb_threads = MAX_THREADS;
+}
+#endif
+
+int parallel_get_nb_threads(void)
+{
+#if HAS_THREADS
+    pthread_once(&g_nb_threads_once, init_nb_threads);
+#endif
+    return g_nb_threads;
+}
+
+static void *worker_func(void *arg)
+{
+    worker_t *worker = arg;
+    job_t *job = worker->job;
+    int i;
+#if HAS_THREADS
+    bool in_worker = g_in_worker;
+    g_in_worker = true;
+#endif
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->n)
+        job->f(job->user, i, worker->thread);
+#if HAS_THREADS
+    g_in_worker = in_worker;
+#endif
+    return NULL;
+}
+
+void parallel_for(int n, void (*f)(void *user, int i, int thread),
+                  void *user)
+{
+    job_t job = {f, user, n};
+    worker_t workers[MAX_THREADS];
+    int i, nb_threads;
+
+    atomic_init(&job.next, 0);
+    nb_threads = parallel_get_nb_threads();
+    if (nb_threads > n) nb_threads = n;
+    for (i = 0; i < nb_threads; i++)
+        workers[i] = (worker_t){&job, i};
+
+#if HAS_THREADS
+    pthread_t threads[MAX_THREADS];
+    bool started[MAX_THREADS] = {};
+    if (nb_threads > 1 && !g_in_worker) {
+        // The calling thread also does some of the work, including the
+        // jobs of the threads we failed to create.
+        for (i = 1; i < nb_threads; i++) {
+            started[i] = pthread_create(&threads[i], NULL, worker_func,
+                                        &workers[i]) == 0;
+        }
+        worker_func(&workers[0]);
+        for (i = 1; i < nb_threads; i++) {
+            if (started[i]) pthread_join(threads[i], NULL);
+        }
+        return;
+    }
+#endif
+    if (nb_threads > 0) worker_func(&workers[0]);
+}
@@ -0,0 +1,51 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024-present Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Minimal helper to run independent jobs on all the cpu cores.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/*
+ * Function: parallel_get_nb_threads
+ * Return the number of threads used by parallel_for.
+ */
+int parallel_get_nb_threads(void);
+
+/*
+ * Function: parallel_for
+ * Call a function for each index in [0, n), using all the cpu cores.
+ *
+ * The calls are done in no particular order, and the function returns
+ * once all of them are done.  The function must be thread safe.
+ *
+ * Calls made from inside a job run all their jobs serially in the calling
+ * thread, with a thread index of 0.
+ *
+ * Parameters:
+ *   n    - Number of jobs.
+ *   f    - Function to call, with the user data, the job index, and the
+ *          index of the thread running it (in [0, parallel_get_nb_threads)).
+ *   user - User data passed to the function.
+ */
+void parallel_for(int n, void (*f)(void *user, int i, int thread),
+                  void *user);
+
+#endif // PARALLEL_H
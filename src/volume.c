@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <stdatomic.h>
 
 #define min(a, b) ({ \
       __typeof__ (a) _a = (a); \
@@ -44,7 +45,7 @@ enum {
 typedef struct tile_data tile_data_t;
 struct tile_data
 {
-    int         ref;
+    atomic_int  ref;
     uint64_t    id;
     uint8_t     voxels[TILE_SIZE * TILE_SIZE * TILE_SIZE][4]; // RGBA voxels.
 };
@@ -59,15 +60,21 @@ struct tile
 
 struct volume
 {
-    int ref;
+    atomic_int ref;
     tile_t *tiles;
-    int *tiles_ref;   // Used to implement copy on write of the tiles.
+    atomic_int *tiles_ref; // Used to implement copy on write of the tiles.
     uint64_t key; // Two volumes with the same key have the same value.
 };
 
-static uint64_t g_uid = 2; // Global id counter.
+// The counters and reference counts are atomic, so that independent
+// volumes can be used from several threads even when they share tiles.
+static atomic_uint_fast64_t g_uid = 2; // Global id counter.
 
-static volume_global_stats_t g_global_stats = {};
+static struct {
+    atomic_int              nb_volumes;
+    atomic_int              nb_tiles;
+    atomic_uint_fast64_t    mem;
+} g_global_stats;
 
 #define N TILE_SIZE
 
@@ -132,13 +139,9 @@ static void bbox_intersection(int a[2][3], int b[2][3], int out[2][3])
 
 static tile_data_t *get_empty_data(void)
 {
-    static tile_data_t *data = NULL;
-    if (!data) {
-        data = calloc(1, sizeof(*data));
-        data->ref = 1;
-        data->id = 0;
-    }
-    return data;
+    // Never released, since its reference count starts at one.
+    static tile_data_t data = {.ref = 1, .id = 0};
+    return &data;
 }
 
 static bool tile_is_empty(const tile_t *tile, bool fast)
@@ -166,8 +169,7 @@ static tile_t *tile_new(const int pos[3])
 
 static void tile_delete(tile_t *tile)
 {
-    tile->data->ref--;
-    if (tile->data->ref == 0) {
+    if (--tile->data->ref == 0) {
         free(tile->data);
         g_global_stats.nb_tiles--;
         g_global_stats.mem -= sizeof(*tile->data);
@@ -187,8 +189,7 @@ static tile_t *tile_copy(const tile_t *other)
 
 static void tile_set_data(tile_t *tile, tile_data_t *data)
 {
-    tile->data->ref--;
-    if (tile->data->ref == 0) {
+    if (--tile->data->ref == 0) {
         free(tile->data);
         g_global_stats.nb_tiles--;
         g_global_stats.mem -= sizeof(*tile->data);
@@ -204,11 +205,16 @@ static void tile_prepare_write(tile_t *tile)
         tile->data->id = ++g_uid;
         return;
     }
-    tile->data->ref--;
     tile_data_t *data;
     data = calloc(1, sizeof(*tile->data));
     memcpy(data->voxels, tile->data->voxels, N * N * N * 4);
     data->ref = 1;
+    // The other references might have been released in the meantime.
+    if (--tile->data->ref == 0) {
+        free(tile->data);
+        g_global_stats.nb_tiles--;
+        g_global_stats.mem -= sizeof(*tile->data);
+    }
     tile->data = data;
     tile->data->id = ++g_uid;
 
@@ -288,14 +294,27 @@ bool volume_get_bbox(const volume_t *volume, int bbox[2][3], bool exact)
     return !empty;
 }
 
+static void delete_tiles(tile_t *tiles, atomic_int *tiles_ref)
+{
+    tile_t *tile, *tmp;
+    HASH_ITER(hh, tiles, tile, tmp) {
+        HASH_DEL(tiles, tile);
+        assert(tiles != tile);
+        tile_delete(tile);
+    }
+    free(tiles_ref);
+    g_global_stats.nb_volumes--;
+}
+
 static void volume_prepare_write(volume_t *volume)
 {
     tile_t *tiles, *tile, *new_tile;
+    atomic_int *tiles_ref;
     assert(*volume->tiles_ref > 0);
     volume->key = g_uid++;
     if (*volume->tiles_ref == 1)
         return;
-    (*volume->tiles_ref)--;
+    tiles_ref = volume->tiles_ref;
     volume->tiles_ref = calloc(1, sizeof(*volume->tiles_ref));
     *volume->tiles_ref = 1;
     tiles = volume->tiles;
@@ -306,6 +325,8 @@ static void volume_prepare_write(volume_t *volume)
         HASH_ADD(hh, volume->tiles, pos, sizeof(new_tile->pos), new_tile);
     }
     g_global_stats.nb_volumes++;
+    // The other references might have been released in the meantime.
+    if (--(*tiles_ref) == 0) delete_tiles(tiles, tiles_ref);
 }
 
 static tile_t *volume_add_tile(volume_t *volume, const int pos[3]);
@@ -435,19 +456,10 @@ void volume_clear(volume_t *volume)
 
 void volume_delete(volume_t *volume)
 {
-    tile_t *tile, *tmp;
     if (!volume) return;
     if (--volume->ref > 0) return;
-    (*volume->tiles_ref)--;
-    if (*volume->tiles_ref == 0) {
-        HASH_ITER(hh, volume->tiles, tile, tmp) {
-            HASH_DEL(volume->tiles, tile);
-            assert(volume->tiles != tile);
-            tile_delete(tile);
-        }
-        free(volume->tiles_ref);
-        g_global_stats.nb_volumes--;
-    }
+    if (--(*volume->tiles_ref) == 0)
+        delete_tiles(volume->tiles, volume->tiles_ref);
     free(volume);
 }
 
@@ -467,19 +479,10 @@ volume_t *volume_copy(const volume_t *volume)
 
 void volume_set(volume_t *volume, const volume_t *other)
 {
-    tile_t *tile, *tmp;
     assert(volume && other);
     if (volume->tiles == other->tiles) return; // Already the same.
-    (*volume->tiles_ref)--;
-    if (*volume->tiles_ref == 0) {
-        HASH_ITER(hh, volume->tiles, tile, tmp) {
-            HASH_DEL(volume->tiles, tile);
-            assert(volume->tiles != tile);
-            tile_delete(tile);
-        }
-        free(volume->tiles_ref);
-        g_global_stats.nb_volumes--;
-    }
+    if (--(*volume->tiles_ref) == 0)
+        delete_tiles(volume->tiles, volume->tiles_ref);
     volume->tiles = other->tiles;
     volume->tiles_ref = other->tiles_ref;
     volume->key = other->key;
@@ -728,24 +731,136 @@ void volume_copy_tile(const volume_t *src, const int src_pos[3],
     tile_t *b1, *b2;
     volume_prepare_write(dst);
     b1 = volume_get_tile_at(src, src_pos, NULL);
+    if (!b1) { // Empty source tile.
+        volume_clear_tile(dst, NULL, dst_pos);
+        return;
+    }
     b2 = volume_get_tile_at(dst, dst_pos, NULL);
     if (!b2) b2 = volume_add_tile(dst, dst_pos);
     tile_set_data(b2, b1->data);
 }
 
+// Call f for each tile intersecting a box, with the box of the
+// intersection in the tile coordinates, and its origin in the data.
+static void iter_box_tiles(const int pos[3], const int size[3],
+        void (*f)(void *user, const int tile_pos[3], const int aabb[2][3],
+                  int data_ofs),
+        void *user)
+{
+    int tile_pos[3], aabb[2][3], i;
+    int start[3], end[3];
+
+    for (i = 0; i < 3; i++) {
+        start[i] = pos[i] & ~(int)(N - 1);
+        end[i] = pos[i] + size[i];
+    }
+    for (tile_pos[2] = start[2]; tile_pos[2] < end[2]; tile_pos[2] += N)
+    for (tile_pos[1] = start[1]; tile_pos[1] < end[1]; tile_pos[1] += N)
+    for (tile_pos[0] = start[0]; tile_pos[0] < end[0]; tile_pos[0] += N) {
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = max(pos[i], tile_pos[i]) - tile_pos[i];
+            aabb[1][i] = min(end[i], tile_pos[i] + N) - tile_pos[i];
+        }
+        f(user, tile_pos, aabb,
+          (tile_pos[2] + aabb[0][2] - pos[2]) * size[1] * size[0] +
+          (tile_pos[1] + aabb[0][1] - pos[1]) * size[0] +
+          (tile_pos[0] + aabb[0][0] - pos[0]));
+    }
+}
+
+typedef struct {
+    volume_t *volume;
+    const int *size;
+    uint8_t *data;
+} box_io_t;
+
+static void read_box_tile(void *user, const int tile_pos[3],
+                          const int aabb[2][3], int ofs)
+{
+    box_io_t *io = user;
+    const tile_t *tile;
+    int y, z, len = aabb[1][0] - aabb[0][0];
+    uint8_t *dst;
+
+    tile = volume_get_tile_at(io->volume, tile_pos, NULL);
+    if (!tile) return; // The data is already zero.
+    for (z = aabb[0][2]; z < aabb[1][2]; z++)
+    for (y = aabb[0][1]; y < aabb[1][1]; y++) {
+        dst = io->data + (ofs + (z - aabb[0][2]) * io->size[1] * io->size[0] +
+                          (y - aabb[0][1]) * io->size[0]) * 4;
+        memcpy(dst, TILE_AT(tile, aabb[0][0], y, z), len * 4);
+    }
+}
+
+static void write_box_tile(void *user, const int tile_pos[3],
+                           const int aabb[2][3], int ofs)
+{
+    box_io_t *io = user;
+    tile_t *tile;
+    int x, y, z, len = aabb[1][0] - aabb[0][0];
+    const uint8_t *src;
+    bool empty = true;
+
+    tile = volume_get_tile_at(io->volume, tile_pos, NULL);
+    if (!tile) {
+        // Don't create tiles for empty data.
+        for (z = aabb[0][2]; empty && z < aabb[1][2]; z++)
+        for (y = aabb[0][1]; empty && y < aabb[1][1]; y++) {
+            src = io->data + (ofs +
+                    (z - aabb[0][2]) * io->size[1] * io->size[0] +
+                    (y - aabb[0][1]) * io->size[0]) * 4;
+            for (x = 0; x < len; x++) {
+                if (src[x * 4 + 3]) {
+                    empty = false;
+                    break;
+                }
+            }
+        }
+        if (empty) return;
+        tile = volume_add_tile(io->volume, tile_pos);
+    }
+
+    tile_prepare_write(tile);
+    for (z = aabb[0][2]; z < aabb[1][2]; z++)
+    for (y = aabb[0][1]; y < aabb[1][1]; y++) {
+        src = io->data + (ofs + (z - aabb[0][2]) * io->size[1] * io->size[0] +
+                          (y - aabb[0][1]) * io->size[0]) * 4;
+        memcpy(TILE_AT(tile, aabb[0][0], y, z), src, len * 4);
+    }
+    if (tile_is_empty(tile, false)) {
+        HASH_DEL(io->volume->tiles, tile);
+        tile_delete(tile);
+    }
+}
+
+void volume_write(volume_t *volume, const int pos[3], const int size[3],
+                  const uint8_t *data)
+{
+    box_io_t io = {volume, size, (uint8_t*)data};
+    if (size[0] <= 0 || size[1] <= 0 || size[2] <= 0) return;
+    volume_prepare_write(volume);
+    iter_box_tiles(pos, size, write_box_tile, &io);
+}
+
 void volume_read(const volume_t *volume,
                const int pos[3], const int size[3],
                uint8_t *data)
 {
-    // For the moment we only support the case where we get the rectangle
-    // of a tile plus a one voxel border around it!
-    assert(pos[0] - (pos[0] & ~(int)(N - 1)) == N - 1);
-    assert(pos[1] - (pos[1] & ~(int)(N - 1)) == N - 1);
-    assert(pos[2] - (pos[2] & ~(int)(N - 1)) == N - 1);
-    assert(size[0] == N + 2);
-    assert(size[1] == N + 2);
-    assert(size[2] == N + 2);
+    box_io_t io = {(volume_t*)volume, size, data};
+
+    // General case: copy the box tile by tile.
+    if (    pos[0] - (pos[0] & ~(int)(N - 1)) != N - 1 ||
+            pos[1] - (pos[1] & ~(int)(N - 1)) != N - 1 ||
+            pos[2] - (pos[2] & ~(int)(N - 1)) != N - 1 ||
+            size[0] != N + 2 || size[1] != N + 2 || size[2] != N + 2) {
+        if (size[0] <= 0 || size[1] <= 0 || size[2] <= 0) return;
+        memset(data, 0, (size_t)size[0] * size[1] * size[2] * 4);
+        iter_box_tiles(pos, size, read_box_tile, &io);
+        return;
+    }
 
+    // Optimized case for the rectangle of a tile plus a one voxel border
+    // around it, used by the mesh generation.
     tile_t *tile;
     int tile_pos[3] = {pos[0] + 1, pos[1] + 1, pos[2] + 1};
     int i, z, y, x, dx, dy, dz, p[3];
@@ -826,5 +941,7 @@ int volume_get_tiles_count(const volume_t *volume)
 
 void volume_get_global_stats(volume_global_stats_t *stats)
 {
-    *stats = g_global_stats;
+    stats->nb_volumes = g_global_stats.nb_volumes;
+    stats->nb_tiles = g_global_stats.nb_tiles;
+    stats->mem = g_global_stats.mem;
 }
@@ -224,10 +224,36 @@ void *volume_get_tile_data(const volume_t *volume, volume_accessor_t *accessor,
 void volume_copy_tile(const volume_t *src, const int src_pos[3],
                       volume_t *dst, const int dst_pos[3]);
 
+/*
+ * Function: volume_read
+ * Read a box of voxels from a volume.
+ *
+ * Parameters:
+ *   volume - The volume we read from.
+ *   pos    - Position of the box first corner.
+ *   size   - Size of the box.
+ *   data   - Output RGBA values in xyz order (x changing the fastest).
+ */
 void volume_read(const volume_t *volume,
                  const int pos[3], const int size[3],
                  uint8_t *data);
 
+/*
+ * Function: volume_write
+ * Write a box of voxels into a volume.
+ *
+ * This copies the data directly tile by tile, so it is much faster than
+ * setting the voxels one by one.  Tiles that end up empty are removed.
+ *
+ * Parameters:
+ *   volume - The volume we write into.
+ *   pos    - Position of the box first corner.
+ *   size   - Size of the box.
+ *   data   - RGBA values in xyz order (x changing the fastest).
+ */
+void volume_write(volume_t *volume, const int pos[3], const int size[3],
+                  const uint8_t *data);
+
 int volume_get_tiles_count(const volume_t *volume);
 
 typedef struct {
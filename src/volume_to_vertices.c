@@ -368,7 +368,13 @@ static void fill_mesh(volume_mesh_t *mesh,
     mesh->vertices_count += nb * size;
 }
 
-static void optimize_mesh(volume_mesh_t *mesh, float simplify)
+/*
+ * Merge the duplicated vertices and simplify a mesh.  If lock_border is
+ * set, the vertices on the open borders of the mesh are not moved, so that
+ * meshes of neighbor tiles simplified separately still join.
+ */
+static void optimize_mesh(volume_mesh_t *mesh, float simplify,
+                          bool lock_border)
 {
     unsigned int *remap;
     unsigned int *tmp_indices;
@@ -406,7 +412,7 @@ static void optimize_mesh(volume_mesh_t *mesh, float simplify)
                 tmp_indices, mesh->indices, mesh->indices_count,
                 (const float*)mesh->vertices, mesh->vertices_count,
                 sizeof(*mesh->vertices), target_index_count, target_error,
-                0, NULL);
+                lock_border ? meshopt_SimplifyLockBorder : 0, NULL);
         vertices_count = meshopt_optimizeVertexFetch(
                 tmp_vertices, tmp_indices, indices_count,
                 mesh->vertices, mesh->vertices_count, sizeof(*mesh->vertices));
@@ -420,9 +426,11 @@ static void optimize_mesh(volume_mesh_t *mesh, float simplify)
     free(tmp_indices);
 }
 
-volume_mesh_t *volume_generate_mesh(
+// Generate the mesh of a list of tiles, or of all the volume tiles if tiles
+// is NULL.
+static volume_mesh_t *generate_mesh(
         const volume_t *volume, int effects, const palette_t *palette,
-        float simplify)
+        float simplify, const int (*tiles)[3], int nb_tiles)
 {
     volume_iterator_t iter;
     int bpos[3];
@@ -433,7 +441,8 @@ volume_mesh_t *volume_generate_mesh(
     verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
     iter = volume_get_iterator(volume,
             VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
-    while (volume_iter(&iter, bpos)) {
+    for (i = 0; tiles ? i < nb_tiles : volume_iter(&iter, bpos); i++) {
+        if (tiles) memcpy(bpos, tiles[i], sizeof(bpos));
         nb = volume_generate_vertices(volume, bpos, effects, verts,
                                       &size, &subdivide);
         if (nb == 0) continue;
@@ -441,7 +450,9 @@ volume_mesh_t *volume_generate_mesh(
     }
     free(verts);
 
-    optimize_mesh(mesh, simplify);
+    // A list of tiles usually doesn't cover the whole volume, so its mesh
+    // has borders shared with other meshes.
+    optimize_mesh(mesh, simplify, tiles != NULL);
 
     mesh->pos_min[0] = +FLT_MAX;
     mesh->pos_min[1] = +FLT_MAX;
@@ -461,6 +472,20 @@ volume_mesh_t *volume_generate_mesh(
     return mesh;
 }
 
+volume_mesh_t *volume_generate_mesh(
+        const volume_t *volume, int effects, const palette_t *palette,
+        float simplify)
+{
+    return generate_mesh(volume, effects, palette, simplify, NULL, 0);
+}
+
+volume_mesh_t *volume_generate_tiles_mesh(
+        const volume_t *volume, int effects, const palette_t *palette,
+        float simplify, const int (*tiles)[3], int nb)
+{
+    return generate_mesh(volume, effects, palette, simplify, tiles, nb);
+}
+
 void volume_mesh_free(volume_mesh_t *mesh)
 {
     free(mesh->vertices);
@@ -20,9 +20,14 @@
 #include "xxhash.h"
 
 #include <limits.h>
+#include <pthread.h>
 
 #define N TILE_SIZE
 
+// Protects the operation caches, since independent volumes can be edited
+// from several threads.  Only held while accessing the caches.
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 // Used for the cache.
 static int volume_del(void *data_)
 {
@@ -41,8 +46,8 @@ int volume_select(const volume_t *volume,
 {
     int i, a;
     int pos[3], p[3];
-    bool keep = true;
-    volume_iterator_t iter;
+    int (*stack)[3] = NULL;
+    int stack_size = 0, stack_capacity = 0;
     volume_accessor_t volume_accessor, selection_accessor;
     volume_clear(selection);
 
@@ -54,84 +59,88 @@ int volume_select(const volume_t *volume,
     volume_set_at(selection, &selection_accessor, start_pos,
                 (uint8_t[]){255, 255, 255, 255});
 
-    // XXX: Very inefficient algorithm!
-    // Iter and test all the neighbors of the selection until there is
-    // no more possible changes.
-    while (keep) {
-        keep = false;
-        iter = volume_get_iterator(selection, VOLUME_ITER_VOXELS);
-        while (volume_iter(&iter, pos)) {
-            // Shouldn't be needed if the iter function did filter the voxels.
-            if (!volume_get_alpha_at(selection, &selection_accessor, pos))
-                continue;
-
-            for (i = 0; i < 6; i++) {
-                p[0] = pos[0] + FACES_NORMALS[i][0];
-                p[1] = pos[1] + FACES_NORMALS[i][1];
-                p[2] = pos[2] + FACES_NORMALS[i][2];
-                if (volume_get_alpha_at(selection, &selection_accessor, p))
-                    continue; // Already done.
-                if (!volume_get_alpha_at(volume, &volume_accessor, p))
-                    continue; // No voxel here.
-                a = cond(user, volume, pos, p, &volume_accessor);
-                if (a) {
-                    volume_set_at(selection, &selection_accessor, p,
-                                (uint8_t[]){255, 255, 255, a});
-                    keep = true;
-                }
+    // Flood fill: each selected voxel is pushed once into the stack, and
+    // then tests its six neighbors.
+    stack_capacity = 1024;
+    stack = malloc(stack_capacity * sizeof(*stack));
+    memcpy(stack[stack_size++], start_pos, sizeof(*stack));
+    while (stack_size) {
+        memcpy(pos, stack[--stack_size], sizeof(pos));
+        for (i = 0; i < 6; i++) {
+            p[0] = pos[0] + FACES_NORMALS[i][0];
+            p[1] = pos[1] + FACES_NORMALS[i][1];
+            p[2] = pos[2] + FACES_NORMALS[i][2];
+            if (volume_get_alpha_at(selection, &selection_accessor, p))
+                continue; // Already done.
+            if (!volume_get_alpha_at(volume, &volume_accessor, p))
+                continue; // No voxel here.
+            a = cond(user, volume, pos, p, &volume_accessor);
+            if (!a) continue;
+            volume_set_at(selection, &selection_accessor, p,
+                          (uint8_t[]){255, 255, 255, a});
+            if (stack_size == stack_capacity) {
+                stack_capacity *= 2;
+                stack = realloc(stack, stack_capacity * sizeof(*stack));
             }
+            memcpy(stack[stack_size++], p, sizeof(p));
         }
     }
+    free(stack);
     return 0;
 }
 
 
-// XXX: need to redo this function from scratch.  Even the API is a bit
-// stupid.
-void volume_extrude(volume_t *volume,
-                  const float plane[4][4],
-                  const float box[4][4])
+void volume_extrude(volume_t *volume, const volume_t *layer, int face,
+                    int from, int to)
 {
-    float proj[4][4];
-    float n[3], pos[3], p[3];
-    volume_iterator_t iter;
-    int vpos[3];
-    uint8_t value[4];
+    int i, x, y, z, ax, dir, start, end, c, q[3];
+    int bbox[2][3], layer_size[3], pos[3], size[3];
+    uint8_t *layer_data, *data;
 
-    vec3_normalize(plane[2], n);
-    vec3_copy(plane[3], pos);
+    volume_clear(volume);
+    if (from > to || !volume_get_bbox(layer, bbox, true)) return;
+    for (ax = 0; ax < 3; ax++) {
+        if (FACES_NORMALS[face][ax]) break;
+    }
+    dir = FACES_NORMALS[face][ax];
+    // If the layer is thicker than one voxel, only sweep its outer slice.
+    if (dir > 0) bbox[0][ax] = bbox[1][ax] - 1;
+    else bbox[1][ax] = bbox[0][ax] + 1;
 
-    // Generate the projection into the plane.
-    // XXX: *very* ugly code, fix this!
-    mat4_set_identity(proj);
+    // Extract the layer values once.
+    for (i = 0; i < 3; i++) layer_size[i] = bbox[1][i] - bbox[0][i];
+    layer_data = malloc(layer_size[0] * layer_size[1] * layer_size[2] * 4);
+    volume_read(layer, bbox[0], layer_size, layer_data);
 
-    if (fabs(plane[2][0]) > 0.1) {
-        proj[0][0] = 0;
-        proj[3][0] = pos[0];
-    }
-    if (fabs(plane[2][1]) > 0.1) {
-        proj[1][1] = 0;
-        proj[3][1] = pos[1];
-    }
-    if (fabs(plane[2][2]) > 0.1) {
-        proj[2][2] = 0;
-        proj[3][2] = pos[2];
-    }
+    // Range of coordinates covered along the axis.
+    start = bbox[0][ax] + min(from * dir, to * dir);
+    end = bbox[0][ax] + max(from * dir, to * dir) + 1;
 
-    // XXX: use an accessor to speed up access.
-    iter = volume_get_box_iterator(volume, box, 0);
-    while (volume_iter(&iter, vpos)) {
-        vec3_set(p, vpos[0], vpos[1], vpos[2]);
-        if (!bbox_contains_vec(box, p)) {
-            memset(value, 0, 4);
-        } else {
-            mat4_mul_vec3(proj, p, p);
-            int pi[3] = {floor(p[0]), floor(p[1]), floor(p[2])};
-            volume_get_at(volume, NULL, pi, value);
+    // Write the layer copies by slabs of at most one tile thickness, aligned
+    // to the tiles, so that each tile is only written once.
+    memcpy(size, layer_size, sizeof(size));
+    size[ax] = N;
+    data = malloc(size[0] * size[1] * size[2] * 4);
+    for (c = start; c < end; c = pos[ax] + size[ax]) {
+        memcpy(pos, bbox[0], sizeof(pos));
+        pos[ax] = c;
+        size[ax] = min(end, (int)floor((float)c / N) * N + N) - c;
+        i = 0;
+        for (z = 0; z < size[2]; z++)
+        for (y = 0; y < size[1]; y++)
+        for (x = 0; x < size[0]; x++, i++) {
+            q[0] = x;
+            q[1] = y;
+            q[2] = z;
+            q[ax] = 0;
+            memcpy(data + i * 4, layer_data +
+                   ((q[2] * layer_size[1] + q[1]) * layer_size[0] + q[0]) * 4,
+                   4);
         }
-        volume_set_at(volume, NULL, vpos, value);
+        volume_write(volume, pos, size, data);
     }
-
+    free(data);
+    free(layer_data);
 }
 
 static void volume_fill(
@@ -164,15 +173,125 @@ static void volume_move_get_color(const int pos[3], uint8_t c[4], void *user)
     volume_get_at(volume, NULL, pi, c);
 }
 
+/*
+ * Check if a transformation maps voxels exactly to voxels, that is an axis
+ * permutation with optional flips followed by an integer translation.
+ * If so, output axis i gets sign[i] * source axis perm[i] + ofs[i].
+ */
+static bool get_rigid_transf(const float mat[4][4],
+                             int perm[3], int sign[3], int ofs[3])
+{
+    int i, j, used = 0;
+    const float e = 1e-5;
+
+    if (fabs(mat[3][3] - 1) > e) return false;
+    for (i = 0; i < 3; i++) {
+        if (fabs(mat[i][3]) > e) return false;
+        perm[i] = -1;
+        for (j = 0; j < 3; j++) {
+            if (fabs(mat[j][i]) < e) continue;
+            if (perm[i] != -1 || fabs(fabs(mat[j][i]) - 1) > e) return false;
+            perm[i] = j;
+            sign[i] = mat[j][i] > 0 ? 1 : -1;
+        }
+        if (perm[i] == -1 || (used & (1 << perm[i]))) return false;
+        used |= 1 << perm[i];
+        ofs[i] = round(mat[3][i]);
+        if (fabs(mat[3][i] - ofs[i]) > 1e-4) return false;
+    }
+    return true;
+}
+
+/*
+ * Fast path of volume_move for rigid transformations.  Tile aligned
+ * translations only rekey the tiles (sharing their data), otherwise each
+ * tile is read once, permuted, and written at its new position.
+ */
+static void volume_move_rigid(volume_t *volume, const int perm[3],
+                              const int sign[3], const int ofs[3])
+{
+    volume_t *src;
+    volume_iterator_t iter;
+    int i, x, y, z, pos[3], dpos[3], stride[3], base = 0;
+    const int size[3] = {N, N, N};
+    bool aligned = true, identity = true;
+    uint8_t (*sdata)[4], (*ddata)[4];
+
+    for (i = 0; i < 3; i++) {
+        if (perm[i] != i || sign[i] != 1) identity = false;
+        if (ofs[i] % N) aligned = false;
+        // Stride in the destination tile for the source axis perm[i].
+        stride[perm[i]] = sign[i] * (i == 0 ? 1 : i == 1 ? N : N * N);
+        if (sign[i] < 0) base -= (N - 1) * stride[perm[i]];
+    }
+
+    src = volume_copy(volume);
+    volume_clear(volume);
+    sdata = malloc(N * N * N * 4);
+    ddata = identity ? sdata : malloc(N * N * N * 4);
+
+    iter = volume_get_iterator(src, VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        if (identity && aligned) {
+            for (i = 0; i < 3; i++) dpos[i] = pos[i] + ofs[i];
+            volume_copy_tile(src, pos, volume, dpos);
+            continue;
+        }
+        for (i = 0; i < 3; i++) {
+            dpos[i] = ofs[i] + (sign[i] > 0 ? pos[perm[i]] :
+                                              -(pos[perm[i]] + N - 1));
+        }
+        volume_read(src, pos, size, (uint8_t*)sdata);
+        if (!identity) {
+            for (z = 0; z < N; z++)
+            for (y = 0; y < N; y++)
+            for (x = 0; x < N; x++) {
+                memcpy(ddata[base + x * stride[0] + y * stride[1] +
+                             z * stride[2]],
+                       sdata[(z * N + y) * N + x], 4);
+            }
+        }
+        volume_write(volume, dpos, size, (uint8_t*)ddata);
+    }
+
+    if (ddata != sdata) free(ddata);
+    free(sdata);
+    volume_delete(src);
+}
+
+bool volume_move_is_rigid(const float mat[4][4], float geo_mat[4][4])
+{
+    int i, perm[3], sign[3], ofs[3];
+
+    if (!get_rigid_transf(mat, perm, sign, ofs)) return false;
+    if (!geo_mat) return true;
+    // A flipped voxel x ends up at -x + ofs, so its geometry [x, x + 1]
+    // ends up at [-x + ofs, -x + ofs + 1].
+    mat4_set_identity(geo_mat);
+    for (i = 0; i < 3; i++) {
+        geo_mat[i][i] = 0;
+        geo_mat[perm[i]][i] = sign[i];
+        geo_mat[3][i] = ofs[i] + (sign[i] < 0 ? 1 : 0);
+    }
+    return true;
+}
+
 void volume_move(volume_t *volume, const float mat[4][4])
 {
     float box[4][4];
-    volume_t *src_volume = volume_copy(volume);
+    volume_t *src_volume;
     float imat[4][4];
+    int perm[3], sign[3], ofs[3];
+
+    if (get_rigid_transf(mat, perm, sign, ofs)) {
+        volume_move_rigid(volume, perm, sign, ofs);
+        return;
+    }
 
     mat4_invert(mat, imat);
     volume_get_box(volume, true, box);
     if (box_is_null(box)) return;
+    src_volume = volume_copy(volume);
     mat4_mul(mat, box, box);
     volume_fill(volume, box, volume_move_get_color,
                 USER_PASS(src_volume, &imat));
@@ -181,19 +300,9 @@ void volume_move(volume_t *volume, const float mat[4][4])
 }
 
 void volume_blit(volume_t *volume, const uint8_t *data,
-               int x, int y, int z, int w, int h, int d,
-               volume_iterator_t *iter)
+               int x, int y, int z, int w, int h, int d)
 {
-    volume_iterator_t default_iter = {0};
-    int pos[3];
-    if (!iter) iter = &default_iter;
-    for (pos[2] = z; pos[2] < z + d; pos[2]++)
-    for (pos[1] = y; pos[1] < y + h; pos[1]++)
-    for (pos[0] = x; pos[0] < x + w; pos[0]++) {
-        volume_set_at(volume, iter, pos, data);
-        data += 4;
-    }
-    volume_remove_empty_tiles(volume, false);
+    volume_write(volume, (int[]){x, y, z}, (int[]){w, h, d}, data);
 }
 
 void volume_shift_alpha(volume_t *volume, int v)
@@ -295,7 +404,6 @@ void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4]
     const float *sym_o = painter->symmetry_origin;
 
     // Check if the operation has been cached.
-    if (!cache) cache = cache_create("volume_op", 32);
     struct {
         uint64_t  id;
         float     box[4][4];
@@ -305,11 +413,12 @@ void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4]
     key.id = volume_get_key(volume);
     mat4_copy(box, key.box);
     key.painter = *painter;
+    pthread_mutex_lock(&g_cache_lock);
+    if (!cache) cache = cache_create("volume_op", 32);
     cached = cache_get(cache, &key, sizeof(key));
-    if (cached) {
-        volume_set(volume, cached);
-        return;
-    }
+    if (cached) volume_set(volume, cached);
+    pthread_mutex_unlock(&g_cache_lock);
+    if (cached) return;
 
     if (painter->symmetry) {
         painter2 = *painter;
@@ -382,7 +491,9 @@ void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4]
             volume_set_at(volume, &accessor, vp, new_value);
     }
 
+    pthread_mutex_lock(&g_cache_lock);
     cache_add(cache, &key, sizeof(key), volume_copy(volume), 1, volume_del);
+    pthread_mutex_unlock(&g_cache_lock);
 }
 
 // XXX: remove this function!
@@ -393,16 +504,15 @@ void volume_get_box(const volume_t *volume, bool exact, float box[4][4])
     bbox_from_aabb(box, bbox);
 }
 
-static void tile_merge(volume_t *volume, const volume_t *other, const int pos[3],
-                        int mode, const uint8_t color[4])
+void volume_merge_tile(volume_t *volume, const volume_t *other,
+                       const int pos[3], int mode, const uint8_t color[4])
 {
-    int p[3];
-    int x, y, z;
+    int i;
     uint64_t id1, id2;
     volume_t *tile;
-    uint8_t v1[4], v2[4];
+    uint8_t v1[N * N * N][4], v2[N * N * N][4];
     static cache_t *cache = NULL;
-    volume_accessor_t a1, a2, a3;
+    const int size[3] = {N, N, N};
 
     volume_get_tile_data(volume,  NULL, pos, &id1);
     volume_get_tile_data(other, NULL, pos, &id2);
@@ -428,7 +538,6 @@ static void tile_merge(volume_t *volume, const volume_t *other, const int pos[3]
     }
 
     // Check if the merge op has been cached.
-    if (!cache) cache = cache_create("tile_merge", 2048);
     struct {
         uint64_t id1;
         uint64_t id2;
@@ -437,31 +546,26 @@ static void tile_merge(volume_t *volume, const volume_t *other, const int pos[3]
     } key = { id1, id2, mode };
     if (color) memcpy(key.color, color, 4);
     _Static_assert(sizeof(key) == 24, "");
+    pthread_mutex_lock(&g_cache_lock);
+    if (!cache) cache = cache_create("tile_merge", 2048);
     tile = cache_get(cache, &key, sizeof(key));
-    if (tile) goto end;
+    if (tile) volume_copy_tile(tile, (int[]){0, 0, 0}, volume, pos);
+    pthread_mutex_unlock(&g_cache_lock);
+    if (tile) return;
 
+    // Work on the whole tiles data at once.
     tile = volume_new();
-    a1 = volume_get_accessor(volume);
-    a2 = volume_get_accessor(other);
-    a3 = volume_get_accessor(tile);
-
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        volume_get_at(volume, &a1, p, v1);
-        volume_get_at(other, &a2, p, v2);
-        if (color) color_mul(v2, color, v2);
-        combine(v1, v2, mode, v1);
-        volume_set_at(tile, &a3, (int[]){x, y, z}, v1);
+    volume_read(volume, pos, size, (uint8_t*)v1);
+    volume_read(other, pos, size, (uint8_t*)v2);
+    for (i = 0; i < N * N * N; i++) {
+        if (color) color_mul(v2[i], color, v2[i]);
+        combine(v1[i], v2[i], mode, v1[i]);
     }
-    cache_add(cache, &key, sizeof(key), tile, 1, volume_del);
-
-end:
+    volume_write(tile, (int[]){0, 0, 0}, size, (uint8_t*)v1);
     volume_copy_tile(tile, (int[]){0, 0, 0}, volume, pos);
-    return;
+    pthread_mutex_lock(&g_cache_lock);
+    cache_add(cache, &key, sizeof(key), tile, 1, volume_del);
+    pthread_mutex_unlock(&g_cache_lock);
 }
 
 void volume_merge(volume_t *volume, const volume_t *other, int mode,
@@ -481,7 +585,6 @@ void volume_merge(volume_t *volume, const volume_t *other, int mode,
     }
 
     // Check if the merge op has been cached.
-    if (!cache) cache = cache_create("volume_merge", 512);
     id1 = volume_get_key(volume);
     id2 = volume_get_key(other);
     struct {
@@ -492,18 +595,165 @@ void volume_merge(volume_t *volume, const volume_t *other, int mode,
     } key = { id1, id2, mode };
     if (color) memcpy(key.color, color, 4);
     _Static_assert(sizeof(key) == 24, "");
+    pthread_mutex_lock(&g_cache_lock);
+    if (!cache) cache = cache_create("volume_merge", 512);
     cached = cache_get(cache, &key, sizeof(key));
-    if (cached) {
-        volume_set(volume, cached);
-        return;
-    }
+    if (cached) volume_set(volume, cached);
+    pthread_mutex_unlock(&g_cache_lock);
+    if (cached) return;
 
     iter = volume_get_union_iterator(volume, other, VOLUME_ITER_TILES);
     while (volume_iter(&iter, bpos)) {
-        tile_merge(volume, other, bpos, mode, color);
+        volume_merge_tile(volume, other, bpos, mode, color);
     }
 
+    pthread_mutex_lock(&g_cache_lock);
     cache_add(cache, &key, sizeof(key), volume_copy(volume), 1, volume_del);
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+void volume_clear_aabb(volume_t *volume, const int aabb[2][3])
+{
+    volume_iterator_t iter;
+    int i, j, nb = 0, pos[3], clip[2][3], size[3];
+    int (*tiles)[3] = NULL;
+    bool full;
+    uint8_t *zeros = NULL;
+
+    // Collect the tiles first, since clearing them can delete them.
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        if (    pos[0] + N <= aabb[0][0] || pos[0] >= aabb[1][0] ||
+                pos[1] + N <= aabb[0][1] || pos[1] >= aabb[1][1] ||
+                pos[2] + N <= aabb[0][2] || pos[2] >= aabb[1][2])
+            continue;
+        tiles = realloc(tiles, (nb + 1) * sizeof(*tiles));
+        memcpy(tiles[nb++], pos, sizeof(pos));
+    }
+
+    for (j = 0; j < nb; j++) {
+        full = true;
+        for (i = 0; i < 3; i++) {
+            clip[0][i] = max(tiles[j][i], aabb[0][i]);
+            clip[1][i] = min(tiles[j][i] + N, aabb[1][i]);
+            size[i] = clip[1][i] - clip[0][i];
+            if (size[i] != N) full = false;
+        }
+        if (full) {
+            volume_clear_tile(volume, NULL, tiles[j]);
+            continue;
+        }
+        if (!zeros) zeros = calloc(N * N * N, 4);
+        volume_write(volume, clip[0], size, zeros);
+    }
+    free(zeros);
+    free(tiles);
+}
+
+// Flip a block of voxels in place along an axis.
+static void flip_block(uint8_t (*data)[4], const int size[3], int axis)
+{
+    int i, x, y, z, p[3], q[3];
+    uint8_t tmp[4];
+    int n = size[axis];
+
+    for (z = 0; z < size[2]; z++)
+    for (y = 0; y < size[1]; y++)
+    for (x = 0; x < size[0]; x++) {
+        p[0] = x; p[1] = y; p[2] = z;
+        if (p[axis] >= n / 2) continue;
+        memcpy(q, p, sizeof(p));
+        q[axis] = n - 1 - p[axis];
+        i = (q[2] * size[1] + q[1]) * size[0] + q[0];
+        memcpy(tmp, data[i], 4);
+        memcpy(data[i], data[(z * size[1] + y) * size[0] + x], 4);
+        memcpy(data[(z * size[1] + y) * size[0] + x], tmp, 4);
+    }
+}
+
+void volume_mirror(volume_t *volume, int axis, const int aabb[2][3])
+{
+    volume_t *src;
+    volume_iterator_t iter;
+    int i, pos[3], clip[2][3], size[3], dst[3];
+    uint8_t (*buffer)[4];
+
+    if (aabb[1][axis] - aabb[0][axis] <= 1) {
+        return;
+    }
+
+    src = volume_copy(volume);
+    volume_clear_aabb(volume, aabb);
+    buffer = malloc(N * N * N * 4);
+
+    iter = volume_get_iterator(src, VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        for (i = 0; i < 3; i++) {
+            clip[0][i] = max(pos[i], aabb[0][i]);
+            clip[1][i] = min(pos[i] + N, aabb[1][i]);
+            size[i] = clip[1][i] - clip[0][i];
+            dst[i] = clip[0][i];
+        }
+        if (size[0] <= 0 || size[1] <= 0 || size[2] <= 0) continue;
+        dst[axis] = aabb[0][axis] + aabb[1][axis] - clip[1][axis];
+        volume_read(src, clip[0], size, (uint8_t*)buffer);
+        flip_block(buffer, size, axis);
+        volume_write(volume, dst, size, (uint8_t*)buffer);
+    }
+
+    free(buffer);
+    volume_delete(src);
+}
+
+void volume_wrap(volume_t *volume, int axis, int sign, const int aabb[2][3])
+{
+    volume_t *src;
+    volume_iterator_t iter;
+    int i, k, pos[3], clip[2][3], part[2][3], size[3], dst[3], split;
+    int n = aabb[1][axis] - aabb[0][axis];
+    uint8_t *buffer;
+
+    if (n <= 1) {
+        return;
+    }
+
+    src = volume_copy(volume);
+    volume_clear_aabb(volume, aabb);
+    buffer = malloc(N * N * N * 4);
+    // Voxels at or after this coordinate along the axis wrap to the start
+    // (sign > 0), or the ones before it wrap to the end (sign < 0).
+    split = sign > 0 ? aabb[1][axis] - sign : aabb[0][axis] - sign;
+
+    iter = volume_get_iterator(src, VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        for (i = 0; i < 3; i++) {
+            clip[0][i] = max(pos[i], aabb[0][i]);
+            clip[1][i] = min(pos[i] + N, aabb[1][i]);
+        }
+        if (    clip[1][0] <= clip[0][0] || clip[1][1] <= clip[0][1] ||
+                clip[1][2] <= clip[0][2])
+            continue;
+
+        // Split the clipped tile in the parts before and after split.
+        for (k = 0; k < 2; k++) {
+            memcpy(part, clip, sizeof(part));
+            if (k == 0) part[1][axis] = min(part[1][axis], split);
+            else part[0][axis] = max(part[0][axis], split);
+            if (part[1][axis] <= part[0][axis]) continue;
+            for (i = 0; i < 3; i++) {
+                size[i] = part[1][i] - part[0][i];
+                dst[i] = part[0][i];
+            }
+            dst[axis] += sign;
+            if (dst[axis] < aabb[0][axis]) dst[axis] += n;
+            if (dst[axis] >= aabb[1][axis]) dst[axis] -= n;
+            volume_read(src, part[0], size, buffer);
+            volume_write(volume, dst, size, buffer);
+        }
+    }
+
+    free(buffer);
+    volume_delete(src);
 }
 
 void volume_crop(volume_t *volume, const float box[4][4])
@@ -516,6 +766,1124 @@ void volume_crop(volume_t *volume, const float box[4][4])
     volume_op(volume, &painter, box);
 }
 
+/*
+ * Morphology operations.
+ *
+ * Each pass computes the new tiles independently in parallel, reading the
+ * tile plus a border of the size of the structuring element from a
+ * snapshot of the volume, then writes them back into the volume.
+ *
+ * A sphere erosion only keeps the voxels with no empty voxel closer than
+ * the radius + 0.5, so in that case we threshold the cached signed distance
+ * field instead of testing all the offsets.
+ */
+
+static void sdf_get_tiles(const volume_t *volume, int nb,
+                          const int (*tiles)[3], float max_dist,
+                          float (*fields)[N * N * N]);
+
+typedef struct {
+    const volume_t *src;
+    bool dilate;
+    int radius;
+    int nb_offsets;
+    int (*offsets)[3];      // Sorted by distance.
+    int (*tiles)[3];
+    uint8_t (*out)[N * N * N][4];
+    uint8_t (**buffers)[4];  // One extended tile buffer per thread.
+    float (*sdf)[N * N * N]; // Tiles fields for the sphere erosion.
+} morpho_t;
+
+static int offset_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    return (a[0] * a[0] + a[1] * a[1] + a[2] * a[2]) -
+           (b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+}
+
+static int tile_pos_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(int[3]));
+}
+
+// Compute all the offsets of a structuring element, except the center.
+static int get_morpho_offsets(const shape_t *shape, int r,
+                              int (**out)[3])
+{
+    int x, y, z, nb = 0;
+    const float s = r + 0.5;
+    *out = calloc((2 * r + 1) * (2 * r + 1) * (2 * r + 1), sizeof(**out));
+    for (z = -r; z <= r; z++)
+    for (y = -r; y <= r; y++)
+    for (x = -r; x <= r; x++) {
+        if (x == 0 && y == 0 && z == 0) continue;
+        if (shape->func((float[]){x, y, z}, (float[]){s, s, s}, 0) <= 0)
+            continue;
+        memcpy((*out)[nb++], (int[]){x, y, z}, sizeof(int[3]));
+    }
+    qsort(*out, nb, sizeof(**out), offset_cmp);
+    return nb;
+}
+
+static void morpho_tile(void *user, int i, int thread)
+{
+    morpho_t *m = user;
+    const int r = m->radius, s = N + 2 * r;
+    uint8_t (*buf)[4] = m->buffers[thread];
+    uint8_t (*out)[4] = m->out[i];
+    const uint8_t *v, *w;
+    int x, y, z, j, pos[3];
+    const int (*o)[3];
+
+    if (m->sdf) {
+        volume_read(m->src, m->tiles[i], (int[]){N, N, N}, (uint8_t*)out);
+        for (j = 0; j < N * N * N; j++) {
+            if (m->sdf[i][j] > -r) memset(out[j], 0, 4);
+        }
+        return;
+    }
+
+    pos[0] = m->tiles[i][0] - r;
+    pos[1] = m->tiles[i][1] - r;
+    pos[2] = m->tiles[i][2] - r;
+    volume_read(m->src, pos, (int[]){s, s, s}, (uint8_t*)buf);
+
+    #define BUF_AT(x, y, z) (buf[((z) + r) * s * s + ((y) + r) * s + (x) + r])
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        v = BUF_AT(x, y, z);
+        if (m->dilate && !v[3]) {
+            // Take the color of the closest solid neighbor.
+            for (j = 0, o = m->offsets; j < m->nb_offsets; j++, o++) {
+                w = BUF_AT(x + (*o)[0], y + (*o)[1], z + (*o)[2]);
+                if (w[3]) {
+                    v = w;
+                    break;
+                }
+            }
+        }
+        if (!m->dilate && v[3]) {
+            for (j = 0, o = m->offsets; j < m->nb_offsets; j++, o++) {
+                w = BUF_AT(x + (*o)[0], y + (*o)[1], z + (*o)[2]);
+                if (!w[3]) {
+                    v = w;
+                    break;
+                }
+            }
+        }
+        memcpy(out[z * N * N + y * N + x], v, 4);
+    }
+    #undef BUF_AT
+}
+
+static void morpho_pass(volume_t *volume, bool dilate, const shape_t *shape,
+                        int radius)
+{
+    const int batch_size = 256;
+    morpho_t m = {.dilate = dilate, .radius = radius};
+    volume_iterator_t iter;
+    int i, j, nb = 0, pos[3], d[3], nb_threads, batch;
+    const int s = N + 2 * radius;
+    // The fields max distance is at most N - 0.5.
+    const bool use_sdf = !dilate && shape == &shape_sphere && radius < N;
+
+    m.src = volume_copy(volume);
+    if (!use_sdf)
+        m.nb_offsets = get_morpho_offsets(shape, radius, &m.offsets);
+
+    // Get all the tiles that can change.  The radius is never bigger than
+    // a tile, so the dilatation can only reach the direct neighbors.
+    iter = volume_get_iterator(m.src,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        m.tiles = realloc(m.tiles, (nb + 27) * sizeof(*m.tiles));
+        if (!dilate) {
+            memcpy(m.tiles[nb++], pos, sizeof(pos));
+            continue;
+        }
+        for (d[2] = -1; d[2] <= 1; d[2]++)
+        for (d[1] = -1; d[1] <= 1; d[1]++)
+        for (d[0] = -1; d[0] <= 1; d[0]++) {
+            for (i = 0; i < 3; i++) m.tiles[nb][i] = pos[i] + d[i] * N;
+            nb++;
+        }
+    }
+    if (dilate && nb) {
+        qsort(m.tiles, nb, sizeof(*m.tiles), tile_pos_cmp);
+        for (i = 1, j = 1; i < nb; i++) {
+            if (tile_pos_cmp(m.tiles[i], m.tiles[j - 1]) == 0) continue;
+            memcpy(m.tiles[j++], m.tiles[i], sizeof(*m.tiles));
+        }
+        nb = j;
+    }
+
+    nb_threads = parallel_get_nb_threads();
+    m.buffers = calloc(nb_threads, sizeof(*m.buffers));
+    for (i = 0; i < nb_threads && !use_sdf; i++)
+        m.buffers[i] = malloc(s * s * s * 4);
+    if (use_sdf) m.sdf = malloc(min(nb, batch_size) * sizeof(*m.sdf));
+    m.out = malloc(min(nb, batch_size) * sizeof(*m.out));
+    for (batch = 0; batch < nb; batch += batch_size) {
+        morpho_t bm = m;
+        bm.tiles = m.tiles + batch;
+        if (use_sdf) {
+            sdf_get_tiles(m.src, min(nb - batch, batch_size),
+                          (const int (*)[3])bm.tiles, radius, m.sdf);
+        }
+        parallel_for(min(nb - batch, batch_size), morpho_tile, &bm);
+        for (i = 0; i < min(nb - batch, batch_size); i++) {
+            volume_write(volume, bm.tiles[i], (int[]){N, N, N},
+                         (uint8_t*)m.out[i]);
+        }
+    }
+
+    for (i = 0; i < nb_threads; i++) free(m.buffers[i]);
+    free(m.buffers);
+    free(m.sdf);
+    free(m.out);
+    free(m.tiles);
+    free(m.offsets);
+    volume_delete((volume_t*)m.src);
+}
+
+void volume_morphology(volume_t *volume, int op, const shape_t *shape,
+                       int radius)
+{
+    volume_t *original;
+
+    radius = clamp(radius, 1, N);
+    original = volume_copy(volume);
+    switch (op) {
+    case VOLUME_MORPHO_DILATE:
+        morpho_pass(volume, true, shape, radius);
+        break;
+    case VOLUME_MORPHO_ERODE:
+        morpho_pass(volume, false, shape, radius);
+        break;
+    case VOLUME_MORPHO_OPEN:
+        morpho_pass(volume, false, shape, radius);
+        morpho_pass(volume, true, shape, radius);
+        // Restore the original colors.
+        volume_merge(volume, original, MODE_INTERSECT_FILL, NULL);
+        break;
+    case VOLUME_MORPHO_CLOSE:
+        morpho_pass(volume, true, shape, radius);
+        morpho_pass(volume, false, shape, radius);
+        break;
+    case VOLUME_MORPHO_HOLLOW:
+        morpho_pass(volume, false, shape, radius);
+        volume_merge(original, volume, MODE_SUB, NULL);
+        volume_set(volume, original);
+        break;
+    default:
+        assert(false);
+    }
+    volume_delete(original);
+}
+
+/*
+ * Signed distance field.
+ *
+ * The field of a tile is computed from the tile plus a border of the size
+ * of the max distance, with an exact euclidean distance transform done one
+ * axis at a time (Felzenszwalb and Huttenlocher).  Since the border is
+ * never bigger than a tile, the result only depends on the tile and its 26
+ * neighbors, so we cache it using their ids as key.
+ */
+
+#define SDF_INF 1e20f
+
+typedef struct {
+    const volume_t *volume;
+    int border;
+    int (*tiles)[3];
+    float (*out)[N * N * N];
+    uint8_t (**buffers)[4];     // One extended tile buffer per thread.
+    float **fields;             // Two extended tile fields per thread.
+} sdf_t;
+
+typedef struct {
+    uint64_t ids[27];
+    int      border;
+    int      pad_;
+} sdf_key_t;
+
+static int sdf_del(void *data)
+{
+    free(data);
+    return 0;
+}
+
+// Get the cache key of a tile field.  Return false if the tile and all its
+// neighbors are empty.
+static bool sdf_get_key(const volume_t *volume, const int pos[3], int border,
+                        sdf_key_t *key)
+{
+    int i = 0, x, y, z;
+    bool ret = false;
+
+    memset(key, 0, sizeof(*key));
+    key->border = border;
+    for (z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++) {
+        volume_get_tile_data(volume, NULL, (int[]){pos[0] + x * N,
+                             pos[1] + y * N, pos[2] + z * N}, &key->ids[i]);
+        if (key->ids[i++]) ret = true;
+    }
+    return ret;
+}
+
+// 1D squared distance transform of n values separated by stride.
+static void edt_1d(float *f, int n, int stride)
+{
+    float d[3 * N], z[3 * N + 1], s = 0, fq;
+    int v[3 * N], q, j, k = -1;
+
+    // Rows fully inside a site don't change.
+    for (q = 0; q < n; q++) if (f[q * stride]) break;
+    if (q == n) return;
+
+    for (q = 0; q < n; q++) {
+        fq = f[q * stride];
+        if (fq >= SDF_INF) continue;
+        while (k >= 0) {
+            s = ((fq + q * q) - (f[v[k] * stride] + v[k] * v[k])) /
+                (2 * q - 2 * v[k]);
+            if (s > z[k]) break;
+            k--;
+        }
+        k++;
+        v[k] = q;
+        z[k] = k ? s : -SDF_INF;
+        z[k + 1] = SDF_INF;
+    }
+    if (k < 0) return; // No site at all.
+    for (q = 0, j = 0; q < n; q++) {
+        while (z[j + 1] < q) j++;
+        d[q] = (q - v[j]) * (q - v[j]) + f[v[j] * stride];
+    }
+    for (q = 0; q < n; q++) f[q * stride] = d[q];
+}
+
+// Squared distance transform of an extended tile, only computed for the
+// values inside the tile.
+static void edt_3d(float *f, int s, int b)
+{
+    int x, y, z;
+    for (z = 0; z < s; z++)
+    for (y = 0; y < s; y++)
+        edt_1d(f + z * s * s + y * s, s, 1);
+    for (z = 0; z < s; z++)
+    for (x = b; x < b + N; x++)
+        edt_1d(f + z * s * s + x, s, s);
+    for (y = b; y < b + N; y++)
+    for (x = b; x < b + N; x++)
+        edt_1d(f + y * s + x, s, s * s);
+}
+
+static void sdf_tile(void *user, int i, int thread)
+{
+    sdf_t *sdf = user;
+    const int b = sdf->border, s = N + 2 * b;
+    const float max_dist = b - 0.5f;
+    uint8_t (*buf)[4] = sdf->buffers[thread];
+    float *outside = sdf->fields[thread];
+    float *inside = outside + s * s * s;
+    float *out = sdf->out[i], d;
+    int x, y, z, j, pos[3];
+    bool has_solid = false, has_empty = false, solid;
+
+    for (j = 0; j < 3; j++) pos[j] = sdf->tiles[i][j] - b;
+    volume_read(sdf->volume, pos, (int[]){s, s, s}, (uint8_t*)buf);
+    for (j = 0; j < s * s * s; j++) {
+        solid = buf[j][3] != 0;
+        outside[j] = solid ? 0 : SDF_INF;
+        inside[j] = solid ? SDF_INF : 0;
+        if (solid) has_solid = true;
+        else has_empty = true;
+    }
+    if (has_solid) edt_3d(outside, s, b);
+    if (has_empty) edt_3d(inside, s, b);
+
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        j = (z + b) * s * s + (y + b) * s + x + b;
+        if (buf[j][3])
+            d = -(sqrtf(inside[j]) - 0.5f);
+        else
+            d = sqrtf(outside[j]) - 0.5f;
+        out[z * N * N + y * N + x] = clamp(d, -max_dist, max_dist);
+    }
+}
+
+// Get the fields of a list of tiles, from the cache if possible.  The max
+// distance must already be clamped.
+static void sdf_get_tiles(const volume_t *volume, int nb,
+                          const int (*tiles)[3], float max_dist,
+                          float (*fields)[N * N * N])
+{
+    const int batch_size = 256;
+    static cache_t *cache = NULL;
+    sdf_t sdf = {.volume = volume};
+    sdf_key_t *keys;
+    int i, j, k, nb_missing = 0, *missing, nb_threads, batch, s;
+    float *f;
+
+    sdf.border = ceilf(max_dist + 0.5f);
+    s = N + 2 * sdf.border;
+    sdf.tiles = calloc(nb, sizeof(*sdf.tiles));
+    keys = calloc(nb, sizeof(*keys));
+    missing = calloc(nb, sizeof(*missing));
+    for (i = 0; i < nb; i++) {
+        if (!sdf_get_key(volume, tiles[i], sdf.border, &keys[i])) {
+            // Nothing around: all the values are at the max distance.
+            for (j = 0; j < N * N * N; j++) fields[i][j] = max_dist;
+            continue;
+        }
+        pthread_mutex_lock(&g_cache_lock);
+        if (!cache) cache = cache_create("sdf", 2048);
+        f = cache_get(cache, &keys[i], sizeof(keys[i]));
+        if (f) memcpy(fields[i], f, sizeof(*fields));
+        pthread_mutex_unlock(&g_cache_lock);
+        if (f) continue;
+        memcpy(sdf.tiles[nb_missing], tiles[i], sizeof(*tiles));
+        missing[nb_missing++] = i;
+    }
+
+    // Compute the missing tiles in parallel.
+    if (nb_missing) {
+        nb_threads = parallel_get_nb_threads();
+        sdf.buffers = calloc(nb_threads, sizeof(*sdf.buffers));
+        sdf.fields = calloc(nb_threads, sizeof(*sdf.fields));
+        for (i = 0; i < nb_threads; i++) {
+            sdf.buffers[i] = malloc(s * s * s * 4);
+            sdf.fields[i] = malloc(2 * s * s * s * sizeof(float));
+        }
+        sdf.out = malloc(min(nb_missing, batch_size) * sizeof(*sdf.out));
+        for (batch = 0; batch < nb_missing; batch += batch_size) {
+            sdf_t bsdf = sdf;
+            bsdf.tiles = sdf.tiles + batch;
+            parallel_for(min(nb_missing - batch, batch_size), sdf_tile, &bsdf);
+            pthread_mutex_lock(&g_cache_lock);
+            for (j = 0; j < min(nb_missing - batch, batch_size); j++) {
+                k = missing[batch + j];
+                memcpy(fields[k], sdf.out[j], sizeof(*fields));
+                f = malloc(sizeof(*fields));
+                memcpy(f, sdf.out[j], sizeof(*fields));
+                cache_add(cache, &keys[k], sizeof(keys[k]), f, 1, sdf_del);
+            }
+            pthread_mutex_unlock(&g_cache_lock);
+        }
+        for (i = 0; i < nb_threads; i++) {
+            free(sdf.buffers[i]);
+            free(sdf.fields[i]);
+        }
+        free(sdf.buffers);
+        free(sdf.fields);
+        free(sdf.out);
+    }
+
+    free(sdf.tiles);
+    free(keys);
+    free(missing);
+}
+
+void volume_get_sdf(const volume_t *volume, const int pos[3],
+                    const int size[3], float max_dist, float *out)
+{
+    int i, j, nb, x, y, z, o[3], n[3], clip[2][3];
+    int (*tiles)[3];
+    float (*fields)[N * N * N], d;
+
+    if (size[0] <= 0 || size[1] <= 0 || size[2] <= 0) return;
+    max_dist = clamp(max_dist, 0.5f, N - 0.5f);
+
+    // Get all the tiles touching the box.
+    for (i = 0; i < 3; i++) {
+        o[i] = pos[i] & ~(int)(N - 1);
+        n[i] = (pos[i] + size[i] - o[i] + N - 1) / N;
+    }
+    nb = n[0] * n[1] * n[2];
+    tiles = calloc(nb, sizeof(*tiles));
+    fields = malloc(nb * sizeof(*fields));
+    for (i = 0; i < nb; i++) {
+        tiles[i][0] = o[0] + (i % n[0]) * N;
+        tiles[i][1] = o[1] + (i / n[0] % n[1]) * N;
+        tiles[i][2] = o[2] + (i / n[0] / n[1]) * N;
+    }
+    sdf_get_tiles(volume, nb, tiles, max_dist, fields);
+
+    // Copy the fields into the output box, clamped to the max distance.
+    for (i = 0; i < nb; i++) {
+        for (j = 0; j < 3; j++) {
+            clip[0][j] = max(tiles[i][j], pos[j]);
+            clip[1][j] = min(tiles[i][j] + N, pos[j] + size[j]);
+        }
+        for (z = clip[0][2]; z < clip[1][2]; z++)
+        for (y = clip[0][1]; y < clip[1][1]; y++)
+        for (x = clip[0][0]; x < clip[1][0]; x++) {
+            d = fields[i][(z - tiles[i][2]) * N * N +
+                          (y - tiles[i][1]) * N + x - tiles[i][0]];
+            out[((z - pos[2]) * size[1] + y - pos[1]) * size[0] +
+                x - pos[0]] = clamp(d, -max_dist, max_dist);
+        }
+    }
+
+    free(tiles);
+    free(fields);
+}
+
+/*
+ * Stroke rendering.
+ *
+ * A stroke is the union of several stamps of the same painter.  Instead of
+ * running volume_op for each stamp, we compute for each voxel the maximum
+ * coverage of all the stamps touching its tile, and combine it once.  The
+ * tiles are processed in parallel in batches, as for the morphology.
+ */
+
+typedef struct {
+    float box[4][4];
+    float mat[4][4];    // Voxel position to unit box.
+    float size[3];
+    int aabb[2][3];     // Voxels where the shape can be non zero.
+    int tiles[2][3];    // Range of tiles covered (inclusive).
+} stamp_t;
+
+typedef struct {
+    const volume_t *volume;
+    const painter_t *painter;
+    int nb_stamps;
+    const stamp_t *stamps;
+    int (*tiles)[3];
+    uint8_t (*out)[N * N * N][4];
+    bool *changed;
+    int **lists;        // One stamp index buffer per thread.
+} stroke_t;
+
+static void stroke_tile(void *user, int i, int thread)
+{
+    const stroke_t *st = user;
+    const painter_t *painter = st->painter;
+    const int *tpos = st->tiles[i];
+    const stamp_t *stamp;
+    uint8_t (*data)[4] = st->out[i];
+    uint8_t c[4], new_value[4];
+    int *list = st->lists[thread];
+    int j, k, nb = 0, x, y, z, idx, aabb[2][3], clip[2][3];
+    float p[3], q[3], v, cover[N * N * N] = {};
+    const bool use_box = painter->box && !box_is_null(*painter->box);
+
+    st->changed[i] = false;
+    volume_get_tile_aabb(tpos, aabb);
+    for (j = 0; j < st->nb_stamps; j++) {
+        stamp = &st->stamps[j];
+        for (k = 0; k < 3; k++) {
+            if (tpos[k] < stamp->tiles[0][k] || tpos[k] > stamp->tiles[1][k])
+                break;
+        }
+        if (k < 3) continue;
+        // Without smoothness the shape can't go out of its box.
+        if (!painter->smoothness && !box_intersect_aabb(stamp->box, aabb))
+            continue;
+        list[nb++] = j;
+    }
+    if (!nb) return;
+
+    // Coverage of the union of the stamps, only evaluated inside the
+    // voxel bounding box of each stamp.
+    for (j = 0; j < nb; j++) {
+        stamp = &st->stamps[list[j]];
+        for (k = 0; k < 3; k++) {
+            clip[0][k] = max(stamp->aabb[0][k], aabb[0][k]) - tpos[k];
+            clip[1][k] = min(stamp->aabb[1][k], aabb[1][k]) - tpos[k];
+        }
+        for (z = clip[0][2]; z < clip[1][2]; z++)
+        for (y = clip[0][1]; y < clip[1][1]; y++)
+        for (x = clip[0][0]; x < clip[1][0]; x++) {
+            idx = (z * N + y) * N + x;
+            if (cover[idx] >= 1) continue;
+            vec3_set(p, tpos[0] + x + 0.5, tpos[1] + y + 0.5,
+                        tpos[2] + z + 0.5);
+            mat4_mul_vec3(stamp->mat, p, q);
+            v = painter->shape->func(q, stamp->size, painter->smoothness);
+            if (painter->smoothness)
+                v = clamp(v / painter->smoothness, -1.0f, 1.0f) / 2.0f + 0.5f;
+            else
+                v = (v >= 0.f) ? 1.f : 0.f;
+            cover[idx] = max(cover[idx], v);
+        }
+    }
+
+    volume_read(st->volume, tpos, (int[]){N, N, N}, (uint8_t*)data);
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        idx = (z * N + y) * N + x;
+        vec3_set(p, tpos[0] + x + 0.5, tpos[1] + y + 0.5, tpos[2] + z + 0.5);
+        if (use_box && !bbox_contains_vec(*painter->box, p)) continue;
+        memcpy(c, painter->color, 4);
+        c[3] *= cover[idx];
+        combine(data[idx], c, MODE_MAX, new_value);
+        if (vec4_equal(data[idx], new_value)) continue;
+        memcpy(data[idx], new_value, 4);
+        st->changed[i] = true;
+    }
+}
+
+// Add the symmetric copies of the stamps boxes.
+static int stroke_get_boxes(const painter_t *painter,
+                            const float (*boxes)[4][4], int nb,
+                            float (**out)[4][4])
+{
+    int i, j, n = nb;
+    float mat[4][4];
+    const float *o = painter->symmetry_origin;
+
+    *out = malloc(nb * 8 * sizeof(**out));
+    memcpy(*out, boxes, nb * sizeof(*boxes));
+    for (i = 0; i < 3; i++) {
+        if (!(painter->symmetry & (1 << i))) continue;
+        mat4_set_identity(mat);
+        mat4_itranslate(mat, +o[0], +o[1], +o[2]);
+        mat4_iscale(mat, i == 0 ? -1 : 1, i == 1 ? -1 : 1, i == 2 ? -1 : 1);
+        mat4_itranslate(mat, -o[0], -o[1], -o[2]);
+        for (j = 0; j < n; j++) mat4_mul(mat, (*out)[j], (*out)[n + j]);
+        n *= 2;
+    }
+    return n;
+}
+
+// Compute the voxels bounding box of a stamp, grown by the smoothness, and
+// the same tiles range as the box iterator used by volume_op.
+static void stamp_get_bounds(stamp_t *stamp, float smoothness)
+{
+    int i, j, m = ceil(smoothness) + 1;
+    float p[4], v[4];
+    int bbox[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                      {INT_MIN, INT_MIN, INT_MIN}};
+
+    for (i = 0; i < 8; i++) {
+        vec4_set(v, (i & 1) ? 1 : -1, (i & 2) ? 1 : -1, (i & 4) ? 1 : -1, 1);
+        mat4_mul_vec4(stamp->box, v, p);
+        for (j = 0; j < 3; j++) {
+            bbox[0][j] = min(bbox[0][j], (int)floor(p[j]));
+            bbox[1][j] = max(bbox[1][j], (int)ceil(p[j]));
+        }
+    }
+    for (j = 0; j < 3; j++) {
+        stamp->aabb[0][j] = bbox[0][j] - m;
+        stamp->aabb[1][j] = bbox[1][j] + m;
+        stamp->tiles[0][j] = bbox[0][j] & ~(int)(N - 1);
+        stamp->tiles[1][j] = bbox[1][j] & ~(int)(N - 1);
+    }
+}
+
+void volume_op_stroke(volume_t *volume, const painter_t *painter,
+                      const float (*boxes)[4][4], int nb)
+{
+    const int batch_size = 256;
+    stroke_t st = {.painter = painter};
+    stamp_t *stamps;
+    float (*all)[4][4];
+    int i, j, nb_tiles = 0, nb_threads, batch, p[3];
+    stamp_t *s;
+
+    // Applying the max coverage once only gives the same result as
+    // applying each stamp in turn for MODE_MAX.
+    if (painter->mode != MODE_MAX) {
+        for (i = 0; i < nb; i++) volume_op(volume, painter, boxes[i]);
+        return;
+    }
+
+    nb = stroke_get_boxes(painter, boxes, nb, &all);
+    stamps = calloc(nb, sizeof(*stamps));
+    for (i = 0; i < nb; i++) {
+        s = &stamps[i];
+        mat4_copy(all[i], s->box);
+        box_get_size(all[i], s->size);
+        mat4_copy(all[i], s->mat);
+        mat4_iscale(s->mat, 1 / s->size[0], 1 / s->size[1], 1 / s->size[2]);
+        mat4_invert(s->mat, s->mat);
+        stamp_get_bounds(s, painter->smoothness);
+        for (p[2] = s->tiles[0][2]; p[2] <= s->tiles[1][2]; p[2] += N)
+        for (p[1] = s->tiles[0][1]; p[1] <= s->tiles[1][1]; p[1] += N)
+        for (p[0] = s->tiles[0][0]; p[0] <= s->tiles[1][0]; p[0] += N) {
+            st.tiles = realloc(st.tiles, (nb_tiles + 1) * sizeof(*st.tiles));
+            memcpy(st.tiles[nb_tiles++], p, sizeof(p));
+        }
+    }
+    free(all);
+    if (nb_tiles) {
+        qsort(st.tiles, nb_tiles, sizeof(*st.tiles), tile_pos_cmp);
+        for (i = 1, j = 1; i < nb_tiles; i++) {
+            if (tile_pos_cmp(st.tiles[i], st.tiles[j - 1]) == 0) continue;
+            memcpy(st.tiles[j++], st.tiles[i], sizeof(*st.tiles));
+        }
+        nb_tiles = j;
+    }
+
+    st.volume = volume;
+    st.nb_stamps = nb;
+    st.stamps = stamps;
+    nb_threads = parallel_get_nb_threads();
+    st.lists = calloc(nb_threads, sizeof(*st.lists));
+    for (i = 0; i < nb_threads; i++)
+        st.lists[i] = malloc(nb * sizeof(**st.lists));
+    st.out = malloc(min(nb_tiles, batch_size) * sizeof(*st.out));
+    st.changed = calloc(min(nb_tiles, batch_size), sizeof(*st.changed));
+    for (batch = 0; batch < nb_tiles; batch += batch_size) {
+        stroke_t bst = st;
+        bst.tiles = st.tiles + batch;
+        parallel_for(min(nb_tiles - batch, batch_size), stroke_tile, &bst);
+        for (i = 0; i < min(nb_tiles - batch, batch_size); i++) {
+            if (!st.changed[i]) continue;
+            volume_write(volume, bst.tiles[i], (int[]){N, N, N},
+                         (uint8_t*)st.out[i]);
+        }
+    }
+
+    for (i = 0; i < nb_threads; i++) free(st.lists[i]);
+    free(st.lists);
+    free(st.out);
+    free(st.changed);
+    free(st.tiles);
+    free(stamps);
+}
+
+/*
+ * Connected components labelling.
+ *
+ * 1. Each tile is labelled independently in parallel, with a union-find
+ *    over its voxels in scan order.
+ * 2. The local labels of all the tiles get a global index, and a second
+ *    union-find links them across the tiles boundaries, only looking at
+ *    the boundary voxels.
+ * 3. The roots are compacted into the final components.
+ */
+
+typedef struct {
+    const volume_t *volume;
+    int connectivity;
+    int threshold;
+    int nb_tiles;
+    int (*tiles)[3];        // Sorted.
+    uint16_t (*labels)[N * N * N]; // Local labels, starting at 1.
+    int *nb_labels;
+    int nb_offsets;
+    int (*offsets)[3];      // The neighbors before a voxel in scan order.
+    uint8_t (**buffers)[4]; // One tile buffer per thread.
+} components_t;
+
+static bool components_connected(const components_t *cc,
+                                 const uint8_t a[4], const uint8_t b[4])
+{
+    if (cc->threshold >= 255) return true;
+    return max3(abs(a[0] - b[0]), abs(a[1] - b[1]), abs(a[2] - b[2])) <=
+           cc->threshold;
+}
+
+static int uf_find(int *parent, int i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// Always keep the smallest index as root.
+static void uf_union(int *parent, int a, int b)
+{
+    if (parent[a] == parent[b]) return; // Common case in solid regions.
+    a = uf_find(parent, a);
+    b = uf_find(parent, b);
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+}
+
+static void components_tile(void *user, int i, int thread)
+{
+    components_t *cc = user;
+    uint8_t (*data)[4] = cc->buffers[thread];
+    uint16_t *labels = cc->labels[i];
+    int parent[N * N * N];
+    int x, y, z, j, idx, nidx, n[3], nb = 0;
+
+    volume_read(cc->volume, cc->tiles[i], (int[]){N, N, N}, (uint8_t*)data);
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        idx = (z * N + y) * N + x;
+        parent[idx] = -1;
+        if (!data[idx][3]) continue;
+        parent[idx] = idx;
+        // Fast path for the voxels whose neighbors are all in the tile.
+        if (x > 0 && x < N - 1 && y > 0 && y < N - 1 && z > 0) {
+            for (j = 0; j < cc->nb_offsets; j++) {
+                nidx = idx + (cc->offsets[j][2] * N + cc->offsets[j][1]) * N +
+                       cc->offsets[j][0];
+                if (parent[nidx] < 0) continue;
+                if (!components_connected(cc, data[idx], data[nidx]))
+                    continue;
+                uf_union(parent, idx, nidx);
+            }
+            continue;
+        }
+        for (j = 0; j < cc->nb_offsets; j++) {
+            n[0] = x + cc->offsets[j][0];
+            n[1] = y + cc->offsets[j][1];
+            n[2] = z + cc->offsets[j][2];
+            if (    n[0] < 0 || n[0] >= N || n[1] < 0 || n[1] >= N ||
+                    n[2] < 0 || n[2] >= N) continue;
+            nidx = (n[2] * N + n[1]) * N + n[0];
+            if (parent[nidx] < 0) continue;
+            if (!components_connected(cc, data[idx], data[nidx])) continue;
+            uf_union(parent, idx, nidx);
+        }
+    }
+
+    // Since the roots are the smallest indices, they get their label
+    // before the other voxels of their set.
+    for (idx = 0; idx < N * N * N; idx++) {
+        if (parent[idx] < 0) {
+            labels[idx] = 0;
+            continue;
+        }
+        j = uf_find(parent, idx);
+        labels[idx] = (j == idx) ? ++nb : labels[j];
+    }
+    cc->nb_labels[i] = nb;
+}
+
+static int components_find_tile(const components_t *cc, const int pos[3])
+{
+    const int (*t)[3];
+    t = bsearch(pos, cc->tiles, cc->nb_tiles, sizeof(*cc->tiles),
+                tile_pos_cmp);
+    return t ? t - cc->tiles : -1;
+}
+
+static int component_cmp(const void *a_, const void *b_)
+{
+    const volume_component_t *a = a_, *b = b_;
+    return cmp(b->nb_voxels, a->nb_voxels);
+}
+
+int volume_get_components(const volume_t *volume, int connectivity,
+                          int threshold, volume_component_t **out)
+{
+    components_t cc = {
+        .volume = volume,
+        .connectivity = connectivity,
+        .threshold = threshold,
+    };
+    volume_iterator_t iter;
+    volume_accessor_t accessor;
+    volume_component_t *comps, *comp;
+    int i, j, k, t, u, l, nb_threads, nb_total = 0, nb_comps = 0;
+    int pos[3], d[3], a[3], b[3], vpos[3], idx, neighbors[27];
+    int *base, *parent, *comp_id, (*fwd)[3], *seen, *slot_of, nb_slots;
+    int (*box)[3];
+    uint8_t c1[4], c2[4];
+    uint8_t (*data)[4], (*tmp)[4];
+    struct {
+        int comp;
+        int box[2][3];
+    } *slots;
+
+    assert(connectivity == 6 || connectivity == 18 || connectivity == 26);
+
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        cc.tiles = realloc(cc.tiles, (cc.nb_tiles + 1) * sizeof(*cc.tiles));
+        memcpy(cc.tiles[cc.nb_tiles++], pos, sizeof(pos));
+    }
+    if (cc.nb_tiles)
+        qsort(cc.tiles, cc.nb_tiles, sizeof(*cc.tiles), tile_pos_cmp);
+
+    // Neighbors offsets, split in the ones before and after in scan order.
+    cc.offsets = calloc(13, sizeof(*cc.offsets));
+    fwd = calloc(13, sizeof(*fwd));
+    for (d[2] = -1; d[2] <= 1; d[2]++)
+    for (d[1] = -1; d[1] <= 1; d[1]++)
+    for (d[0] = -1; d[0] <= 1; d[0]++) {
+        k = abs(d[0]) + abs(d[1]) + abs(d[2]);
+        if (k == 0 || (k == 2 && connectivity < 18) ||
+                      (k == 3 && connectivity < 26)) continue;
+        if ((d[2] * N + d[1]) * N + d[0] > 0) continue;
+        memcpy(cc.offsets[cc.nb_offsets], d, sizeof(d));
+        for (i = 0; i < 3; i++) fwd[cc.nb_offsets][i] = -d[i];
+        cc.nb_offsets++;
+    }
+
+    // 1. Label each tile.
+    nb_threads = parallel_get_nb_threads();
+    cc.buffers = calloc(nb_threads, sizeof(*cc.buffers));
+    for (i = 0; i < nb_threads; i++)
+        cc.buffers[i] = malloc(N * N * N * 4);
+    cc.labels = malloc(cc.nb_tiles * sizeof(*cc.labels));
+    cc.nb_labels = calloc(cc.nb_tiles, sizeof(*cc.nb_labels));
+    parallel_for(cc.nb_tiles, components_tile, &cc);
+
+    // 2. Link the labels across the tiles boundaries.
+    base = calloc(cc.nb_tiles + 1, sizeof(*base));
+    for (t = 0; t < cc.nb_tiles; t++) {
+        base[t] = nb_total;
+        nb_total += cc.nb_labels[t];
+    }
+    parent = malloc(max(nb_total, 1) * sizeof(*parent));
+    for (i = 0; i < nb_total; i++) parent[i] = i;
+
+    accessor = volume_get_accessor(volume);
+    for (t = 0; t < cc.nb_tiles; t++) {
+        for (i = 0; i < 27; i++) {
+            pos[0] = cc.tiles[t][0] + (i % 3 - 1) * N;
+            pos[1] = cc.tiles[t][1] + (i / 3 % 3 - 1) * N;
+            pos[2] = cc.tiles[t][2] + (i / 9 - 1) * N;
+            neighbors[i] = components_find_tile(&cc, pos);
+        }
+        for (a[2] = 0; a[2] < N; a[2]++)
+        for (a[1] = 0; a[1] < N; a[1]++)
+        for (a[0] = 0; a[0] < N; a[0]++) {
+            // Only the boundary voxels can connect to other tiles.
+            if (    a[0] > 0 && a[0] < N - 1 && a[1] > 0 && a[1] < N - 1 &&
+                    a[2] > 0 && a[2] < N - 1) {
+                a[0] = N - 2;
+                continue;
+            }
+            l = cc.labels[t][(a[2] * N + a[1]) * N + a[0]];
+            if (!l) continue;
+            for (j = 0; j < cc.nb_offsets; j++) {
+                for (i = 0; i < 3; i++) {
+                    b[i] = a[i] + fwd[j][i];
+                    d[i] = b[i] < 0 ? -1 : b[i] >= N ? 1 : 0;
+                    b[i] -= d[i] * N;
+                    pos[i] = cc.tiles[t][i] + d[i] * N;
+                }
+                if (!d[0] && !d[1] && !d[2]) continue;
+                u = neighbors[(d[2] + 1) * 9 + (d[1] + 1) * 3 + d[0] + 1];
+                if (u < 0) continue;
+                k = cc.labels[u][(b[2] * N + b[1]) * N + b[0]];
+                if (!k) continue;
+                if (threshold < 255) {
+                    for (i = 0; i < 3; i++) {
+                        vpos[i] = cc.tiles[t][i] + a[i];
+                        pos[i] += b[i];
+                    }
+                    volume_get_at(volume, &accessor, vpos, c1);
+                    volume_get_at(volume, &accessor, pos, c2);
+                    if (!components_connected(&cc, c1, c2)) continue;
+                }
+                uf_union(parent, base[t] + l - 1, base[u] + k - 1);
+            }
+        }
+    }
+
+    // 3. Compact the components and compute their stats.
+    comp_id = malloc(max(nb_total, 1) * sizeof(*comp_id));
+    for (i = 0; i < nb_total; i++) {
+        j = uf_find(parent, i);
+        comp_id[i] = (j == i) ? nb_comps++ : comp_id[j];
+    }
+    comps = calloc(max(nb_comps, 1), sizeof(*comps));
+    for (i = 0; i < nb_comps; i++) {
+        comps[i].aabb[0][0] = comps[i].aabb[0][1] = comps[i].aabb[0][2] =
+            INT_MAX;
+        comps[i].aabb[1][0] = comps[i].aabb[1][1] = comps[i].aabb[1][2] =
+            INT_MIN;
+        comps[i].volume = volume_new();
+    }
+    data = cc.buffers[0];
+    tmp = malloc(N * N * N * 4);
+    seen = malloc(max(nb_comps, 1) * sizeof(*seen));
+    slot_of = malloc(max(nb_comps, 1) * sizeof(*slot_of));
+    for (i = 0; i < nb_comps; i++) seen[i] = -1;
+    slots = malloc(N * N * N * sizeof(*slots));
+    for (t = 0; t < cc.nb_tiles; t++) {
+        // Group the voxels of the tile by component, with their local
+        // bounding box.
+        nb_slots = 0;
+        volume_read(volume, cc.tiles[t], (int[]){N, N, N}, (uint8_t*)data);
+        for (idx = 0; idx < N * N * N; idx++) {
+            l = cc.labels[t][idx];
+            if (!l) continue;
+            j = comp_id[base[t] + l - 1];
+            if (seen[j] != t) {
+                seen[j] = t;
+                slots[nb_slots].comp = j;
+                memcpy(slots[nb_slots].box, (int[2][3]){{N, N, N}, {0, 0, 0}},
+                       sizeof(slots[nb_slots].box));
+                slot_of[j] = nb_slots++;
+            }
+            box = slots[slot_of[j]].box;
+            a[0] = idx % N;
+            a[1] = (idx / N) % N;
+            a[2] = idx / (N * N);
+            for (i = 0; i < 3; i++) {
+                box[0][i] = min(box[0][i], a[i]);
+                box[1][i] = max(box[1][i], a[i] + 1);
+            }
+            comps[j].nb_voxels++;
+        }
+
+        // Write each component part, only copying its bounding box.
+        for (k = 0; k < nb_slots; k++) {
+            comp = &comps[slots[k].comp];
+            box = slots[k].box;
+            for (i = 0; i < 3; i++) {
+                vpos[i] = cc.tiles[t][i] + box[0][i];
+                b[i] = box[1][i] - box[0][i];
+                comp->aabb[0][i] = min(comp->aabb[0][i], vpos[i]);
+                comp->aabb[1][i] = max(comp->aabb[1][i], vpos[i] + b[i]);
+            }
+            j = 0;
+            for (a[2] = box[0][2]; a[2] < box[1][2]; a[2]++)
+            for (a[1] = box[0][1]; a[1] < box[1][1]; a[1]++)
+            for (a[0] = box[0][0]; a[0] < box[1][0]; a[0]++, j++) {
+                idx = (a[2] * N + a[1]) * N + a[0];
+                l = cc.labels[t][idx];
+                if (l && comp_id[base[t] + l - 1] == slots[k].comp)
+                    memcpy(tmp[j], data[idx], 4);
+                else
+                    memset(tmp[j], 0, 4);
+            }
+            volume_write(comp->volume, vpos, b, (uint8_t*)tmp);
+        }
+    }
+    qsort(comps, nb_comps, sizeof(*comps), component_cmp);
+
+    for (i = 0; i < nb_threads; i++) free(cc.buffers[i]);
+    free(cc.buffers);
+    free(cc.labels);
+    free(cc.nb_labels);
+    free(cc.tiles);
+    free(cc.offsets);
+    free(fwd);
+    free(base);
+    free(parent);
+    free(comp_id);
+    free(tmp);
+    free(seen);
+    free(slot_of);
+    free(slots);
+    *out = comps;
+    return nb_comps;
+}
+
+void volume_components_free(volume_component_t *comps, int nb)
+{
+    int i;
+    for (i = 0; i < nb; i++) volume_delete(comps[i].volume);
+    free(comps);
+}
+
+/*
+ * Downsampling.
+ *
+ * Each output tile is computed in parallel from the 2x2x2 input tiles it
+ * covers, then written serially.
+ */
+
+typedef struct {
+    const volume_t *src;
+    int (*tiles)[3];
+    uint8_t (*out)[N * N * N][4];
+    uint8_t (**buffers)[4];     // One 2x2x2 tiles buffer per thread.
+} downsample_t;
+
+static void downsample_tile(void *user, int i, int thread)
+{
+    downsample_t *d = user;
+    uint8_t (*buf)[4] = d->buffers[thread];
+    uint8_t (*out)[4] = d->out[i];
+    const uint8_t *v[8];
+    int x, y, z, j, k, nb, count, best, best_count;
+    const int s = 2 * N;
+
+    volume_read(d->src, (int[]){d->tiles[i][0] * 2, d->tiles[i][1] * 2,
+                                d->tiles[i][2] * 2},
+                (int[]){s, s, s}, (uint8_t*)buf);
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        nb = 0;
+        for (j = 0; j < 8; j++) {
+            v[nb] = buf[(z * 2 + j / 4) * s * s + (y * 2 + j / 2 % 2) * s +
+                        x * 2 + j % 2];
+            if (v[nb][3]) nb++;
+        }
+        if (nb < 4) {
+            memset(out[(z * N + y) * N + x], 0, 4);
+            continue;
+        }
+        // Most frequent color, first one in case of tie.
+        best = 0;
+        best_count = 0;
+        for (j = 0; j < nb; j++) {
+            for (k = 0, count = 0; k < nb; k++)
+                count += memcmp(v[j], v[k], 4) == 0;
+            if (count > best_count) {
+                best = j;
+                best_count = count;
+            }
+        }
+        memcpy(out[(z * N + y) * N + x], v[best], 4);
+    }
+}
+
+volume_t *volume_downsample(const volume_t *volume)
+{
+    const int batch_size = 256;
+    downsample_t d = {.src = volume};
+    volume_t *ret = volume_new();
+    volume_iterator_t iter;
+    int i, j, nb = 0, pos[3], nb_threads, batch;
+
+    // The output tiles, covering each input tile.
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        d.tiles = realloc(d.tiles, (nb + 1) * sizeof(*d.tiles));
+        for (i = 0; i < 3; i++)
+            d.tiles[nb][i] = (pos[i] >> 1) & ~(int)(N - 1);
+        nb++;
+    }
+    if (nb) {
+        qsort(d.tiles, nb, sizeof(*d.tiles), tile_pos_cmp);
+        for (i = 1, j = 1; i < nb; i++) {
+            if (tile_pos_cmp(d.tiles[i], d.tiles[j - 1]) == 0) continue;
+            memcpy(d.tiles[j++], d.tiles[i], sizeof(*d.tiles));
+        }
+        nb = j;
+    }
+
+    nb_threads = parallel_get_nb_threads();
+    d.buffers = calloc(nb_threads, sizeof(*d.buffers));
+    for (i = 0; i < nb_threads; i++)
+        d.buffers[i] = malloc(8 * N * N * N * 4);
+    d.out = malloc(min(nb, batch_size) * sizeof(*d.out));
+    for (batch = 0; batch < nb; batch += batch_size) {
+        downsample_t bd = d;
+        bd.tiles = d.tiles + batch;
+        parallel_for(min(nb - batch, batch_size), downsample_tile, &bd);
+        for (i = 0; i < min(nb - batch, batch_size); i++) {
+            volume_write(ret, bd.tiles[i], (int[]){N, N, N},
+                         (uint8_t*)d.out[i]);
+        }
+    }
+
+    for (i = 0; i < nb_threads; i++) free(d.buffers[i]);
+    free(d.buffers);
+    free(d.out);
+    free(d.tiles);
+    return ret;
+}
+
 /* Function: volume_crc32
  * Compute the crc32 of the volume data as an array of xyz rgba values.
  *
@@ -129,10 +129,42 @@ void volume_get_box(const volume_t *volume, bool exact, float box[4][4]);
 void volume_op(volume_t *volume, const painter_t *painter,
                const float box[4][4]);
 
-// XXX: to cleanup.
-void volume_extrude(volume_t *volume,
-                  const float plane[4][4],
-                  const float box[4][4]);
+/* Function: volume_op_stroke
+ * Apply a paint operation for the union of several shapes.
+ *
+ * For MODE_MAX, the painter is applied once per voxel with the maximum
+ * coverage of all the shapes, in a single pass over the tiles.  This is the
+ * same as calling <volume_op> for each box, but much faster for strokes
+ * made of many overlapping stamps.  The other modes fall back to one
+ * <volume_op> per box.
+ *
+ * Parameters:
+ *   volume  - The volume we paint into.
+ *   painter - Defines the paint operation to apply.
+ *   boxes   - The boxes of all the shapes.
+ *   nb      - Number of boxes.
+ */
+void volume_op_stroke(volume_t *volume, const painter_t *painter,
+                      const float (*boxes)[4][4], int nb);
+
+/*
+ * Function: volume_extrude
+ * Sweep a one voxel thick layer of voxels along a face normal.
+ *
+ * The volume is set to the copies of the layer moved by all the offsets
+ * in [from, to] along the normal.  The cost is proportional to the swept
+ * area.
+ *
+ * Parameters:
+ *   volume - Volume that receives the result.
+ *   layer  - Voxels to sweep.  If the layer is thicker than one voxel along
+ *            the face normal, only its outer slice is used.
+ *   face   - Index of the face (see FACES_NORMALS) giving the direction.
+ *   from   - First offset of the sweep (can be negative).
+ *   to     - Last offset of the sweep (included).
+ */
+void volume_extrude(volume_t *volume, const volume_t *layer, int face,
+                    int from, int to);
 
 /* Function: volume_blit
  *
@@ -148,14 +180,30 @@ void volume_extrude(volume_t *volume,
  *   w    - Width of the data.
  *   h    - Height of the data.
  *   d    - Depth of the data.
- *   iter - Optional iterator for optimized access.
  */
 void volume_blit(volume_t *volume, const uint8_t *data,
-               int x, int y, int z, int w, int h, int d,
-               volume_iterator_t *iter);
+               int x, int y, int z, int w, int h, int d);
 
+/* Function: volume_move
+ *
+ * Apply a transformation to a volume, resampling it with the nearest
+ * voxel.
+ *
+ * Integer translations and axis aligned rotations or flips are detected
+ * and moved tile by tile without resampling.  Tile aligned translations
+ * don't copy any voxel data.
+ */
 void volume_move(volume_t *volume, const float mat[4][4]);
 
+/* Function: volume_move_is_rigid
+ *
+ * Check if volume_move with a given matrix maps the voxels exactly, without
+ * resampling.  If so, and if geo_mat is not NULL, also output the matrix
+ * that applies the same transformation to the volume geometry (where voxel
+ * (x, y, z) spans from (x, y, z) to (x + 1, y + 1, z + 1)).
+ */
+bool volume_move_is_rigid(const float mat[4][4], float geo_mat[4][4]);
+
 void volume_shift_alpha(volume_t *volume, int v);
 
 // Compute the selection mask for a given condition.
@@ -167,6 +215,63 @@ int volume_select(const volume_t *volume,
                             volume_accessor_t *volume_accessor),
                 void *user, volume_t *selection);
 
+/*
+ * Type: volume_component_t
+ * A connected component returned by <volume_get_components>.
+ *
+ * Attributes:
+ *   volume    - The voxels of the component.
+ *   nb_voxels - Number of voxels.
+ *   aabb      - Bounding box of the voxels (max excluded).
+ */
+typedef struct {
+    volume_t *volume;
+    int nb_voxels;
+    int aabb[2][3];
+} volume_component_t;
+
+/*
+ * Function: volume_get_components
+ * Split a volume into its connected components.
+ *
+ * All the components are labelled in a single pass, so this is much
+ * faster than calling <volume_select> from each voxel.
+ *
+ * Parameters:
+ *   volume       - The input volume.
+ *   connectivity - 6 (faces), 18 (faces and edges) or 26 (faces, edges
+ *                  and corners).
+ *   threshold    - Maximum difference of any color channel between two
+ *                  connected voxels.  255 to ignore the colors.
+ *   out          - Get allocated with the components, sorted from the
+ *                  largest to the smallest.  Release with
+ *                  <volume_components_free>.
+ *
+ * Return:
+ *   The number of components.
+ */
+int volume_get_components(const volume_t *volume, int connectivity,
+                          int threshold, volume_component_t **out);
+
+/*
+ * Function: volume_components_free
+ * Release the components returned by <volume_get_components>.
+ */
+void volume_components_free(volume_component_t *comps, int nb);
+
+/*
+ * Function: volume_downsample
+ * Create a half resolution copy of a volume, for levels of detail.
+ *
+ * Each 2x2x2 block of voxels becomes a single voxel, solid if at least
+ * half of the block is solid, with the most frequent color of its solid
+ * voxels, so that no new color is introduced.
+ * Voxel (x, y, z) of the output covers voxels (2x, 2y, 2z) to
+ * (2x + 1, 2y + 1, 2z + 1) of the input.  The tiles are computed in
+ * parallel.
+ */
+volume_t *volume_downsample(const volume_t *volume);
+
 /*
  * Function: volume_merge
  * Merge a volume into an other using a given blending function.
@@ -181,6 +286,16 @@ int volume_select(const volume_t *volume,
 void volume_merge(volume_t *volume, const volume_t *other, int mode,
                 const uint8_t color[4]);
 
+/*
+ * Function: volume_merge_tile
+ * Same as <volume_merge>, but only for the tile at a given position.
+ *
+ * Unlike <volume_merge> the resulting volume is not cached, so that we can
+ * update a few tiles of a big volume without copying all its tiles.
+ */
+void volume_merge_tile(volume_t *volume, const volume_t *other,
+                       const int pos[3], int mode, const uint8_t color[4]);
+
 /*
  * Function: volume_generate_vertices
  * Generate a vertice array for rendering a volume block.
@@ -216,12 +331,104 @@ volume_mesh_t *volume_generate_mesh(
         const volume_t *volume, int effects, const palette_t *palette,
         float simplify);
 
+/*
+ * volume_generate_tiles_mesh
+ * Same as volume_generate_mesh, but only for a list of tiles positions.
+ * The simplification keeps the vertices on the borders of the tiles, so
+ * that the meshes of separate lists of tiles join without cracks.
+ */
+volume_mesh_t *volume_generate_tiles_mesh(
+        const volume_t *volume, int effects, const palette_t *palette,
+        float simplify, const int (*tiles)[3], int nb);
+
 void volume_mesh_free(volume_mesh_t *mesh);
 
+/* Function: volume_clear_aabb
+ *
+ * Remove all the voxels inside an AABB.  Tiles fully inside the box are
+ * deleted without touching their data.
+ */
+void volume_clear_aabb(volume_t *volume, const int aabb[2][3]);
+
+/* Function: volume_mirror
+ *
+ * Mirror the voxels inside an AABB along an axis.  Each non empty tile
+ * intersecting the box is read once, flipped, and written at its mirrored
+ * position, so the empty space is never visited.
+ */
+void volume_mirror(volume_t *volume, int axis, const int aabb[2][3]);
+
+/* Function: volume_wrap
+ *
+ * Move the voxels inside an AABB by one along an axis, wrapping around the
+ * box boundary.  Each non empty tile intersecting the box is read once and
+ * written back shifted, in two parts if it crosses the wrapping boundary.
+ *
+ * Parameters:
+ *   volume - The volume to modify.
+ *   axis   - The axis of the move (0, 1 or 2).
+ *   sign   - Direction of the move: 1 or -1.
+ *   aabb   - The box, max excluded.
+ */
+void volume_wrap(volume_t *volume, int axis, int sign, const int aabb[2][3]);
 
 // XXX: use int[2][3] for the box?
 void volume_crop(volume_t *volume, const float box[4][4]);
 
+/*
+ * Enum: VOLUME_MORPHO
+ * The morphology operations supported by <volume_morphology>.
+ *
+ * VOLUME_MORPHO_DILATE - Grow the volume, the new voxels take the color of
+ *                        their closest neighbor.
+ * VOLUME_MORPHO_ERODE  - Shrink the volume.
+ * VOLUME_MORPHO_OPEN   - Erode then dilate: remove the small details.
+ * VOLUME_MORPHO_CLOSE  - Dilate then erode: fill the small holes.
+ * VOLUME_MORPHO_HOLLOW - Only keep a shell of the size of the radius.
+ */
+enum {
+    VOLUME_MORPHO_DILATE,
+    VOLUME_MORPHO_ERODE,
+    VOLUME_MORPHO_OPEN,
+    VOLUME_MORPHO_CLOSE,
+    VOLUME_MORPHO_HOLLOW,
+};
+
+/*
+ * Function: volume_morphology
+ * Apply a morphology operation to a volume.
+ *
+ * Parameters:
+ *   volume - The volume to modify.
+ *   op     - One of the <VOLUME_MORPHO> enum values.
+ *   shape  - Shape of the structuring element.
+ *   radius - Radius of the structuring element, from 1 to TILE_SIZE.
+ */
+void volume_morphology(volume_t *volume, int op, const shape_t *shape,
+                       int radius);
+
+/*
+ * Function: volume_get_sdf
+ * Compute the signed distance field of a volume inside a box.
+ *
+ * The values are the euclidean distances in voxels from the voxels centers
+ * to the surface, negative inside and positive outside, clamped to
+ * max_dist.  Voxels with a non zero alpha are considered solid, as with
+ * the morphology operations, that use the field for the sphere erosion.
+ * The fields are computed per tile in parallel and cached, so calling this
+ * function again on an unchanged volume is cheap.
+ *
+ * Parameters:
+ *   volume   - The input volume.
+ *   pos      - Position of the first corner of the box.
+ *   size     - Size of the box.
+ *   max_dist - Max distance, from 0.5 to TILE_SIZE - 0.5.
+ *   out      - Output buffer of size[0] * size[1] * size[2] floats, in
+ *              xyz order.
+ */
+void volume_get_sdf(const volume_t *volume, const int pos[3],
+                    const int size[3], float max_dist, float *out);
+
 /* Function: volume_crc32
  * Compute the crc32 of the volume data as an array of xyz rgba values.
  *